@@ -0,0 +1,1375 @@
+/*
+ * scullbench.c -- userspace benchmark driver for the scull devices
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define FILL_CHUNK (1UL << 20)
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+struct bench_opts {
+  const char * path;          // device node
+  const char * pipe_path;     // scullpipe device node
+  unsigned long long size;    // device size to fill before measuring
+  size_t bsize;               // size of one I/O
+  unsigned long ops;          // number of I/Os to measure (per thread)
+  unsigned int threads;       // concurrent workers
+  unsigned int cycles;        // trim: truncate/refill cycles
+  int random;                 // random offsets rather than sequential ones
+  int overlap;                // writers share the whole device
+  int nofill;                 // reuse the current device contents
+  int format;                 // FMT_*
+  int noheader;               // no CSV header line
+};
+
+/*
+ * What a test measured; report() turns it into a line of output.
+ */
+
+struct bench_result {
+  const char * test;
+  const char * pattern;       // "seq", "rand" or "-"
+  unsigned long ops;          // operations done
+  unsigned long long bytes;   // bytes moved by them
+  double elapsed;             // wall time, ns
+  uint64_t * lat;             // latency of each operation, ns
+  size_t nlat;
+};
+
+/*
+ * parse_size - parse a byte count with an optional K, M or G suffix
+ */
+
+static unsigned long long parse_size(const char * str)
+{
+  char * end;
+  unsigned long long val;
+
+  errno = 0;
+  val = strtoull(str, &end, 0);
+  if (errno != 0 || end == str)
+  {
+    fprintf(stderr, "invalid size: %s\n", str);
+    exit(EXIT_FAILURE);
+  }
+
+  switch (*end)
+  {
+    case 'g': case 'G':
+      val <<= 10;
+      // fall through
+    case 'm': case 'M':
+      val <<= 10;
+      // fall through
+    case 'k': case 'K':
+      val <<= 10;
+      break;
+    case '\0':
+      break;
+    default:
+      fprintf(stderr, "invalid size suffix: %s\n", str);
+      exit(EXIT_FAILURE);
+  }
+
+  return val;
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift64, good enough to scatter the offsets
+static uint64_t next_rand(uint64_t * state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+
+  return x;
+}
+
+/*
+ * module_param_read - current value of a scull module parameter, so that
+ * results carry the geometry they were measured with
+ *
+ * Return:
+ * the value or -1 if the module is not loaded.
+ */
+
+static long module_param_read(const char * name)
+{
+  char path[128];
+  long val;
+  FILE * f;
+
+  snprintf(path, sizeof(path), "/sys/module/scull/parameters/%s", name);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+
+  if (fscanf(f, "%ld", &val) != 1)
+    val = -1;
+  fclose(f);
+
+  return val;
+}
+
+static int lat_cmp(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of sorted latencies, in microseconds
+static double percentile(const uint64_t * lat, size_t n, double p)
+{
+  size_t rank;
+
+  if (n == 0)
+    return 0.0;
+
+  rank = (size_t) (p * n + 0.999999);
+  if (rank == 0)
+    rank = 1;
+
+  return lat[(rank > n ? n : rank) - 1] / 1e3;
+}
+
+/*
+ * report - print a result as text, a CSV row or a JSON line, and free its
+ * latencies
+ */
+
+static void report(const struct bench_opts * opts, struct bench_result * res)
+{
+  double secs, mbs, opss, p50, p99, p999;
+  long quantum, qset;
+
+  qsort(res->lat, res->nlat, sizeof(uint64_t), lat_cmp);
+
+  secs = res->elapsed / 1e9;
+  mbs = secs > 0 ? res->bytes / secs / 1e6 : 0.0;
+  opss = secs > 0 ? res->ops / secs : 0.0;
+  p50 = percentile(res->lat, res->nlat, 0.50);
+  p99 = percentile(res->lat, res->nlat, 0.99);
+  p999 = percentile(res->lat, res->nlat, 0.999);
+  quantum = module_param_read("scull_quantum");
+  qset = module_param_read("scull_qset");
+
+  switch (opts->format)
+  {
+    case FMT_CSV:
+      if (!opts->noheader)
+        printf("test,pattern,size,bsize,threads,quantum,qset,ops,seconds,"
+               "mb_s,ops_s,p50_us,p99_us,p999_us\n");
+      printf("%s,%s,%llu,%zu,%u,%ld,%ld,%lu,%.6f,%.1f,%.1f,%.2f,%.2f,%.2f\n",
+              res->test, res->pattern, opts->size, opts->bsize, opts->threads,
+              quantum, qset, res->ops, secs, mbs, opss, p50, p99, p999);
+      break;
+    case FMT_JSON:
+      printf("{\"test\": \"%s\", \"pattern\": \"%s\", \"size\": %llu, \"bsize\": %zu, "
+             "\"threads\": %u, \"quantum\": %ld, \"qset\": %ld, \"ops\": %lu, "
+             "\"seconds\": %.6f, \"mb_s\": %.1f, \"ops_s\": %.1f, "
+             "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}\n",
+              res->test, res->pattern, opts->size, opts->bsize, opts->threads,
+              quantum, qset, res->ops, secs, mbs, opss, p50, p99, p999);
+      break;
+    default:
+      printf("%s pattern=%s size=%llu bsize=%zu threads=%u ops=%lu MB/s=%.1f ops/s=%.1f "
+             "p50=%.2fus p99=%.2fus p999=%.2fus\n",
+              res->test, res->pattern, opts->size, opts->bsize, opts->threads,
+              res->ops, mbs, opss, p50, p99, p999);
+      break;
+  }
+
+  free(res->lat);
+  res->lat = NULL;
+}
+
+/*
+ * fill_device - truncate the device and write @size bytes into it
+ */
+
+static int fill_device(const char * path, unsigned long long size)
+{
+  int fd;
+  char * buf;
+  ssize_t ret;
+  unsigned long long done;
+
+  // a write-only open trims the device
+  fd = open(path, O_WRONLY);
+  if (fd < 0)
+  {
+    perror(path);
+    return -1;
+  }
+
+  buf = malloc(FILL_CHUNK);
+  if (buf == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+  memset(buf, 0xa5, FILL_CHUNK);
+
+  for (done = 0; done < size; done += ret)
+  {
+    ret = write(fd, buf, (size - done < FILL_CHUNK) ? size - done : FILL_CHUNK);
+    if (ret <= 0)
+    {
+      perror("write");
+      free(buf);
+      close(fd);
+      return -1;
+    }
+  }
+
+  free(buf);
+  close(fd);
+
+  return 0;
+}
+
+struct io_worker {
+  pthread_t thread;
+  const struct bench_opts * opts;
+  unsigned int id;
+  uint64_t seed;
+  unsigned long cursor;       // next block of the sequential pattern
+  unsigned long done;         // completed I/Os
+  uint64_t * lat;             // latency of each I/O, ns
+  int err;
+};
+
+/*
+ * next_block - block of the next I/O of a worker, out of @nblocks; the
+ * sequential pattern starts at "cursor" and wraps around at the end
+ */
+
+static unsigned long next_block(struct io_worker * w, unsigned long nblocks)
+{
+  if (w->opts->random)
+    return next_rand(&w->seed) % nblocks;
+
+  return w->cursor++ % nblocks;
+}
+
+/*
+ * io_worker_setup - open the device and get an I/O buffer for a worker
+ */
+
+static int io_worker_setup(struct io_worker * w, int flags, char ** buf)
+{
+  int fd;
+
+  fd = open(w->opts->path, flags);
+  if (fd < 0)
+  {
+    perror(w->opts->path);
+    w->err = 1;
+    return -1;
+  }
+
+  *buf = malloc(w->opts->bsize);
+  if (*buf == NULL)
+  {
+    close(fd);
+    w->err = 1;
+    return -1;
+  }
+
+  return fd;
+}
+
+static void * pread_worker_run(void * arg)
+{
+  int fd;
+  char * buf;
+  unsigned long nblocks;
+  double start;
+  struct io_worker * w;
+  const struct bench_opts * opts;
+
+  w = arg;
+  opts = w->opts;
+
+  fd = io_worker_setup(w, O_RDONLY, &buf);
+  if (fd < 0)
+    return NULL;
+
+  nblocks = opts->size / opts->bsize;
+  // sequential readers each start at their own share of the device
+  w->cursor = nblocks / opts->threads * w->id;
+
+  for (w->done = 0; w->done < opts->ops; w->done++)
+  {
+    start = now_ns();
+    if (pread(fd, buf, opts->bsize, (off_t) next_block(w, nblocks) * opts->bsize) < 0)
+    {
+      perror("pread");
+      w->err = 1;
+      break;
+    }
+    w->lat[w->done] = now_ns() - start;
+  }
+
+  free(buf);
+  close(fd);
+
+  return NULL;
+}
+
+/*
+ * pwrite_worker_run - block aligned pwrite(), each block filled with a
+ * single byte value so that a torn block can be spotted afterwards. With
+ * @overlap every worker writes anywhere on the device, otherwise worker i
+ * only writes to the i-th slice of it.
+ */
+
+static void * pwrite_worker_run(void * arg)
+{
+  int fd;
+  char * buf;
+  unsigned long nblocks, first;
+  double start;
+  struct io_worker * w;
+  const struct bench_opts * opts;
+
+  w = arg;
+  opts = w->opts;
+
+  // O_RDWR, a write-only open would trim the device under the other workers
+  fd = io_worker_setup(w, O_RDWR, &buf);
+  if (fd < 0)
+    return NULL;
+
+  nblocks = opts->size / opts->bsize;
+  first = 0;
+  if (!opts->overlap)
+  {
+    nblocks /= opts->threads;
+    first = nblocks * w->id;
+  }
+
+  // a disjoint slice is walked from its start
+  w->cursor = opts->overlap ? nblocks / opts->threads * w->id : 0;
+
+  for (w->done = 0; w->done < opts->ops; w->done++)
+  {
+    memset(buf, (int) (next_rand(&w->seed) & 0xff), opts->bsize);
+
+    start = now_ns();
+    if (pwrite(fd, buf, opts->bsize, (off_t) (first + next_block(w, nblocks)) * opts->bsize) < 0)
+    {
+      perror("pwrite");
+      w->err = 1;
+      break;
+    }
+    w->lat[w->done] = now_ns() - start;
+  }
+
+  free(buf);
+  close(fd);
+
+  return NULL;
+}
+
+/*
+ * run_workers - run @fn on @threads threads and wait for all of them
+ *
+ * Return:
+ * 0 on success, the I/Os done, their latencies and the wall time go to
+ * @res.
+ */
+
+static int run_workers(const struct bench_opts * opts, void * (* fn)(void *),
+                       struct bench_result * res)
+{
+  unsigned int i, started;
+  int err;
+  double start;
+  struct io_worker * workers;
+
+  workers = calloc(opts->threads, sizeof(struct io_worker));
+  res->lat = malloc(opts->threads * opts->ops * sizeof(uint64_t));
+  if (workers == NULL || res->lat == NULL)
+  {
+    free(workers);
+    free(res->lat);
+    res->lat = NULL;
+    return -1;
+  }
+
+  start = now_ns();
+  for (started = 0; started < opts->threads; started++)
+  {
+    workers[started].opts = opts;
+    workers[started].id = started;
+    workers[started].seed = 0x9e3779b97f4a7c15ULL * (started + 1);
+    workers[started].lat = res->lat + (size_t) started * opts->ops;
+    if (pthread_create(&workers[started].thread, NULL, fn, workers + started))
+      break;
+  }
+
+  err = (started != opts->threads);
+  res->ops = 0;
+  res->nlat = 0;
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    err |= workers[i].err;
+    res->ops += workers[i].done;
+
+    // pack the latencies of the workers that stopped early
+    memmove(res->lat + res->nlat, workers[i].lat, workers[i].done * sizeof(uint64_t));
+    res->nlat += workers[i].done;
+  }
+  res->elapsed = now_ns() - start;
+  res->bytes = (unsigned long long) res->ops * opts->bsize;
+
+  free(workers);
+
+  return err ? -1 : 0;
+}
+
+/*
+ * bench_pread - random, block aligned pread() over the whole device, from
+ * @threads threads at once, each doing @ops reads on its own descriptor
+ */
+
+static int bench_pread(const struct bench_opts * opts)
+{
+  int err;
+  struct bench_result res = {
+    .test = "pread",
+    .pattern = opts->random ? "rand" : "seq"
+  };
+
+  if (opts->size < opts->bsize)
+  {
+    fprintf(stderr, "device size smaller than the block size\n");
+    return -1;
+  }
+
+  if (!opts->nofill && fill_device(opts->path, opts->size) < 0)
+    return -1;
+
+  err = run_workers(opts, pread_worker_run, &res);
+  if (res.lat != NULL)
+    report(opts, &res);
+
+  return err;
+}
+
+/*
+ * verify_blocks - check that every @bsize block of the device holds a
+ * single byte value, i.e. that no concurrent write got torn
+ *
+ * Return:
+ * number of torn blocks or -1 on error.
+ */
+
+static long verify_blocks(const struct bench_opts * opts)
+{
+  int fd;
+  char * buf;
+  long torn;
+  size_t i;
+  unsigned long long off;
+
+  fd = open(opts->path, O_RDONLY);
+  if (fd < 0)
+  {
+    perror(opts->path);
+    return -1;
+  }
+
+  buf = malloc(opts->bsize);
+  if (buf == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  torn = 0;
+  for (off = 0; off + opts->bsize <= opts->size; off += opts->bsize)
+  {
+    if (pread(fd, buf, opts->bsize, off) != (ssize_t) opts->bsize)
+      continue;
+
+    for (i = 1; i < opts->bsize; i++)
+    {
+      if (buf[i] != buf[0])
+      {
+        torn++;
+        break;
+      }
+    }
+  }
+
+  free(buf);
+  close(fd);
+
+  return torn;
+}
+
+/*
+ * bench_pwrite - random, block aligned pwrite() from @threads threads at
+ * once. With -o the writers overlap and the device is checked for torn
+ * blocks afterwards; use a block size dividing the quantum so that each
+ * block is written under a single quantum set lock.
+ */
+
+static int bench_pwrite(const struct bench_opts * opts)
+{
+  int err;
+  long torn;
+  struct bench_result res = {
+    .test = "pwrite",
+    .pattern = opts->random ? "rand" : "seq"
+  };
+
+  if (opts->size / opts->threads < opts->bsize)
+  {
+    fprintf(stderr, "device size too small for the block size and threads\n");
+    return -1;
+  }
+
+  if (!opts->nofill && fill_device(opts->path, opts->size) < 0)
+    return -1;
+
+  err = run_workers(opts, pwrite_worker_run, &res);
+  if (res.lat != NULL)
+    report(opts, &res);
+
+  if (opts->overlap)
+  {
+    torn = verify_blocks(opts);
+    if (torn != 0)
+    {
+      fprintf(stderr, "pwrite: %ld torn blocks\n", torn);
+      err = -1;
+    }
+  }
+
+  return err;
+}
+
+/*
+ * bench_seqread - sequential read() of the device in @bsize chunks, from
+ * the start until EOF or @ops calls
+ */
+
+static int bench_seqread(const struct bench_opts * opts)
+{
+  int fd;
+  char * buf;
+  double start, t;
+  ssize_t ret;
+  struct bench_result res = {
+    .test = "seqread",
+    .pattern = "seq"
+  };
+
+  if (!opts->nofill && fill_device(opts->path, opts->size) < 0)
+    return -1;
+
+  fd = open(opts->path, O_RDONLY);
+  if (fd < 0)
+  {
+    perror(opts->path);
+    return -1;
+  }
+
+  buf = malloc(opts->bsize);
+  res.lat = malloc(opts->ops * sizeof(uint64_t));
+  if (buf == NULL || res.lat == NULL)
+  {
+    free(buf);
+    free(res.lat);
+    close(fd);
+    return -1;
+  }
+
+  ret = 0;
+
+  start = now_ns();
+  for (res.ops = 0; res.ops < opts->ops; res.ops++)
+  {
+    t = now_ns();
+    ret = read(fd, buf, opts->bsize);
+    if (ret <= 0)
+      break;
+    res.lat[res.ops] = now_ns() - t;
+    res.bytes += ret;
+  }
+  res.elapsed = now_ns() - start;
+  res.nlat = res.ops;
+
+  if (ret < 0)
+    perror("read");
+
+  report(opts, &res);
+
+  free(buf);
+  close(fd);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * bench_mmapscan - scan the whole device once with read() and once through
+ * a shared mapping, summing every 64-bit word so both touch all the data
+ */
+
+static int bench_mmapscan(const struct bench_opts * opts)
+{
+  int fd;
+  char * buf;
+  const uint64_t * map;
+  uint64_t sum_read, sum_map;
+  size_t i, n, len;
+  double start, t_read, t_map;
+  ssize_t ret;
+
+  if (!opts->nofill && fill_device(opts->path, opts->size) < 0)
+    return -1;
+
+  fd = open(opts->path, O_RDONLY);
+  if (fd < 0)
+  {
+    perror(opts->path);
+    return -1;
+  }
+
+  buf = malloc(opts->bsize);
+  if (buf == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  len = opts->size;
+  sum_read = 0;
+
+  start = now_ns();
+  while ((ret = read(fd, buf, opts->bsize)) > 0)
+  {
+    n = ret / sizeof(uint64_t);
+    for (i = 0; i < n; i++)
+      sum_read += ((const uint64_t *) buf)[i];
+  }
+  t_read = now_ns() - start;
+
+  map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    perror("mmap (is scull_quantum a multiple of the page size?)");
+    free(buf);
+    close(fd);
+    return -1;
+  }
+
+  sum_map = 0;
+  n = len / sizeof(uint64_t);
+
+  start = now_ns();
+  for (i = 0; i < n; i++)
+    sum_map += map[i];
+  t_map = now_ns() - start;
+
+  printf("mmapscan size=%llu bsize=%zu read MB/s=%.1f mmap MB/s=%.1f%s\n",
+          opts->size, opts->bsize, (double) len / (t_read / 1e9) / 1e6,
+          (double) len / (t_map / 1e9) / 1e6,
+          (sum_read == sum_map) ? "" : " (checksum mismatch)");
+
+  munmap((void *) map, len);
+  free(buf);
+  close(fd);
+
+  return 0;
+}
+
+/*
+ * loopback_pair - a connected TCP pair over 127.0.0.1
+ *
+ * Return:
+ * 0 on success or -1 on error.
+ */
+
+static int loopback_pair(int * tx, int * rx)
+{
+  int lfd;
+  struct sockaddr_in addr;
+  socklen_t alen;
+
+  *tx = *rx = -1;
+
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lfd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  alen = sizeof(addr);
+
+  if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0 ||
+      getsockname(lfd, (struct sockaddr *) &addr, &alen) < 0)
+    goto failed;
+
+  *tx = socket(AF_INET, SOCK_STREAM, 0);
+  if (*tx < 0 || connect(*tx, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    goto failed;
+
+  *rx = accept(lfd, NULL, NULL);
+  if (*rx < 0)
+    goto failed;
+
+  close(lfd);
+  return 0;
+
+failed:
+  perror("loopback socket");
+  if (*tx >= 0)
+    close(*tx);
+  close(lfd);
+  *tx = -1;
+  return -1;
+}
+
+// receiving end of the socket, throws the data away until EOF
+static void * sock_drain_run(void * arg)
+{
+  char buf[1 << 16];
+  int fd;
+
+  fd = *(int *) arg;
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+
+  return NULL;
+}
+
+/*
+ * stream_to_socket - send the device from the start to a loopback socket,
+ * with read() + write() or with sendfile(), @bsize bytes per call, and
+ * time it until the receiver saw the last byte
+ */
+
+static int stream_to_socket(const struct bench_opts * opts, int use_sendfile,
+                            struct bench_result * res)
+{
+  int fd, tx, rx;
+  char * buf;
+  ssize_t ret, sent, n;
+  double start, t;
+  pthread_t drain;
+
+  buf = malloc(opts->bsize);
+  res->lat = malloc(opts->ops * sizeof(uint64_t));
+  if (buf == NULL || res->lat == NULL)
+    goto nomem;
+
+  fd = open(opts->path, O_RDONLY);
+  if (fd < 0)
+  {
+    perror(opts->path);
+    goto nomem;
+  }
+
+  if (loopback_pair(&tx, &rx) < 0)
+  {
+    close(fd);
+    goto nomem;
+  }
+
+  if (pthread_create(&drain, NULL, sock_drain_run, &rx))
+  {
+    close(tx);
+    close(rx);
+    close(fd);
+    goto nomem;
+  }
+
+  ret = 0;
+
+  start = now_ns();
+  for (res->ops = 0; res->ops < opts->ops; res->ops++)
+  {
+    t = now_ns();
+    if (use_sendfile)
+    {
+      ret = sendfile(tx, fd, NULL, opts->bsize);
+    }
+    else
+    {
+      ret = read(fd, buf, opts->bsize);
+      for (sent = 0; (ret > 0) && (sent < ret); sent += n)
+      {
+        n = write(tx, buf + sent, ret - sent);
+        if (n < 0)
+        {
+          ret = -1;
+          break;
+        }
+      }
+    }
+    if (ret <= 0)
+      break;
+    res->lat[res->ops] = now_ns() - t;
+    res->bytes += ret;
+  }
+
+  shutdown(tx, SHUT_WR);
+  pthread_join(drain, NULL);
+  res->elapsed = now_ns() - start;
+  res->nlat = res->ops;
+
+  if (ret < 0)
+    perror(use_sendfile ? "sendfile" : "read/write");
+
+  close(tx);
+  close(rx);
+  close(fd);
+  free(buf);
+
+  return (ret < 0) ? -1 : 0;
+
+nomem:
+  free(buf);
+  free(res->lat);
+  res->lat = NULL;
+  return -1;
+}
+
+/*
+ * bench_sendfile - ship the device over loopback TCP once with a read() +
+ * write() loop and once with sendfile(), which goes through splice_read()
+ * and, with page-backed quanta, does not copy the data out of the device
+ */
+
+static int bench_sendfile(const struct bench_opts * opts)
+{
+  int err;
+  struct bench_result rw = {
+    .test = "sockrw",
+    .pattern = "seq"
+  };
+  struct bench_result sf = {
+    .test = "sendfile",
+    .pattern = "seq"
+  };
+  struct bench_opts sf_opts;
+
+  if (!opts->nofill && fill_device(opts->path, opts->size) < 0)
+    return -1;
+
+  err = stream_to_socket(opts, 0, &rw);
+  if (rw.lat != NULL)
+    report(opts, &rw);
+  if (err)
+    return -1;
+
+  // one CSV header for both rows
+  sf_opts = *opts;
+  sf_opts.noheader = 1;
+
+  err = stream_to_socket(opts, 1, &sf);
+  if (sf.lat != NULL)
+    report(opts->format == FMT_CSV ? &sf_opts : opts, &sf);
+
+  return err;
+}
+
+/*
+ * fifo_open - the two ends of a scullpipe device, or of a kernel pipe
+ *
+ * Return:
+ * 0 on success or -1 on error.
+ */
+
+static int fifo_open(const struct bench_opts * opts, int scull, int * rfd, int * wfd)
+{
+  int fds[2];
+  char buf[4096];
+
+  if (!scull)
+  {
+    if (pipe(fds) < 0)
+    {
+      perror("pipe");
+      return -1;
+    }
+    *rfd = fds[0];
+    *wfd = fds[1];
+    return 0;
+  }
+
+  *rfd = open(opts->pipe_path, O_RDONLY | O_NONBLOCK);
+  *wfd = open(opts->pipe_path, O_WRONLY);
+  if (*rfd < 0 || *wfd < 0)
+  {
+    perror(opts->pipe_path);
+    if (*rfd >= 0)
+      close(*rfd);
+    if (*wfd >= 0)
+      close(*wfd);
+    return -1;
+  }
+
+  // whatever an earlier run left in the ring
+  while (read(*rfd, buf, sizeof(buf)) > 0)
+    ;
+  fcntl(*rfd, F_SETFL, 0);
+
+  return 0;
+}
+
+struct fifo_reader {
+  pthread_t thread;
+  int fd;
+  size_t bsize;
+  unsigned long long want;    // bytes to read before stopping
+  unsigned long long got;
+  uint64_t * lat;             // wakeup latencies, if not NULL
+  volatile unsigned long seen; // messages received so far
+};
+
+// read until "want" bytes came through the fifo or it hit EOF
+static void * fifo_reader_run(void * arg)
+{
+  char * buf;
+  double sent;
+  ssize_t ret;
+  struct fifo_reader * r;
+
+  r = arg;
+  buf = malloc(r->bsize);
+  if (buf == NULL)
+    return NULL;
+
+  while (r->got < r->want)
+  {
+    ret = read(r->fd, buf, r->bsize);
+    if (ret <= 0)
+      break;
+    r->got += ret;
+
+    if (r->lat != NULL)
+    {
+      // the writer sent the time of the write
+      memcpy(&sent, buf, sizeof(sent));
+      r->lat[r->seen] = now_ns() - sent;
+      __atomic_store_n(&r->seen, r->seen + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/*
+ * fifo_stream - @ops writes of @bsize bytes through a fifo, to a reader
+ * thread reading @bsize at a time
+ */
+
+static int fifo_stream(const struct bench_opts * opts, int scull, struct bench_result * res)
+{
+  int rfd, wfd, started;
+  char * buf;
+  double start, t;
+  ssize_t ret;
+  struct fifo_reader r;
+
+  res->test = "fifo";
+  res->pattern = scull ? "scull" : "pipe";
+
+  buf = malloc(opts->bsize);
+  res->lat = malloc(opts->ops * sizeof(uint64_t));
+  if (buf == NULL || res->lat == NULL || fifo_open(opts, scull, &rfd, &wfd) < 0)
+  {
+    free(buf);
+    free(res->lat);
+    res->lat = NULL;
+    return -1;
+  }
+  memset(buf, 0x5a, opts->bsize);
+
+  memset(&r, 0, sizeof(r));
+  r.fd = rfd;
+  r.bsize = opts->bsize;
+  r.want = (unsigned long long) opts->ops * opts->bsize;
+
+  start = now_ns();
+  started = !pthread_create(&r.thread, NULL, fifo_reader_run, &r);
+  ret = started ? 0 : -1;
+
+  for (res->ops = 0; (ret >= 0) && (res->ops < opts->ops); res->ops++)
+  {
+    t = now_ns();
+    ret = write(wfd, buf, opts->bsize);
+    if (ret < 0)
+      break;
+    res->lat[res->ops] = now_ns() - t;
+    res->bytes += ret;
+  }
+
+  // the reader sees the end of file once the last writer is gone
+  close(wfd);
+  if (started)
+    pthread_join(r.thread, NULL);
+  res->elapsed = now_ns() - start;
+  res->nlat = res->ops;
+
+  if (ret < 0)
+    perror("write");
+
+  close(rfd);
+  free(buf);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * fifo_wakeup - @ops one-message round trips: the reader sleeps on an
+ * empty fifo, the writer sends it the current time, the reader measures
+ * how long it took to wake up with it
+ */
+
+static int fifo_wakeup(const struct bench_opts * opts, int scull, struct bench_result * res)
+{
+  int rfd, wfd;
+  double start, now;
+  unsigned long i;
+  struct fifo_reader r;
+
+  res->test = "fifowake";
+  res->pattern = scull ? "scull" : "pipe";
+
+  res->lat = malloc(opts->ops * sizeof(uint64_t));
+  if (res->lat == NULL || fifo_open(opts, scull, &rfd, &wfd) < 0)
+  {
+    free(res->lat);
+    res->lat = NULL;
+    return -1;
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.fd = rfd;
+  r.bsize = sizeof(now);
+  r.want = (unsigned long long) opts->ops * sizeof(now);
+  r.lat = res->lat;
+
+  if (pthread_create(&r.thread, NULL, fifo_reader_run, &r))
+  {
+    free(res->lat);
+    res->lat = NULL;
+    close(rfd);
+    close(wfd);
+    return -1;
+  }
+
+  start = now_ns();
+  for (i = 0; i < opts->ops; i++)
+  {
+    // give the reader time to go back to sleep
+    while (__atomic_load_n(&r.seen, __ATOMIC_ACQUIRE) != i)
+      ;
+    usleep(50);
+
+    now = now_ns();
+    if (write(wfd, &now, sizeof(now)) != sizeof(now))
+    {
+      perror("write");
+      break;
+    }
+  }
+
+  close(wfd);
+  pthread_join(r.thread, NULL);
+  res->elapsed = now_ns() - start;
+  res->ops = r.seen;
+  res->nlat = r.seen;
+  res->bytes = r.got;
+
+  close(rfd);
+
+  return (i == opts->ops) ? 0 : -1;
+}
+
+/*
+ * bench_fifo - throughput and wakeup latency of a scullpipe device next
+ * to a kernel pipe
+ */
+
+static int bench_fifo(const struct bench_opts * opts)
+{
+  int scull, err, first;
+  struct bench_opts ropts;
+  struct bench_result res;
+
+  // one CSV header for all the rows
+  ropts = *opts;
+  first = 1;
+  err = 0;
+
+  for (scull = 1; scull >= 0; scull--)
+  {
+    memset(&res, 0, sizeof(res));
+    err |= fifo_stream(opts, scull, &res);
+    if (res.lat != NULL)
+    {
+      report(&ropts, &res);
+      ropts.noheader |= first;
+      first = 0;
+    }
+
+    memset(&res, 0, sizeof(res));
+    err |= fifo_wakeup(opts, scull, &res);
+    if (res.lat != NULL)
+    {
+      report(&ropts, &res);
+      ropts.noheader |= first;
+      first = 0;
+    }
+  }
+
+  return err ? -1 : 0;
+}
+
+/*
+ * bench_trim - truncate/refill cycles: fill the device, then time the
+ * write-only open that empties it, @cycles times. Throughput is bytes
+ * trimmed per second of open().
+ */
+
+static int bench_trim(const struct bench_opts * opts)
+{
+  int fd;
+  unsigned int i;
+  double start;
+  struct bench_result res = {
+    .test = "trim",
+    .pattern = "-"
+  };
+
+  res.lat = malloc(opts->cycles * sizeof(uint64_t));
+  if (res.lat == NULL)
+    return -1;
+
+  for (i = 0; i < opts->cycles; i++)
+  {
+    if (fill_device(opts->path, opts->size) < 0)
+      break;
+
+    start = now_ns();
+    fd = open(opts->path, O_WRONLY);
+    res.lat[i] = now_ns() - start;
+    if (fd < 0)
+    {
+      perror(opts->path);
+      break;
+    }
+    close(fd);
+
+    res.elapsed += res.lat[i];
+    res.bytes += opts->size;
+  }
+  res.ops = i;
+  res.nlat = i;
+
+  report(opts, &res);
+
+  return (i == opts->cycles) ? 0 : -1;
+}
+
+static void usage(const char * prog)
+{
+  fprintf(stderr,
+          "Usage: %s <test> [-d device] [-P pipe] [-s size] [-b bsize] [-n ops] [-t threads]\n"
+          "          [-p seq|rand] [-c cycles] [-f text|csv|json] [-H] [-o] [-N]\n"
+          "tests:\n"
+          "  pread     block aligned pread() over a filled device\n"
+          "  pwrite    block aligned pwrite() from several threads\n"
+          "  seqread   sequential read() from the start until EOF (or -n calls)\n"
+          "  mmapscan  scan the device with read() and with mmap(), compare\n"
+          "  trim      truncate/refill cycles, time the write-only open\n"
+          "  sendfile  send the device to a loopback socket, read()/write() vs sendfile()\n"
+          "  fifo      scullpipe throughput and wakeup latency, next to a kernel pipe\n"
+          "options:\n"
+          "  -d        device node (default /dev/scull0)\n"
+          "  -P        scullpipe device node (default /dev/scullpipe0)\n"
+          "  -s        device size, K/M/G suffix allowed (default 1M)\n"
+          "  -b        I/O size, K/M/G suffix allowed (default 4000)\n"
+          "  -n        number of measured I/Os per thread (default 100000)\n"
+          "  -t        number of threads, pread and pwrite only (default 1)\n"
+          "  -p        pread and pwrite offsets, sequential or random (default rand)\n"
+          "  -c        number of trim cycles (default 1)\n"
+          "  -f        output format (default text)\n"
+          "  -H        no CSV header line\n"
+          "  -o        pwrite threads overlap, check for torn blocks afterwards\n"
+          "  -N        do not refill the device, reuse its contents\n",
+          prog);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  const char * test;
+  struct bench_opts opts = {
+    .path = "/dev/scull0",
+    .pipe_path = "/dev/scullpipe0",
+    .size = 1UL << 20,
+    .bsize = 4000,
+    .ops = 100000,
+    .threads = 1,
+    .cycles = 1,
+    .random = 1,
+    .overlap = 0,
+    .nofill = 0,
+    .format = FMT_TEXT,
+    .noheader = 0
+  };
+
+  if (argc < 2)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  test = argv[1];
+  optind = 2;
+
+  while ((opt = getopt(argc, argv, "d:P:s:b:n:t:p:c:f:HoN")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd':
+        opts.path = optarg;
+        break;
+      case 'P':
+        opts.pipe_path = optarg;
+        break;
+      case 's':
+        opts.size = parse_size(optarg);
+        break;
+      case 'b':
+        opts.bsize = parse_size(optarg);
+        break;
+      case 'n':
+        opts.ops = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        opts.threads = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        if (strcmp(optarg, "seq") == 0)
+          opts.random = 0;
+        else if (strcmp(optarg, "rand") == 0)
+          opts.random = 1;
+        else
+        {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        opts.cycles = strtoul(optarg, NULL, 0);
+        break;
+      case 'f':
+        if (strcmp(optarg, "text") == 0)
+          opts.format = FMT_TEXT;
+        else if (strcmp(optarg, "csv") == 0)
+          opts.format = FMT_CSV;
+        else if (strcmp(optarg, "json") == 0)
+          opts.format = FMT_JSON;
+        else
+        {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'H':
+        opts.noheader = 1;
+        break;
+      case 'o':
+        opts.overlap = 1;
+        break;
+      case 'N':
+        opts.nofill = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (opts.bsize == 0 || opts.ops == 0 || opts.threads == 0 || opts.cycles == 0)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(test, "pread") == 0)
+    return bench_pread(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (strcmp(test, "pwrite") == 0)
+    return bench_pwrite(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (strcmp(test, "seqread") == 0)
+    return bench_seqread(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (strcmp(test, "mmapscan") == 0)
+    return bench_mmapscan(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (strcmp(test, "trim") == 0)
+    return bench_trim(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (strcmp(test, "sendfile") == 0)
+    return bench_sendfile(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (strcmp(test, "fifo") == 0)
+    return bench_fifo(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  usage(argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,424 @@
+/*
+ * sleepybench.c -- wakeup rate of the sleepy device with many sleepers
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * wakeup: for each number of sleepers, that many threads block in read()
+ * on one device; every round, one 8-byte write() of that number hands each
+ * of them a token, and the round ends when all of them came back. Context
+ * switches are those of the whole process (getrusage()), per wakeup: with
+ * exclusive wakeups it stays close to one, a thundering herd makes it
+ * grow with the sleepers.
+ *
+ * epoll: for each number of devices, one event loop thread waits on all of
+ * them with epoll; every round, the main thread adds 1 to one of them and
+ * times how long the loop takes to read it back. The same runs against as
+ * many eventfds.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+struct bench_opts {
+  const char * prefix;        // device nodes, without the minor
+  unsigned int rounds;        // writes per run
+  const char * counts;        // list of sleeper or device counts
+};
+
+static volatile int done;             // the sleepers should exit
+static unsigned long woken;           // reads that returned, all threads
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int dev_open(const struct bench_opts * opts, unsigned int minor, int flags)
+{
+  int fd;
+  char path[256];
+
+  snprintf(path, sizeof(path), "%s%u", opts->prefix, minor);
+  fd = open(path, flags);
+  if (fd < 0)
+    perror(path);
+
+  return fd;
+}
+
+static int lat_cmp(const void * a, const void * b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of sorted latencies, in microseconds
+static double percentile(const double * lat, size_t n, double p)
+{
+  size_t rank;
+
+  if (n == 0)
+    return 0.0;
+
+  rank = (size_t) (p * n + 0.999999);
+  if (rank == 0)
+    rank = 1;
+
+  return lat[(rank > n ? n : rank) - 1] / 1e3;
+}
+
+static void * sleeper_run(void * arg)
+{
+  char c;
+  int fd;
+
+  fd = *(int *) arg;
+
+  while (!done)
+  {
+    if (read(fd, &c, 1) < 0 && errno != EINTR)
+    {
+      perror("read");
+      break;
+    }
+    __atomic_add_fetch(&woken, 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+// context switches of the process so far, voluntary or not
+static long ctx_switches(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+// wait until @n reads have returned
+static void wait_woken(unsigned long n)
+{
+  while (__atomic_load_n(&woken, __ATOMIC_ACQUIRE) < n)
+    sched_yield();
+}
+
+/*
+ * bench_sleepers - @rounds rounds of waking up @n sleepers at once
+ */
+
+static int bench_sleepers(const struct bench_opts * opts, unsigned int n)
+{
+  int fd, err;
+  uint64_t tokens;
+  unsigned int i, started;
+  long ctx;
+  double start, elapsed;
+  pthread_t * threads;
+
+  fd = dev_open(opts, 0, O_RDWR);
+  if (fd < 0)
+    return -1;
+
+  threads = calloc(n, sizeof(pthread_t));
+  if (threads == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+  tokens = n;
+
+  done = 0;
+  woken = 0;
+  err = 0;
+
+  for (started = 0; started < n; started++)
+  {
+    if (pthread_create(threads + started, NULL, sleeper_run, &fd))
+      break;
+  }
+  if (started != n)
+  {
+    fprintf(stderr, "only %u sleepers started\n", started);
+    err = -1;
+    n = started;
+  }
+
+  // let them all block in read() before measuring
+  usleep(100000);
+
+  ctx = ctx_switches();
+  start = now_ns();
+  for (i = 1; i <= opts->rounds; i++)
+  {
+    if (write(fd, &tokens, sizeof(tokens)) != sizeof(tokens))
+    {
+      perror("write");
+      err = -1;
+      break;
+    }
+    wait_woken((unsigned long) i * n);
+  }
+  elapsed = now_ns() - start;
+  ctx = ctx_switches() - ctx;
+
+  printf("sleepers=%u rounds=%u wakeups=%lu wakeups/s=%.1f ctxsw/wakeup=%.2f\n",
+          n, i - 1, woken, woken / (elapsed / 1e9),
+          woken ? (double) ctx / woken : 0.0);
+
+  // one more token each to get the threads out of read()
+  done = 1;
+  if (n != 0 && write(fd, &tokens, sizeof(tokens)) != sizeof(tokens))
+    perror("write");
+  for (i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  close(fd);
+
+  return err;
+}
+
+struct event_loop {
+  pthread_t thread;
+  int epfd;
+  int * fds;
+  double * lat;               // wakeup latency of each round, ns
+  volatile double sent;       // when the current round was written
+  unsigned long seen;         // rounds read back so far
+  volatile int stop;
+};
+
+static void * event_loop_run(void * arg)
+{
+  int i, n;
+  uint64_t value;
+  struct epoll_event events[64];
+  struct event_loop * loop;
+
+  loop = arg;
+
+  while (!loop->stop)
+  {
+    n = epoll_wait(loop->epfd, events, 64, -1);
+    for (i = 0; i < n; i++)
+    {
+      if (read(loop->fds[events[i].data.u32], &value, sizeof(value)) != sizeof(value))
+        continue;
+
+      loop->lat[loop->seen] = now_ns() - loop->sent;
+      __atomic_store_n(&loop->seen, loop->seen + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * bench_epoll - @rounds single wakeups of an event loop waiting on @n
+ * sleepy devices, or on @n eventfds
+ */
+
+static int bench_epoll(const struct bench_opts * opts, unsigned int n, int sleepy)
+{
+  int err;
+  unsigned int i, opened;
+  uint64_t one;
+  struct epoll_event ev;
+  struct event_loop loop;
+
+  memset(&loop, 0, sizeof(loop));
+  opened = 0;
+  loop.fds = calloc(n, sizeof(int));
+  loop.lat = malloc((opts->rounds + 1) * sizeof(double));
+  loop.epfd = epoll_create1(0);
+  err = -1;
+  if (loop.fds == NULL || loop.lat == NULL || loop.epfd < 0)
+    goto out;
+
+  for (opened = 0; opened < n; opened++)
+  {
+    if (sleepy)
+      loop.fds[opened] = dev_open(opts, opened, O_RDWR | O_NONBLOCK);
+    else
+      loop.fds[opened] = eventfd(0, EFD_NONBLOCK);
+    if (loop.fds[opened] < 0)
+      goto out;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = opened;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.fds[opened], &ev) < 0)
+    {
+      perror("epoll_ctl");
+      close(loop.fds[opened]);
+      goto out;
+    }
+  }
+
+  if (pthread_create(&loop.thread, NULL, event_loop_run, &loop))
+    goto out;
+
+  one = 1;
+  err = 0;
+  for (i = 0; i < opts->rounds; i++)
+  {
+    // give the loop time to go back to sleep in epoll_wait()
+    usleep(50);
+
+    loop.sent = now_ns();
+    if (write(loop.fds[i % n], &one, sizeof(one)) != sizeof(one))
+    {
+      perror("write");
+      err = -1;
+      break;
+    }
+
+    while (__atomic_load_n(&loop.seen, __ATOMIC_ACQUIRE) != i + 1)
+      ;
+  }
+
+  loop.stop = 1;
+  if (write(loop.fds[0], &one, sizeof(one)) != sizeof(one))
+    perror("write");
+  pthread_join(loop.thread, NULL);
+
+  qsort(loop.lat, i, sizeof(double), lat_cmp);
+  printf("epoll kind=%s fds=%u rounds=%u p50=%.2fus p99=%.2fus p999=%.2fus\n",
+          sleepy ? "sleepy" : "eventfd", n, i, percentile(loop.lat, i, 0.50),
+          percentile(loop.lat, i, 0.99), percentile(loop.lat, i, 0.999));
+
+out:
+  if (err && loop.fds != NULL && opened != n)
+    fprintf(stderr, "could not wait on %u devices\n", n);
+  while (loop.fds != NULL && opened > 0)
+    close(loop.fds[--opened]);
+  if (loop.epfd >= 0)
+    close(loop.epfd);
+  free(loop.fds);
+  free(loop.lat);
+
+  return err;
+}
+
+static void usage(const char * prog)
+{
+  fprintf(stderr,
+          "Usage: %s <test> [-d prefix] [-r rounds] [-s counts]\n"
+          "tests:\n"
+          "  wakeup    wake many readers blocked on one device\n"
+          "  epoll     wake an epoll loop waiting on many devices, next to eventfd\n"
+          "options:\n"
+          "  -d        device nodes, without the minor (default /dev/sleepy)\n"
+          "  -r        number of wakeup rounds per run (default 1000)\n"
+          "  -s        comma separated sleeper counts (wakeup) or device counts\n"
+          "            (epoll, load sleepy with that many sleepy_nr_devs)\n"
+          "            (default 1,100,1000)\n",
+          prog);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt, err;
+  char * list, * tok, * save;
+  const char * test;
+  unsigned long n;
+  struct bench_opts opts = {
+    .prefix = "/dev/sleepy",
+    .rounds = 1000,
+    .counts = "1,100,1000"
+  };
+
+  if (argc < 2 || (strcmp(argv[1], "wakeup") != 0 && strcmp(argv[1], "epoll") != 0))
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  test = argv[1];
+  optind = 2;
+
+  while ((opt = getopt(argc, argv, "d:r:s:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd':
+        opts.prefix = optarg;
+        break;
+      case 'r':
+        opts.rounds = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        opts.counts = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (opts.rounds == 0)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  list = strdup(opts.counts);
+  if (list == NULL)
+    return EXIT_FAILURE;
+
+  err = 0;
+  for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+  {
+    n = strtoul(tok, NULL, 0);
+    if (n == 0)
+    {
+      usage(argv[0]);
+      err = -1;
+      break;
+    }
+    if (strcmp(test, "wakeup") == 0)
+    {
+      err |= bench_sleepers(&opts, n);
+      continue;
+    }
+
+    err |= bench_epoll(&opts, n, 1);
+    err |= bench_epoll(&opts, n, 0);
+  }
+
+  free(list);
+
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
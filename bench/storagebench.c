@@ -0,0 +1,427 @@
+/*
+ * storagebench.c -- microbenchmark of the scull storage engine, built in
+ * userspace against scull_shim.h
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The read and write paths run exactly as in the module, minus the
+ * syscall and the user copy, so changes to the offset math, the index or
+ * the locking can be profiled with perf and full symbols, no root needed.
+ */
+
+#include "scull_shim.h"
+#include "scull.h"
+
+#include <unistd.h>
+
+// the module parameters storage.c reads
+unsigned int scull_quantum = SCULL_QUANTUM;
+unsigned int scull_qset = SCULL_QSET;
+unsigned int scull_pool_max = SCULL_POOL_MAX;
+unsigned long scull_max_bytes = SCULL_MAX_BYTES;
+unsigned long scull_global_max_bytes = SCULL_GLOBAL_MAX_BYTES;
+unsigned int scull_compress_ms = SCULL_COMPRESS_MS;
+bool scull_dedup = SCULL_DEDUP;
+bool scull_log = SCULL_LOG;
+
+struct bench_opts {
+  unsigned long long size;    // device size to fill before measuring
+  size_t bsize;               // size of one I/O
+  unsigned long ops;          // number of I/Os to measure (per thread)
+  unsigned int threads;       // concurrent workers
+};
+
+static struct scull_dev bench_dev;
+
+static unsigned long long parse_size(const char * str)
+{
+  char * end;
+  unsigned long long val;
+
+  errno = 0;
+  val = strtoull(str, &end, 0);
+  if (errno != 0 || end == str)
+  {
+    fprintf(stderr, "invalid size: %s\n", str);
+    exit(EXIT_FAILURE);
+  }
+
+  switch (*end)
+  {
+    case 'g': case 'G':
+      val <<= 10;
+      // fall through
+    case 'm': case 'M':
+      val <<= 10;
+      // fall through
+    case 'k': case 'K':
+      val <<= 10;
+      break;
+    case '\0':
+      break;
+    default:
+      fprintf(stderr, "invalid size suffix: %s\n", str);
+      exit(EXIT_FAILURE);
+  }
+
+  return val;
+}
+
+// xorshift64, good enough to scatter the offsets
+static uint64_t next_rand(uint64_t * state)
+{
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+
+  return x;
+}
+
+/*
+ * dev_io - one read or write through the same entry points as the VFS,
+ * @flags being the IOCB_* flags an O_APPEND file would set
+ */
+
+static ssize_t dev_io(struct file * flip, loff_t pos, void * buf, size_t len, bool write,
+                      int flags)
+{
+  struct kiocb iocb;
+  struct iov_iter iter;
+
+  iocb.ki_filp = flip;
+  iocb.ki_pos = pos;
+  iocb.ki_flags = flags;
+  iov_iter_shim_init(&iter, buf, len);
+
+  return write ? scull_write_iter(&iocb, &iter) : scull_read_iter(&iocb, &iter);
+}
+
+/*
+ * dev_file_open - the per open file state scull_open() would set up
+ */
+
+static void dev_file_open(struct file * flip, struct scull_file * sf)
+{
+  memset(sf, 0, sizeof(struct scull_file));
+  sf->dev = &bench_dev;
+  spin_lock_init(&sf->lock);
+  flip->private_data = sf;
+}
+
+/*
+ * fill_device - trim the device and write @size bytes into it
+ */
+
+static int fill_device(unsigned long long size)
+{
+  char * buf;
+  ssize_t ret;
+  unsigned long long done;
+  struct file flip;
+  struct scull_file sf;
+
+  scull_lock_write(&bench_dev);
+  scull_trim(&bench_dev);
+  up_write(&bench_dev.rwsem);
+  scull_storage_flush();
+
+  buf = malloc(1UL << 20);
+  if (buf == NULL)
+    return -1;
+  memset(buf, 0xa5, 1UL << 20);
+
+  dev_file_open(&flip, &sf);
+  for (done = 0; done < size; done += ret)
+  {
+    ret = dev_io(&flip, done, buf, min_t(unsigned long long, size - done, 1UL << 20), true,
+                 0);
+    if (ret <= 0)
+    {
+      fprintf(stderr, "fill: %zd\n", ret);
+      free(buf);
+      return -1;
+    }
+  }
+
+  free(buf);
+
+  return 0;
+}
+
+struct io_worker {
+  pthread_t thread;
+  const struct bench_opts * opts;
+  bool write;
+  bool random;
+  bool append;                // writes go to the tail, whatever "pos" is
+  uint64_t seed;
+  unsigned long done;         // completed I/Os
+  int err;
+};
+
+/*
+ * io_worker_run - @ops block aligned I/Os, one after the other or at
+ * random offsets, or appends, all on a file of its own
+ */
+
+static void * io_worker_run(void * arg)
+{
+  char * buf;
+  loff_t pos;
+  unsigned long nblocks;
+  struct file flip;
+  struct scull_file sf;
+  struct io_worker * w;
+  const struct bench_opts * opts;
+
+  w = arg;
+  opts = w->opts;
+
+  buf = malloc(opts->bsize);
+  if (buf == NULL)
+  {
+    w->err = 1;
+    return NULL;
+  }
+  memset(buf, 0x5a, opts->bsize);
+
+  dev_file_open(&flip, &sf);
+  nblocks = opts->size / opts->bsize;
+  pos = 0;
+
+  for (w->done = 0; w->done < opts->ops; w->done++)
+  {
+    if (w->random)
+      pos = (loff_t) (next_rand(&w->seed) % nblocks) * opts->bsize;
+    else if (pos + opts->bsize > opts->size)
+      pos = 0;
+
+    if (dev_io(&flip, pos, buf, opts->bsize, w->write, w->append ? IOCB_APPEND : 0) < 0)
+    {
+      w->err = 1;
+      break;
+    }
+
+    pos += opts->bsize;
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/*
+ * bench_io - run @threads workers at once and report the throughput
+ */
+
+static int bench_io(const char * name, const struct bench_opts * opts, bool write,
+                    bool random, bool append)
+{
+  unsigned int i, started;
+  unsigned long total;
+  u64 start, elapsed;
+  int err;
+  struct io_worker * workers;
+
+  if (!append && (opts->size < opts->bsize))
+  {
+    fprintf(stderr, "device size smaller than the block size\n");
+    return -1;
+  }
+
+  // appends start from an empty device and grow it
+  if (fill_device(append ? 0 : opts->size) < 0)
+    return -1;
+
+  workers = calloc(opts->threads, sizeof(struct io_worker));
+  if (workers == NULL)
+    return -1;
+
+  start = ktime_get_ns();
+  for (started = 0; started < opts->threads; started++)
+  {
+    workers[started].opts = opts;
+    workers[started].write = write;
+    workers[started].random = random;
+    workers[started].append = append;
+    workers[started].seed = 0x9e3779b97f4a7c15ULL * (started + 1);
+    if (pthread_create(&workers[started].thread, NULL, io_worker_run, workers + started))
+      break;
+  }
+
+  err = (started != opts->threads);
+  total = 0;
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    err |= workers[i].err;
+    total += workers[i].done;
+  }
+  elapsed = ktime_get_ns() - start;
+
+  printf("%s quantum=%u qset=%u size=%llu bsize=%zu threads=%u ops=%lu ns/op=%.1f "
+          "ops/s=%.0f MB/s=%.1f\n",
+          name, bench_dev.quantum, bench_dev.qset,
+          append ? (unsigned long long) atomic_long_read(&bench_dev.size) : opts->size,
+          opts->bsize, started, total, total ? (double) elapsed / total * started : 0.0,
+          total / ((double) elapsed / 1e9),
+          (double) total * opts->bsize / ((double) elapsed / 1e9) / 1e6);
+  printf("  follow=%lu cursor_hits=%lu quantum_alloc=%lu log_waits=%lu\n",
+          bench_dev.stats->count[SCULL_STAT_FOLLOW],
+          bench_dev.stats->count[SCULL_STAT_CURSOR_HITS],
+          bench_dev.stats->count[SCULL_STAT_QUANTUM_ALLOC],
+          bench_dev.stats->count[SCULL_STAT_LOG_WAITS]);
+
+  free(workers);
+
+  return err ? -1 : 0;
+}
+
+/*
+ * bench_trim - time emptying a filled device, waiting for the deferred
+ * release too, so this is the full cost of freeing it
+ */
+
+static int bench_trim(const struct bench_opts * opts)
+{
+  u64 start, elapsed;
+
+  if (fill_device(opts->size) < 0)
+    return -1;
+
+  start = ktime_get_ns();
+  scull_lock_write(&bench_dev);
+  scull_trim(&bench_dev);
+  up_write(&bench_dev.rwsem);
+  scull_storage_flush();
+  elapsed = ktime_get_ns() - start;
+
+  printf("trim quantum=%u qset=%u size=%llu us=%.1f\n",
+          bench_dev.quantum, bench_dev.qset, opts->size, elapsed / 1e3);
+
+  return 0;
+}
+
+static void usage(const char * prog)
+{
+  fprintf(stderr,
+          "Usage: %s <test> [-s size] [-b bsize] [-n ops] [-t threads] [-q quantum] [-Q qset]\n"
+          "tests:\n"
+          "  seqread   sequential reads, wrapping around at the end of the device\n"
+          "  seqwrite  sequential writes, wrapping around at the end of the device\n"
+          "  randread  random block aligned reads\n"
+          "  randwrite random block aligned writes\n"
+          "  append    O_APPEND writes to an empty device, -s is ignored\n"
+          "  trim      empty a filled device\n"
+          "options:\n"
+          "  -s        device size, K/M/G suffix allowed (default 64M)\n"
+          "  -b        I/O size (default 4000)\n"
+          "  -n        number of measured I/Os per thread (default 1000000)\n"
+          "  -t        number of threads (default 1)\n"
+          "  -q        quantum size (default %u)\n"
+          "  -Q        quanta per quantum set (default %u)\n",
+          prog, SCULL_QUANTUM, SCULL_QSET);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt, ret;
+  const char * test;
+  struct bench_opts opts = {
+    .size = 64ULL << 20,
+    .bsize = 4000,
+    .ops = 1000000,
+    .threads = 1
+  };
+
+  if (argc < 2)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  test = argv[1];
+  optind = 2;
+
+  while ((opt = getopt(argc, argv, "s:b:n:t:q:Q:")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        opts.size = parse_size(optarg);
+        break;
+      case 'b':
+        opts.bsize = parse_size(optarg);
+        break;
+      case 'n':
+        opts.ops = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        opts.threads = strtoul(optarg, NULL, 0);
+        break;
+      case 'q':
+        scull_quantum = parse_size(optarg);
+        break;
+      case 'Q':
+        scull_qset = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (opts.bsize == 0 || opts.ops == 0 || opts.threads == 0 ||
+      !scull_geometry_valid(scull_quantum, scull_qset))
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (scull_storage_init() || scull_storage_dev_init(&bench_dev))
+  {
+    fprintf(stderr, "cannot set up the device\n");
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(test, "seqread") == 0)
+    ret = bench_io(test, &opts, false, false, false);
+  else if (strcmp(test, "seqwrite") == 0)
+    ret = bench_io(test, &opts, true, false, false);
+  else if (strcmp(test, "randread") == 0)
+    ret = bench_io(test, &opts, false, true, false);
+  else if (strcmp(test, "randwrite") == 0)
+    ret = bench_io(test, &opts, true, true, false);
+  else if (strcmp(test, "append") == 0)
+    ret = bench_io(test, &opts, true, false, true);
+  else if (strcmp(test, "trim") == 0)
+    ret = bench_trim(&opts);
+  else
+  {
+    usage(argv[0]);
+    ret = -1;
+  }
+
+  scull_storage_dev_exit(&bench_dev);
+  scull_storage_exit();
+
+  return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
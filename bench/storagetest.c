@@ -0,0 +1,771 @@
+/*
+ * storagetest.c -- functional tests of the scull storage engine, built in
+ * userspace against scull_shim.h
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each test starts from an empty device, changes it through the same
+ * entry points as the module and compares what reads, SEEK_DATA/SEEK_HOLE
+ * and the statistics show with an image of what the device should hold.
+ * The quantum sets are kept small so that every test crosses a few.
+ */
+
+#include "scull_shim.h"
+#include "scull.h"
+
+// the module parameters storage.c reads
+unsigned int scull_quantum = SCULL_QUANTUM;
+unsigned int scull_qset = 16;
+unsigned int scull_pool_max = SCULL_POOL_MAX;
+unsigned long scull_max_bytes = SCULL_MAX_BYTES;
+unsigned long scull_global_max_bytes = SCULL_GLOBAL_MAX_BYTES;
+unsigned int scull_compress_ms = SCULL_COMPRESS_MS;
+bool scull_dedup = SCULL_DEDUP;
+bool scull_log = SCULL_LOG;
+
+#define Q SCULL_QUANTUM
+#define IMAGE_QUANTA 48             // three quantum sets
+
+#define APPEND_THREADS 4
+#define APPEND_RECORDS 2000
+#define APPEND_MAX_LEN 150
+
+#define TRIM_QUANTA 40
+#define TRIM_ROUNDS 500
+
+static struct scull_dev test_dev;
+
+// what the device should hold, and a buffer to read it back into
+static char image[IMAGE_QUANTA * Q];
+static char readback[IMAGE_QUANTA * Q];
+
+#define CHECK(cond)                                                 \
+  do {                                                              \
+    if (!(cond))                                                    \
+    {                                                               \
+      fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__,        \
+              __func__, #cond);                                     \
+      return -1;                                                    \
+    }                                                               \
+  } while (0)
+
+#define STAT(item) (test_dev.stats->count[SCULL_STAT_##item])
+
+/*
+ * dev_io - one read or write through the same entry points as the VFS,
+ * @flags being the IOCB_* flags an O_APPEND file would set
+ */
+
+static ssize_t dev_io(struct file * flip, loff_t pos, void * buf, size_t len, bool write,
+                      int flags)
+{
+  struct kiocb iocb;
+  struct iov_iter iter;
+
+  iocb.ki_filp = flip;
+  iocb.ki_pos = pos;
+  iocb.ki_flags = flags;
+  iov_iter_shim_init(&iter, buf, len);
+
+  return write ? scull_write_iter(&iocb, &iter) : scull_read_iter(&iocb, &iter);
+}
+
+/*
+ * snap_read - read from a snapshot as its file would
+ */
+
+static ssize_t snap_read(struct scull_snap * snap, loff_t pos, void * buf, size_t len)
+{
+  struct file flip;
+  struct kiocb iocb;
+  struct iov_iter iter;
+
+  flip.private_data = snap;
+  iocb.ki_filp = &flip;
+  iocb.ki_pos = pos;
+  iocb.ki_flags = 0;
+  iov_iter_shim_init(&iter, buf, len);
+
+  return scull_snap_read_iter(&iocb, &iter);
+}
+
+/*
+ * dev_file_open - the per open file state scull_open() would set up
+ */
+
+static void dev_file_open(struct file * flip, struct scull_file * sf)
+{
+  memset(sf, 0, sizeof(struct scull_file));
+  sf->dev = &test_dev;
+  spin_lock_init(&sf->lock);
+  flip->private_data = sf;
+}
+
+// empty the device and the image
+static void dev_reset(void)
+{
+  scull_lock_write(&test_dev);
+  scull_trim(&test_dev);
+  up_write(&test_dev.rwsem);
+  scull_storage_flush();
+
+  memset(image, 0, sizeof(image));
+}
+
+// fill @len bytes with data that depends on @seed, and does not compress
+static void fill_random(char * buf, size_t len, unsigned int seed)
+{
+  size_t i;
+  uint64_t x;
+
+  x = 0x9e3779b97f4a7c15ULL * (seed + 1);
+  for (i = 0; i < len; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buf[i] = x;
+  }
+}
+
+// fill @len bytes with runs of a byte that depends on @seed, they compress
+static void fill_runs(char * buf, size_t len, unsigned int seed)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = 'a' + (seed + i / 64) % 26;
+}
+
+// write the image over [@off, @off + @len)
+static int image_write(struct file * flip, loff_t off, size_t len)
+{
+  CHECK(dev_io(flip, off, image + off, len, true, 0) == (ssize_t) len);
+
+  return 0;
+}
+
+// the device holds the image up to @size, and nothing past it
+static int image_check(struct file * flip, size_t size)
+{
+  CHECK(atomic_long_read(&test_dev.size) == (long) size);
+  CHECK(dev_io(flip, 0, readback, sizeof(readback), false, 0) == (ssize_t) size);
+  CHECK(memcmp(readback, image, size) == 0);
+
+  return 0;
+}
+
+// SEEK_DATA or SEEK_HOLE from @off
+static loff_t seek(loff_t off, bool hole)
+{
+  loff_t pos;
+
+  scull_lock_read(&test_dev);
+  pos = scull_seek_hole_data(&test_dev, off, hole);
+  up_read(&test_dev.rwsem);
+
+  return pos;
+}
+
+static int punch(loff_t off, loff_t len)
+{
+  int retval;
+
+  scull_lock_read(&test_dev);
+  retval = scull_punch_range(&test_dev, off, len);
+  up_read(&test_dev.rwsem);
+
+  memset(image + off, 0, len);
+
+  return retval;
+}
+
+// two passes of the compression worker, the first one only ages the quanta
+static void compress_now(void)
+{
+  unsigned int ms;
+
+  ms = scull_compress_ms;
+  scull_compress_ms = 1;
+  test_dev.compress_work.work.func(&test_dev.compress_work.work);
+  test_dev.compress_work.work.func(&test_dev.compress_work.work);
+  scull_compress_ms = ms;
+}
+
+/*
+ * test_holes - unwritten ranges, quanta written with zeros and punched
+ * ranges read as zeros, and SEEK_DATA/SEEK_HOLE skip them
+ */
+
+static int test_holes(void)
+{
+  unsigned long elided;
+  struct file flip;
+  struct scull_file sf;
+
+  dev_reset();
+  dev_file_open(&flip, &sf);
+
+  // quantum 1, part of quantum 5 and quantum 20, in the second quantum set
+  fill_random(image + 1 * Q, Q, 1);
+  fill_random(image + 5 * Q + 100, 200, 5);
+  fill_random(image + 20 * Q, Q, 20);
+  CHECK(image_write(&flip, 1 * Q, Q) == 0);
+  CHECK(image_write(&flip, 5 * Q + 100, 200) == 0);
+  CHECK(image_write(&flip, 20 * Q, Q) == 0);
+  CHECK(image_check(&flip, 21 * Q) == 0);
+
+  CHECK(seek(0, false) == 1 * Q);
+  CHECK(seek(1 * Q + 10, true) == 2 * Q);
+  CHECK(seek(2 * Q, false) == 5 * Q);
+  CHECK(seek(6 * Q, false) == 20 * Q);
+  CHECK(seek(20 * Q, true) == 21 * Q);
+  CHECK(seek(21 * Q, false) == -ENXIO);
+  CHECK(seek(21 * Q, true) == -ENXIO);
+
+  // a quantum written whole with zeros is not stored
+  elided = STAT(ZERO_ELIDED);
+  memset(image + 1 * Q, 0, Q);
+  CHECK(image_write(&flip, 1 * Q, Q) == 0);
+  CHECK(STAT(ZERO_ELIDED) == elided + 1);
+  CHECK(seek(0, false) == 5 * Q);
+
+  // punching zeroes the edges and releases the quanta in between
+  fill_random(image + 8 * Q, 4 * Q, 8);
+  CHECK(image_write(&flip, 8 * Q, 4 * Q) == 0);
+  CHECK(punch(8 * Q + 10, 2 * Q) == 0);
+  CHECK(image_check(&flip, 21 * Q) == 0);
+  CHECK(seek(8 * Q, true) == 9 * Q);
+  CHECK(seek(9 * Q, false) == 10 * Q);
+
+  // across a quantum set boundary, up to the end of the device
+  CHECK(punch(11 * Q, 10 * Q) == 0);
+  CHECK(image_check(&flip, 21 * Q) == 0);
+  CHECK(seek(11 * Q, false) == -ENXIO);
+
+  return 0;
+}
+
+/*
+ * test_dedup - quanta written whole with the same contents are stored
+ * once, and a write to one of them gives it its own copy
+ */
+
+static int test_dedup(void)
+{
+  unsigned int q;
+  unsigned long cow;
+  struct file flip;
+  struct scull_file sf;
+
+  dev_reset();
+  dev_file_open(&flip, &sf);
+
+  // five copies of the same quantum around a different one
+  for (q = 0; q < 6; q++)
+    fill_random(image + q * Q, Q, (q == 4) ? 4 : 0);
+  CHECK(image_write(&flip, 0, 6 * Q) == 0);
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 4);
+  CHECK(image_check(&flip, 6 * Q) == 0);
+
+  // a write to a shared quantum leaves the others as they were
+  cow = STAT(DEDUP_COW);
+  image[2 * Q + 7] ^= 0xff;
+  CHECK(image_write(&flip, 2 * Q + 7, 1) == 0);
+  CHECK(STAT(DEDUP_COW) == cow + 1);
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 3);
+  CHECK(image_check(&flip, 6 * Q) == 0);
+
+  // rewritten whole, a quantum moves from one shared copy to another
+  memcpy(image, image + 4 * Q, Q);
+  CHECK(image_write(&flip, 0, Q) == 0);
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 3);
+  CHECK(image_check(&flip, 6 * Q) == 0);
+
+  // punching one copy drops its reference only
+  CHECK(punch(3 * Q, Q) == 0);
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 2);
+  CHECK(image_check(&flip, 6 * Q) == 0);
+
+  dev_reset();
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 0);
+
+  return 0;
+}
+
+/*
+ * test_snapshot - a snapshot keeps reading what the device held when it
+ * was taken, whatever is written, punched or trimmed afterwards
+ */
+
+static int test_snapshot(void)
+{
+  static char taken[IMAGE_QUANTA * Q];
+  unsigned int q;
+  size_t size;
+  struct file flip;
+  struct scull_file sf;
+  struct scull_snap * snap;
+
+  dev_reset();
+  dev_file_open(&flip, &sf);
+
+  /*
+   * Raw, shared, compressed quanta and holes, over two quantum sets; only
+   * the shared ones go through dedup, as quanta in the dedup table are
+   * not compressed.
+   */
+  for (q = 0; q < 32; q++)
+  {
+    scull_dedup = (q % 4 == 1);
+    switch (q % 4)
+    {
+      case 0:
+        fill_random(image + q * Q, Q, q);
+        break;
+      case 1:
+        fill_random(image + q * Q, Q, 1);
+        break;
+      case 2:
+        fill_runs(image + q * Q, Q, q);
+        break;
+    }
+    CHECK(image_write(&flip, q * Q, Q) == 0);
+  }
+  scull_dedup = false;
+  size = 32 * Q;
+  compress_now();
+  CHECK(atomic_long_read(&test_dev.zquanta) == 8);
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 7);
+
+  scull_lock_write(&test_dev);
+  snap = scull_snap_create(&test_dev);
+  up_write(&test_dev.rwsem);
+  CHECK(!IS_ERR(snap));
+  memcpy(taken, image, size);
+
+  // partial writes over each kind of quantum, one past the end
+  for (q = 0; q < 34; q += 3)
+  {
+    fill_random(image + q * Q + q, 300, q + 100);
+    CHECK(image_write(&flip, q * Q + q, 300) == 0);
+  }
+  size = 33 * Q + 33 + 300;
+  CHECK(punch(10 * Q + 5, 3 * Q) == 0);
+  CHECK(image_check(&flip, size) == 0);
+
+  // preserving does not count as a dedup saving, nor inflate the device
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 4);
+  CHECK(snap_read(snap, 0, readback, sizeof(readback)) == 32 * Q);
+  CHECK(memcmp(readback, taken, 32 * Q) == 0);
+  CHECK(snap_read(snap, 32 * Q - 5, readback, 10) == 5);
+  CHECK(atomic_long_read(&test_dev.zquanta) == 4);
+
+  // trimmed, the device leaves its old index to the snapshot
+  dev_reset();
+  fill_random(image, Q, 1000);
+  CHECK(image_write(&flip, 0, Q) == 0);
+  CHECK(snap_read(snap, 0, readback, sizeof(readback)) == 32 * Q);
+  CHECK(memcmp(readback, taken, 32 * Q) == 0);
+
+  scull_snap_release(snap);
+  CHECK(image_check(&flip, Q) == 0);
+
+  dev_reset();
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 0);
+  CHECK(atomic_long_read(&test_dev.zquanta) == 0);
+
+  return 0;
+}
+
+/*
+ * test_zcache - reads of a compressed quantum decompress it once and keep
+ * the copy, up to SCULL_ZCACHE_MAX of them, until the quantum goes cold
+ */
+
+static int test_zcache(void)
+{
+  unsigned int q;
+  unsigned long inflated;
+  struct file flip;
+  struct scull_file sf;
+
+  dev_reset();
+  dev_file_open(&flip, &sf);
+
+  for (q = 0; q < 24; q++)
+    fill_runs(image + q * Q, Q, q);
+  CHECK(image_write(&flip, 0, 24 * Q) == 0);
+  compress_now();
+  CHECK(atomic_long_read(&test_dev.zquanta) == 24);
+
+  // small reads of one quantum
+  inflated = STAT(INFLATED);
+  for (q = 0; q < 8; q++)
+  {
+    CHECK(dev_io(&flip, 2 * Q + q * (Q / 8), readback, Q / 8, false, 0) == Q / 8);
+    CHECK(memcmp(readback, image + 2 * Q + q * (Q / 8), Q / 8) == 0);
+  }
+  CHECK(STAT(INFLATED) == inflated + 1);
+  CHECK(atomic_long_read(&test_dev.zcached) == 1);
+
+  // the others past the bound go through a scratch buffer
+  CHECK(image_check(&flip, 24 * Q) == 0);
+  CHECK(atomic_long_read(&test_dev.zcached) == SCULL_ZCACHE_MAX);
+  CHECK(STAT(INFLATED) == inflated + 24);
+
+  // a write takes the copy as the raw quantum
+  image[2 * Q + 5] ^= 0xff;
+  CHECK(image_write(&flip, 2 * Q + 5, 1) == 0);
+  CHECK(STAT(INFLATED) == inflated + 24);
+  CHECK(atomic_long_read(&test_dev.zcached) == SCULL_ZCACHE_MAX - 1);
+  CHECK(image_check(&flip, 24 * Q) == 0);
+
+  // gone cold, the copies go
+  compress_now();
+  CHECK(atomic_long_read(&test_dev.zcached) == 0);
+  CHECK(atomic_long_read(&test_dev.zquanta) == 24);
+  CHECK(image_check(&flip, 24 * Q) == 0);
+
+  dev_reset();
+  CHECK(atomic_long_read(&test_dev.zcached) == 0);
+  CHECK(atomic_long_read(&test_dev.zquanta) == 0);
+
+  return 0;
+}
+
+struct appender {
+  pthread_t thread;
+  unsigned int id;
+  int flags;
+  int err;
+};
+
+// the length of the @n-th record of appender @id
+static size_t record_len(unsigned int id, unsigned int n)
+{
+  return 3 + (n * 7 + id) % (APPEND_MAX_LEN - 2);
+}
+
+/*
+ * appender_run - append records "<xx...x>", x telling the appender and
+ * the length which record of it this is
+ */
+
+static void * appender_run(void * arg)
+{
+  char rec[APPEND_MAX_LEN + 1];
+  unsigned int n;
+  size_t len;
+  struct file flip;
+  struct scull_file sf;
+  struct appender * a;
+
+  a = arg;
+  dev_file_open(&flip, &sf);
+
+  for (n = 0; n < APPEND_RECORDS; n++)
+  {
+    len = record_len(a->id, n);
+    memset(rec, 'A' + a->id, len);
+    rec[0] = '<';
+    rec[len - 1] = '>';
+
+    // the position is ignored, appends go to the tail
+    if (dev_io(&flip, 0, rec, len, true, a->flags) != (ssize_t) len)
+    {
+      a->err = 1;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * append_run - concurrent appends land whole, one after the other, each
+ * appender's in the order it made them
+ */
+
+static int append_run(int flags)
+{
+  char * buf;
+  unsigned int i, started, id;
+  unsigned int next[APPEND_THREADS];
+  size_t size, pos, len;
+  struct file flip;
+  struct scull_file sf;
+  struct appender appenders[APPEND_THREADS];
+
+  dev_reset();
+  pos = 0;
+  memset(appenders, 0, sizeof(appenders));
+
+  for (started = 0; started < APPEND_THREADS; started++)
+  {
+    appenders[started].id = started;
+    appenders[started].flags = flags;
+    if (pthread_create(&appenders[started].thread, NULL, appender_run, appenders + started))
+      break;
+  }
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(appenders[i].thread, NULL);
+    CHECK(appenders[i].err == 0);
+  }
+  CHECK(started == APPEND_THREADS);
+
+  size = 0;
+  for (id = 0; id < APPEND_THREADS; id++)
+  {
+    for (i = 0; i < APPEND_RECORDS; i++)
+      size += record_len(id, i);
+  }
+  CHECK(atomic_long_read(&test_dev.size) == (long) size);
+
+  buf = malloc(size);
+  CHECK(buf != NULL);
+  dev_file_open(&flip, &sf);
+  if (dev_io(&flip, 0, buf, size, false, 0) != (ssize_t) size)
+    goto fail;
+
+  memset(next, 0, sizeof(next));
+  for (pos = 0; pos < size; pos += len)
+  {
+    if ((buf[pos] != '<') || (buf[pos + 1] < 'A') || (buf[pos + 1] >= 'A' + APPEND_THREADS))
+      goto fail;
+
+    id = buf[pos + 1] - 'A';
+    len = record_len(id, next[id]++);
+    if ((pos + len > size) || (buf[pos + len - 1] != '>') ||
+        (memchr_inv(buf + pos + 1, 'A' + id, len - 2) != NULL))
+      goto fail;
+  }
+
+  free(buf);
+
+  return 0;
+
+fail:
+  fprintf(stderr, "%s: appends torn or out of order around %zu\n", __func__, pos);
+  free(buf);
+  return -1;
+}
+
+/*
+ * test_append - O_APPEND writes, then all writes with "scull_log" set
+ */
+
+static int test_append(void)
+{
+  int retval;
+
+  retval = append_run(IOCB_APPEND);
+  if (retval == 0)
+  {
+    scull_log = true;
+    retval = append_run(0);
+    scull_log = false;
+  }
+
+  dev_reset();
+
+  return retval;
+}
+
+static bool trim_stop;
+
+struct trim_peer {
+  pthread_t thread;
+  int (* run)(void);
+  int err;
+};
+
+/*
+ * trim_writer - write the first TRIM_QUANTA quanta whole, over and over,
+ * quantum q of generation g holding the byte g + q
+ */
+
+static int trim_writer(void)
+{
+  static char buf[TRIM_QUANTA * Q];
+  unsigned int gen, q;
+  struct file flip;
+  struct scull_file sf;
+
+  dev_file_open(&flip, &sf);
+
+  for (gen = 0; !READ_ONCE(trim_stop); gen++)
+  {
+    for (q = 0; q < TRIM_QUANTA; q++)
+      memset(buf + q * Q, gen + q, Q);
+    CHECK(dev_io(&flip, 0, buf, sizeof(buf), true, 0) == sizeof(buf));
+  }
+
+  return 0;
+}
+
+/*
+ * trim_snap_reader - take snapshots and read them back, each one empty or
+ * holding a whole write of one generation
+ */
+
+static int trim_snap_reader(void)
+{
+  static char buf[TRIM_QUANTA * Q];
+  unsigned int q;
+  ssize_t len;
+  struct scull_snap * snap;
+
+  while (!READ_ONCE(trim_stop))
+  {
+    scull_lock_write(&test_dev);
+    snap = scull_snap_create(&test_dev);
+    up_write(&test_dev.rwsem);
+    CHECK(!IS_ERR(snap));
+
+    len = snap_read(snap, 0, buf, sizeof(buf));
+    scull_snap_release(snap);
+
+    CHECK((len == 0) || (len == sizeof(buf)));
+    for (q = 0; q < len / Q; q++)
+      CHECK(memchr_inv(buf + q * Q, (char) (buf[0] + q), Q) == NULL);
+  }
+
+  return 0;
+}
+
+static void * trim_peer_run(void * arg)
+{
+  struct trim_peer * peer;
+
+  peer = arg;
+  peer->err = peer->run();
+
+  return NULL;
+}
+
+/*
+ * test_trim - trims while a writer and a snapshot reader are at work, the
+ * old index being freed from the workqueue or left to the snapshot
+ */
+
+static int test_trim(void)
+{
+  int err;
+  unsigned int i, started;
+  struct trim_peer peers[] = {
+    { .run = trim_writer },
+    { .run = trim_snap_reader },
+  };
+
+  dev_reset();
+  WRITE_ONCE(trim_stop, false);
+
+  for (started = 0; started < 2; started++)
+  {
+    if (pthread_create(&peers[started].thread, NULL, trim_peer_run, peers + started))
+      break;
+  }
+
+  err = 0;
+  for (i = 0; (i < TRIM_ROUNDS) && (started == 2); i++)
+  {
+    scull_lock_write(&test_dev);
+    err |= scull_trim(&test_dev);
+    up_write(&test_dev.rwsem);
+    sched_yield();
+  }
+
+  WRITE_ONCE(trim_stop, true);
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(peers[i].thread, NULL);
+    CHECK(peers[i].err == 0);
+  }
+  CHECK(started == 2);
+  CHECK(err == 0);
+
+  dev_reset();
+  CHECK(atomic_long_read(&test_dev.dedup_saved) == 0);
+
+  return 0;
+}
+
+struct test {
+  const char * name;
+  int (* run)(void);
+  bool dedup;                 // "scull_dedup" for the test
+};
+
+static const struct test tests[] = {
+  { "holes",    test_holes,    false },
+  { "dedup",    test_dedup,    true },
+  { "snapshot", test_snapshot, false },
+  { "zcache",   test_zcache,   false },
+  { "append",   test_append,   false },
+  { "trim",     test_trim,     true },
+};
+
+int main(int argc, char * argv[])
+{
+  int failed, arg;
+  unsigned int i;
+
+  if (scull_storage_init() || scull_storage_dev_init(&test_dev))
+  {
+    fprintf(stderr, "cannot set up the device\n");
+    return EXIT_FAILURE;
+  }
+
+  failed = 0;
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+  {
+    // run only the tests named on the command line, if any
+    if (argc > 1)
+    {
+      for (arg = 1; arg < argc; arg++)
+      {
+        if (strcmp(argv[arg], tests[i].name) == 0)
+          break;
+      }
+      if (arg == argc)
+        continue;
+    }
+
+    scull_dedup = tests[i].dedup;
+    if (tests[i].run())
+    {
+      printf("FAIL %s\n", tests[i].name);
+      failed++;
+    }
+    else
+      printf("ok   %s\n", tests[i].name);
+  }
+
+  scull_storage_dev_exit(&test_dev);
+  scull_storage_exit();
+
+  if (atomic_long_read(&test_dev.mem) != 0)
+  {
+    printf("FAIL %ld bytes of quanta left\n", atomic_long_read(&test_dev.mem));
+    failed++;
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# sweep.sh -- run scullbench over a grid of scull geometries and workloads
+#
+# Copyright (C) 2024  Arka Mondal
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Every scull_quantum x scull_qset pair reloads the module (root needed,
+# scull.ko built in ../scull), then every workload runs against it. The
+# results are one CSV table on stdout, pick the geometry from there.
+#
+# The grid comes from the environment, e.g.
+#   QUANTA="4000 4096 65536" QSETS="1000 4096" THREADS="1 8" ./sweep.sh > out.csv
+
+QUANTA=${QUANTA:-"1000 4000 4096 16384 65536"}
+QSETS=${QSETS:-"256 1000 4096"}
+TESTS=${TESTS:-"pread pwrite seqread sendfile trim"}
+PATTERNS=${PATTERNS:-"seq rand"}
+BSIZES=${BSIZES:-"1 512 4K 64K 1M 16M"}
+THREADS=${THREADS:-"1 4"}
+SIZE=${SIZE:-"64M"}
+OPS=${OPS:-"20000"}           # I/Os per thread
+OPS_LARGE=${OPS_LARGE:-"200"}   # same, for M and G block sizes
+CYCLES=${CYCLES:-"5"}
+DEVICE=${DEVICE:-"/dev/scull0"}
+
+BENCH=$(realpath "$(dirname "$0")")/scullbench
+SCULLDIR=$(realpath "$(dirname "$0")/../scull")
+
+header=""   # -H once the header line is out
+
+function reload()
+{
+  (cd "${SCULLDIR}" && ./scullinit.sh reload "scull_quantum=$1" "scull_qset=$2") ||
+    (cd "${SCULLDIR}" && ./scullinit.sh load "scull_quantum=$1" "scull_qset=$2") || exit 1
+}
+
+# run <test> [options] -- the last option must be the block size, if any
+function run()
+{
+  local ops=${OPS}
+
+  case "${*: -1}" in
+    *[mMgG] ) ops=${OPS_LARGE} ;;
+  esac
+
+  "${BENCH}" "$@" -d "${DEVICE}" -s "${SIZE}" -n "${ops}" -f csv ${header} || \
+    echo "sweep: failed: $*" >&2
+  header="-H"
+}
+
+for quantum in ${QUANTA}
+do
+  for qset in ${QSETS}
+  do
+    reload "${quantum}" "${qset}"
+
+    for test in ${TESTS}
+    do
+      case "${test}" in
+        trim )
+          run trim -c "${CYCLES}"
+          continue
+          ;;
+        seqread | sendfile )
+          for bsize in ${BSIZES}
+          do
+            run "${test}" -b "${bsize}"
+          done
+          continue
+          ;;
+      esac
+
+      for pattern in ${PATTERNS}
+      do
+        for bsize in ${BSIZES}
+        do
+          for threads in ${THREADS}
+          do
+            run "${test}" -p "${pattern}" -t "${threads}" -b "${bsize}"
+          done
+        done
+      done
+    done
+  done
+done
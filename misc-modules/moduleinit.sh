@@ -23,7 +23,7 @@ declare -i no_devs
 declare DEVICE   # the name of the device
 declare MODULE   # the name of the module
 mode="664"       # permission
-no_devs=1
+no_devs=4
 group=""
 
 function clean_devnodes()
@@ -36,15 +36,26 @@ function clean_devnodes()
   return
 }
 
+# load [param=value ...] -- the arguments are passed on to insmod
 function load() {
 
-  # TODO: add support for the insmod arguments
-  insmod ./${MODULE}.ko || exit 1
+  local arg
+
+  # the number of nodes follows the number of devices
+  for arg in "$@"
+  do
+    case "${arg}" in
+      ${MODULE}_nr_devs=* )
+        no_devs=${arg#${MODULE}_nr_devs=} ;;
+    esac
+  done
+
+  insmod ./${MODULE}.ko "$@" || exit 1
 
   clean_devnodes
 
   echo "Seaching for the major number of device ${DEVICE}..."
-  major=$(awk -v device="${DEVICE}" '$2 == "device" { print $1 }' /proc/devices)
+  major=$(awk -v device="${DEVICE}" '$2 == device { print $1 }' /proc/devices)
 
   if [[ -z  ${major} ]]; then
     echo "No device found in /proc/devices for driver ${MODULE} (this driver may not allocate a device)"
@@ -82,15 +93,16 @@ function unload()
   return
 }
 
-if [[ $# -lt 1 || $# -gt 2 ]]; then
+if [[ $# -lt 1 ]]; then
   echo "Wrong number of arguments"
   echo "$0 help for checking usage"
   exit 1
 fi
 
 if [[ "$1" == "help" ]]; then
-  echo "Usage: $0 {module_name} [load | unload]"
-  echo "Default is load"
+  echo "Usage: $0 {module_name} [load | unload] [param=value ...]"
+  echo "Default is load, the parameters go to insmod"
+  echo "e.g. $0 sleepy load sleepy_nr_devs=1024"
   exit 1
 elif [[ ! "$1" =~ ^(sleepy|wokenup)$ ]]; then
   echo "Invalid module name"
@@ -103,9 +115,10 @@ MODULE=$1
 set -e
 
 arg=${2:-"load"}
+shift $(( $# < 2 ? $# : 2 ))
 case "${arg}" in
   load )
-    load ;;
+    load "$@" ;;
   unload )
     unload ;;
   * )
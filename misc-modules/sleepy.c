@@ -26,22 +26,105 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>           // ilog2()
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fcntl.h>          // O_NONBLOCK
+#include <linux/uaccess.h>        // get_user(), put_user()
 
 
 unsigned int sleepy_major = 0;
 unsigned int sleepy_minor = 0;
+unsigned int sleepy_nr_devs = 4;
 struct cdev *sleepy_cdev = NULL;
 
 module_param(sleepy_major, uint, S_IRUGO);
 module_param(sleepy_minor, uint, S_IRUGO);
+module_param(sleepy_nr_devs, uint, S_IRUGO);
 
-static DECLARE_WAIT_QUEUE_HEAD(wq);
-static DEFINE_MUTEX(mtx);
-static int flag = 0;
+/*
+ * Each sleepy device is a 64-bit counter, with eventfd semantics:
+ *
+ *  - a write of 8 bytes adds that value to the counter, a read of 8 bytes
+ *    or more returns the counter and resets it to 0
+ *  - shorter writes add one per byte, shorter reads take one, as eventfd
+ *    does with EFD_SEMAPHORE (`echo > /dev/sleepy0` wakes one reader)
+ *  - longer writes fail with EINVAL
+ *
+ * The counter is atomic, so neither side takes a lock. Readers wait in
+ * exclusive mode, so that adding n wakes at most n of them instead of
+ * every sleeper; poll() waiters are always woken up.
+ */
+
+/*
+ * The write that wakes readers up stamps the device, each reader that
+ * slept through it counts how long it took to run again in a per-CPU
+ * log2 histogram, shown by <debugfs>/sleepy/sleepyN. Writing to the
+ * file resets it.
+ */
+
+#define SLEEPY_LAT_BUCKETS 32   // bucket n counts latencies in [2^n, 2^(n+1)) ns
+
+struct sleepy_stats {
+  unsigned long lat[SLEEPY_LAT_BUCKETS];
+};
+
+struct sleepy_dev {
+  atomic64_t count;
+  wait_queue_head_t wq;
+  u64 woken_ns;                 // ktime_get_ns() of the last waking write
+  struct sleepy_stats __percpu *stats;
+};
+
+static struct sleepy_dev *sleepy_devices = NULL;
+static struct dentry *sleepy_debugfs_root = NULL;
+
+// take a token if there is one
+static inline bool sleepy_take(struct sleepy_dev *dev)
+{
+  return atomic64_add_unless(&dev->count, -1, 0);
+}
+
+// take the whole counter, 0 if it was empty
+static inline u64 sleepy_take_all(struct sleepy_dev *dev)
+{
+  return atomic64_xchg(&dev->count, 0);
+}
+
+/*
+ * sleepy_woken - account the wake-to-run latency of a reader
+ * @dev:        sleepy device
+ * @slept:      ktime_get_ns() when the reader went to sleep
+ */
+
+static void sleepy_woken(struct sleepy_dev *dev, u64 slept)
+{
+  u64 woken, delta;
+  unsigned int bucket;
+
+  // the condition held before the reader had to sleep, nothing to count
+  woken = READ_ONCE(dev->woken_ns);
+  if (woken < slept)
+    return;
+
+  delta = ktime_get_ns() - woken;
+  bucket = (delta != 0) ? ilog2(delta) : 0;
+  if (bucket >= SLEEPY_LAT_BUCKETS)
+    bucket = SLEEPY_LAT_BUCKETS - 1;
+
+  this_cpu_inc(dev->stats->lat[bucket]);
+}
 
 int sleepy_open(struct inode *inode, struct file *flip)
 {
-  return 0;
+  flip->private_data = sleepy_devices + (iminor(inode) - sleepy_minor);
+
+  return stream_open(inode, flip);
 }
 
 int sleepy_release(struct inode *inode, struct file *flip)
@@ -52,77 +135,216 @@ int sleepy_release(struct inode *inode, struct file *flip)
 ssize_t sleepy_read(struct file *flip, char __user *buf, size_t count,
                     loff_t *f_pos)
 {
-  if (mutex_lock_interruptible(&mtx))
-    return -ERESTARTSYS;
+  u64 value, slept;
+  struct sleepy_dev *dev = flip->private_data;
 
-  while (flag == 0)
+  if (count < sizeof(u64))
   {
-    mutex_unlock(&mtx);
-    printk(KERN_DEBUG "process: %i (%s) is going to sleep\n", current->pid, current->comm);
-    if (wait_event_interruptible(wq, flag != 0))
+    if (sleepy_take(dev))
+      return count;
+    if (flip->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+
+    slept = ktime_get_ns();
+
+    /*
+     * The condition is checked again after every wakeup, with the task
+     * already queued, and before giving up on a signal: a token meant for
+     * this reader is never lost.
+     */
+    if (wait_event_interruptible_exclusive(dev->wq, sleepy_take(dev)))
       return -ERESTARTSYS;
-    // reacquire the mutex first, then check the condition again
-    if (mutex_lock_interruptible(&mtx))
+
+    sleepy_woken(dev, slept);
+    return count;
+  }
+
+  value = sleepy_take_all(dev);
+  if (value == 0)
+  {
+    if (flip->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+
+    slept = ktime_get_ns();
+    if (wait_event_interruptible_exclusive(dev->wq, (value = sleepy_take_all(dev)) != 0))
       return -ERESTARTSYS;
+    sleepy_woken(dev, slept);
   }
 
-  flag = 0;
-  printk(KERN_DEBUG "process: %i (%s) awoken\n", current->pid, current->comm);
-  mutex_unlock(&mtx);
+  if (put_user(value, (u64 __user *) buf))
+  {
+    // give it back rather than lose it
+    atomic64_add(value, &dev->count);
+    wake_up_interruptible(&dev->wq);
+    return -EFAULT;
+  }
 
-  return count;
+  return sizeof(u64);
 }
 
 ssize_t sleepy_write(struct file *flip, const char __user *buf, size_t count,
                      loff_t *f_pos)
 {
-  if (mutex_lock_interruptible(&mtx))
-    return -ERESTARTSYS;
+  u64 value;
+  s64 old;
+  ssize_t retval;
+  struct sleepy_dev *dev = flip->private_data;
+
+  if (count < sizeof(u64))
+  {
+    value = count;
+    retval = count;
+  }
+  else if (count == sizeof(u64))
+  {
+    if (get_user(value, (const u64 __user *) buf))
+      return -EFAULT;
+    retval = sizeof(u64);
+  }
+  else
+    return -EINVAL;
 
-  flag = 1;
-  printk(KERN_DEBUG "process: %i (%s) awakening the readers...\n", current->pid, current->comm);
-  wake_up_interruptible(&wq);
-  mutex_unlock(&mtx);
+  if (value == 0)
+    return retval;
+  if (value > S64_MAX)
+    return -EINVAL;
 
-  return count;
+  // refuse to overflow, the reader has to catch up first
+  old = atomic64_read(&dev->count);
+  do
+  {
+    if (value > S64_MAX - old)
+      return -EAGAIN;
+  } while (!atomic64_try_cmpxchg(&dev->count, &old, old + value));
+
+  // stamped before the sleepers are woken up, a failed write stamps nothing
+  WRITE_ONCE(dev->woken_ns, ktime_get_ns());
+
+  wake_up_interruptible_nr(&dev->wq, min_t(u64, value, INT_MAX));
+
+  return retval;
+}
+
+__poll_t sleepy_poll(struct file *flip, poll_table *wait)
+{
+  s64 value;
+  __poll_t mask = 0;
+  struct sleepy_dev *dev = flip->private_data;
+
+  poll_wait(flip, &dev->wq, wait);
+
+  value = atomic64_read(&dev->count);
+  if (value > 0)
+    mask |= EPOLLIN | EPOLLRDNORM;
+  if (value < S64_MAX)
+    mask |= EPOLLOUT | EPOLLWRNORM;
+
+  return mask;
 }
 
 struct file_operations sleepy_fops = {
   .owner        = THIS_MODULE,
   .read         = sleepy_read,
   .write        = sleepy_write,
+  .poll         = sleepy_poll,
   .open         = sleepy_open,
   .release      = sleepy_release
 };
 
+static int sleepy_lat_show(struct seq_file *sfile, void *v)
+{
+  int cpu;
+  unsigned int i;
+  unsigned long sum;
+  struct sleepy_dev *dev = sfile->private;
+
+  seq_puts(sfile, "wake-to-run latency (ns):\n");
+
+  for (i = 0; i < SLEEPY_LAT_BUCKETS; i++)
+  {
+    sum = 0;
+    for_each_possible_cpu(cpu)
+      sum += per_cpu_ptr(dev->stats, cpu)->lat[i];
+
+    if (sum != 0)
+      seq_printf(sfile, "  %10llu - %-10llu %lu\n", i ? 1ULL << i : 0,
+                 (2ULL << i) - 1, sum);
+  }
+
+  return 0;
+}
+
+static int sleepy_lat_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sleepy_lat_show, inode->i_private);
+}
+
+static ssize_t sleepy_lat_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos)
+{
+  int cpu;
+  struct sleepy_dev *dev = ((struct seq_file *) file->private_data)->private;
+
+  // racing increments may survive, which is fine for statistics
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct sleepy_stats));
+
+  return count;
+}
+
+static const struct file_operations sleepy_lat_fops = {
+  .owner        = THIS_MODULE,
+  .open         = sleepy_lat_open,
+  .read         = seq_read,
+  .write        = sleepy_lat_write,
+  .llseek       = seq_lseek,
+  .release      = single_release
+};
+
 static void sleepy_cleanup_module(void)
 {
+  unsigned int i;
   dev_t devno;
 
   devno = MKDEV(sleepy_major, sleepy_minor);
 
+  // no problem if it was not previously created
+  debugfs_remove_recursive(sleepy_debugfs_root);
+
   if (sleepy_cdev != NULL)
   {
     cdev_del(sleepy_cdev);
     kfree(sleepy_cdev);
   }
 
-  unregister_chrdev_region(devno, 1);
+  if (sleepy_devices != NULL)
+  {
+    for (i = 0; i < sleepy_nr_devs; i++)
+      free_percpu(sleepy_devices[i].stats);
+    kfree(sleepy_devices);
+  }
+
+  unregister_chrdev_region(devno, sleepy_nr_devs);
 }
 
 static int __init sleepy_init_module(void)
 {
   int result;
+  unsigned int i;
+  char name[16];
   dev_t devno;
 
+  if (sleepy_nr_devs == 0)
+    return -EINVAL;
+
   if (sleepy_major)
   {
     devno = MKDEV(sleepy_major, sleepy_minor);
-    result = register_chrdev_region(devno, 1, "sleepy");
+    result = register_chrdev_region(devno, sleepy_nr_devs, "sleepy");
   }
   else
   {
-    result = alloc_chrdev_region(&devno, sleepy_minor, 1, "sleepy");
+    result = alloc_chrdev_region(&devno, sleepy_minor, sleepy_nr_devs, "sleepy");
     sleepy_major = MAJOR(devno);
   }
 
@@ -132,6 +354,32 @@ static int __init sleepy_init_module(void)
     return result;
   }
 
+  sleepy_devices = kcalloc(sleepy_nr_devs, sizeof(struct sleepy_dev), GFP_KERNEL);
+  if (sleepy_devices == NULL)
+  {
+    result = -ENOMEM;
+    goto failed;
+  }
+
+  sleepy_debugfs_root = debugfs_create_dir("sleepy", NULL);
+
+  for (i = 0; i < sleepy_nr_devs; i++)
+  {
+    atomic64_set(&sleepy_devices[i].count, 0);
+    init_waitqueue_head(&sleepy_devices[i].wq);
+
+    sleepy_devices[i].stats = alloc_percpu(struct sleepy_stats);
+    if (sleepy_devices[i].stats == NULL)
+    {
+      result = -ENOMEM;
+      goto failed;
+    }
+
+    snprintf(name, sizeof(name), "sleepy%u", i);
+    debugfs_create_file(name, 0644, sleepy_debugfs_root, sleepy_devices + i,
+                        &sleepy_lat_fops);
+  }
+
   sleepy_cdev = kmalloc(sizeof(struct cdev), GFP_KERNEL);
   if (sleepy_cdev == NULL)
   {
@@ -139,9 +387,10 @@ static int __init sleepy_init_module(void)
     goto failed;
   }
 
+  // a single cdev covers all the minors
   cdev_init(sleepy_cdev, &sleepy_fops);
   sleepy_cdev->owner = THIS_MODULE;
-  result = cdev_add(sleepy_cdev, devno, 1);
+  result = cdev_add(sleepy_cdev, devno, sleepy_nr_devs);
   if (result)
     goto failed;
 
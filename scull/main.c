@@ -29,66 +29,99 @@
 #include <linux/fcntl.h>          // O_ACCMODE
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/uio.h>            // iov_iter
+#include <linux/mm.h>             // mmap, alloc_pages_exact()
+#include <linux/version.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/debugfs.h>
+#include <linux/falloc.h>         // FALLOC_FL_*
+#include <linux/percpu.h>
+#include <linux/log2.h>           // ilog2()
+#include <linux/ktime.h>
+#include <linux/capability.h>     // capable()
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/shrinker.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>           // fd_install()
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>          // pfn_to_pfn_t()
+#endif
 
 #include <linux/uaccess.h>        // copy_(from|to)_user
 
 #include "scull.h"
 #include "proc_ops_version.h"     // proc_ops_wrapper() - macro
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 // parameters which can be set at load time
 unsigned int scull_major = SCULL_MAJOR;
 unsigned int scull_minor = 0;
 unsigned int scull_nr_devs = SCULL_NR_DEVS;
 unsigned int scull_quantum = SCULL_QUANTUM;
 unsigned int scull_qset = SCULL_QSET;
-
+unsigned int scull_pool_max = SCULL_POOL_MAX;
+unsigned long scull_max_bytes = SCULL_MAX_BYTES;
+unsigned long scull_global_max_bytes = SCULL_GLOBAL_MAX_BYTES;
+unsigned int scull_compress_ms = SCULL_COMPRESS_MS;
+bool scull_dedup = SCULL_DEDUP;
+bool scull_log = SCULL_LOG;
 
 module_param(scull_major, uint, S_IRUGO);
 module_param(scull_minor, uint, S_IRUGO);
 module_param(scull_nr_devs, uint, S_IRUGO);
 module_param(scull_quantum, uint, S_IRUGO);
 module_param(scull_qset, uint, S_IRUGO);
+module_param(scull_pool_max, uint, S_IRUGO | S_IWUSR);
+module_param(scull_max_bytes, ulong, S_IRUGO | S_IWUSR);
+module_param(scull_global_max_bytes, ulong, S_IRUGO | S_IWUSR);
+module_param(scull_dedup, bool, S_IRUGO | S_IWUSR);
+module_param(scull_log, bool, S_IRUGO | S_IWUSR);
 
 struct scull_dev * scull_devices;
 
+static DEFINE_MUTEX(scull_compress_lock);
+static bool scull_devices_live;       // set up, their workers may be kicked
+
 /*
- * scull_trim - empty out the scull device; must be called with
- * the deice lock held.
- * @dev:        scull device
+ * scull_compress_ms_set - store "scull_compress_ms" and start or stop the
+ * compression workers accordingly
+ * @val:        the new value, as written to the parameter
+ * @kp:         the parameter
  *
  * Return:
- * always return 0.
+ * 0 on success or appropriate errno value on error.
  */
 
-int scull_trim(struct scull_dev * dev)
+static int scull_compress_ms_set(const char * val, const struct kernel_param * kp)
 {
-  unsigned int qset, i;
-  struct scull_qset * next, * curr;
-
-  qset = dev->qset;
+  int retval;
+  unsigned int i;
 
-  for (curr = dev->data; curr != NULL; curr = next)
-  {
-    if (curr->data != NULL)
-    {
-      for (i = 0; i < qset; i++)
-        kfree(curr->data[i]);
-      kfree(curr->data);
-      curr->data = NULL;
-    }
+  mutex_lock(&scull_compress_lock);
 
-    next = curr->next;
-    kfree(curr);
-  }
+  retval = param_set_uint(val, kp);
+  for (i = 0; (retval == 0) && scull_devices_live && (i < scull_nr_devs); i++)
+    scull_compress_kick(scull_devices + i);
 
-  dev->size = 0;
-  dev->quantum = scull_quantum;
-  dev->qset = scull_qset;
-  dev->data = NULL;
+  mutex_unlock(&scull_compress_lock);
 
-  return 0;
+  return retval;
 }
 
+static const struct kernel_param_ops scull_compress_ms_ops = {
+  .set = scull_compress_ms_set,
+  .get = param_get_uint
+};
+
+module_param_cb(scull_compress_ms, &scull_compress_ms_ops, &scull_compress_ms,
+                S_IRUGO | S_IWUSR);
+
+static struct dentry * scull_debugfs_root;
+
 #ifdef SCULL_DEBUG    // use proc file only if in debugging mode
 
 /*
@@ -117,33 +150,39 @@ static void * scull_seq_next(struct seq_file * sfile, void * v, loff_t * pos)
 static int scull_seq_show(struct seq_file * sfile, void * v)
 {
   int i;
+  unsigned long item;
   struct scull_dev * dev;
-  struct scull_qset * qset;
+  struct scull_qset * qset, * last;
 
   dev = (struct scull_dev *) v;
+  last = NULL;
 
-  if (mutex_lock_interruptible(&dev->mtx_lock))
+  if (down_read_interruptible(&dev->rwsem))
     return -ERESTARTSYS;
 
-  seq_printf(sfile, "Device %u: qset: %u, quantum: %u, size: %lu\n",
-              (unsigned int) (dev - scull_devices), dev->qset, dev->quantum, dev->size);
+  seq_printf(sfile, "Device %u: qset: %u, quantum: %u, size: %ld\n",
+              (unsigned int) (dev - scull_devices), dev->qset, dev->quantum,
+              atomic_long_read(&dev->size));
 
-  for (qset = dev->data; qset != NULL, qset = qset->next)
+  xa_for_each(&dev->index->qsets, item, qset)
   {
-    seq_printf(sfile, "\titem at %p, qset %p\n", qset, qset->data);
+    seq_printf(sfile, "\titem %lu at %p, qset %p\n", item, qset, qset->data);
+    last = qset;
+  }
 
-    if ((qset->data != NULL) && (qset->next == NULL)) // dump only the last item
+  if (last != NULL) // dump only the last item
+  {
+    down_read(&last->rwsem);
+    for (i = 0; (last->data != NULL) && (i < dev->qset); i++)
     {
-      for (i = 0; i < dev->qset; i++)
-      {
-        if (qset->data[i] != NULL)
-          seq_printf(sfile, "\t\t%4d: %8p\n", i, dev->data[i]);
-      }
+      if (last->data[i] != NULL)
+        seq_printf(sfile, "\t\t%4d: %8p\n", i, last->data[i]);
     }
+    up_read(&last->rwsem);
   }
 
   seq_putc(sfile, '\n');
-  mutex_unlock(&dev->mtx_lock);
+  up_read(&dev->rwsem);
 
   return 0;
 }
@@ -203,6 +242,226 @@ static void scull_remove_proc(void)
 
 #endif /* SCULL_DEBUG */
 
+/*
+ * Per-device debugfs files, under <debugfs>/scull/scullN/.
+ */
+
+static int scull_pool_show(struct seq_file * sfile, void * v)
+{
+  unsigned int count;
+  unsigned long hits, misses;
+  struct scull_dev * dev;
+
+  dev = sfile->private;
+
+  spin_lock(&dev->pool.lock);
+  count = dev->pool.count;
+  hits = dev->pool.hits;
+  misses = dev->pool.misses;
+  spin_unlock(&dev->pool.lock);
+
+  seq_printf(sfile, "quanta: %u\n", count);
+  seq_printf(sfile, "bytes: %lu\n", (unsigned long) count * dev->quantum);
+  seq_printf(sfile, "max: %u\n", scull_pool_max);
+  seq_printf(sfile, "hits: %lu\n", hits);
+  seq_printf(sfile, "misses: %lu\n", misses);
+  seq_printf(sfile, "hit rate: %lu%%\n", (hits + misses) ? hits * 100 / (hits + misses) : 0);
+
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_pool);
+
+static const char * const scull_stat_names[SCULL_STAT_NR] = {
+  [SCULL_STAT_READ_OPS]             = "read_ops",
+  [SCULL_STAT_READ_BYTES]           = "read_bytes",
+  [SCULL_STAT_WRITE_OPS]            = "write_ops",
+  [SCULL_STAT_WRITE_BYTES]          = "write_bytes",
+  [SCULL_STAT_FOLLOW]               = "follow",
+  [SCULL_STAT_CURSOR_HITS]          = "cursor_hits",
+  [SCULL_STAT_QUANTUM_ALLOC]        = "quantum_alloc",
+  [SCULL_STAT_QUANTUM_FREE]         = "quantum_free",
+  [SCULL_STAT_QSET_ALLOC]           = "qset_alloc",
+  [SCULL_STAT_QSET_FREE]            = "qset_free",
+  [SCULL_STAT_LOCK_CONTENDED]       = "lock_contended",
+  [SCULL_STAT_LOCK_WAIT_NS]         = "lock_wait_ns",
+  [SCULL_STAT_QSET_LOCK_CONTENDED]  = "qset_lock_contended",
+  [SCULL_STAT_QSET_LOCK_WAIT_NS]    = "qset_lock_wait_ns",
+  [SCULL_STAT_EVICTED]              = "evicted",
+  [SCULL_STAT_COMPRESSED]           = "compressed",
+  [SCULL_STAT_INFLATED]             = "inflated",
+  [SCULL_STAT_ZERO_ELIDED]          = "zero_elided",
+  [SCULL_STAT_DEDUP_HITS]           = "dedup_hits",
+  [SCULL_STAT_DEDUP_MISSES]         = "dedup_misses",
+  [SCULL_STAT_DEDUP_COW]            = "dedup_cow",
+  [SCULL_STAT_SNAP_SAVED]           = "snap_saved",
+  [SCULL_STAT_LOG_WAITS]            = "log_waits"
+};
+
+static const char * const scull_lat_names[SCULL_LAT_NR] = {
+  [SCULL_LAT_READ]  = "read",
+  [SCULL_LAT_WRITE] = "write",
+  [SCULL_LAT_TRIM]  = "trim",
+  [SCULL_LAT_INFLATE] = "inflate"
+};
+
+/*
+ * scull_stat_sum - add up a statistics counter over all CPUs
+ * @dev:        scull device
+ * @item:       the counter
+ */
+
+static unsigned long scull_stat_sum(struct scull_dev * dev, enum scull_stat item)
+{
+  int cpu;
+  unsigned long sum;
+
+  sum = 0;
+  for_each_possible_cpu(cpu)
+    sum += per_cpu_ptr(dev->stats, cpu)->count[item];
+
+  return sum;
+}
+
+/*
+ * The "stats" file sums the per-CPU counters up and prints the non-empty
+ * buckets of each latency histogram. Writing anything to it resets them.
+ */
+
+static int scull_stats_show(struct seq_file * sfile, void * v)
+{
+  int cpu;
+  unsigned int i, j;
+  unsigned long sum;
+  struct scull_dev * dev;
+
+  dev = sfile->private;
+
+  for (i = 0; i < SCULL_STAT_NR; i++)
+    seq_printf(sfile, "%s: %lu\n", scull_stat_names[i], scull_stat_sum(dev, i));
+
+  for (i = 0; i < SCULL_LAT_NR; i++)
+  {
+    seq_printf(sfile, "\n%s latency (ns):\n", scull_lat_names[i]);
+
+    for (j = 0; j < SCULL_LAT_BUCKETS; j++)
+    {
+      sum = 0;
+      for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(dev->stats, cpu)->lat[i][j];
+
+      if (sum != 0)
+        seq_printf(sfile, "  %10llu - %-10llu %lu\n", j ? 1ULL << j : 0,
+                    (2ULL << j) - 1, sum);
+    }
+  }
+
+  return 0;
+}
+
+static int scull_stats_open(struct inode * inode, struct file * file)
+{
+  return single_open(file, scull_stats_show, inode->i_private);
+}
+
+static ssize_t scull_stats_write(struct file * file, const char __user * buf,
+                                 size_t count, loff_t * ppos)
+{
+  int cpu;
+  struct scull_dev * dev;
+
+  dev = ((struct seq_file *) file->private_data)->private;
+
+  // racing increments may survive, which is fine for statistics
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct scull_stats));
+
+  return count;
+}
+
+static const struct file_operations scull_stats_fops = {
+  .owner        = THIS_MODULE,
+  .open         = scull_stats_open,
+  .read         = seq_read,
+  .write        = scull_stats_write,
+  .llseek       = seq_lseek,
+  .release      = single_release
+};
+
+/*
+ * scull_compress_show - the debugfs "compress" file: what the compression
+ * worker saves on a device
+ */
+
+static int scull_compress_show(struct seq_file * sfile, void * v)
+{
+  unsigned long zquanta, zbytes, raw;
+  struct scull_dev * dev;
+
+  dev = sfile->private;
+
+  zquanta = atomic_long_read(&dev->zquanta);
+  zbytes = atomic_long_read(&dev->zbytes);
+  raw = zquanta * READ_ONCE(dev->quantum);
+
+  seq_printf(sfile, "period: %u ms\n", READ_ONCE(scull_compress_ms));
+  seq_printf(sfile, "quanta: %lu\n", zquanta);
+  seq_printf(sfile, "raw bytes: %lu\n", raw);
+  seq_printf(sfile, "stored bytes: %lu\n", zbytes);
+  seq_printf(sfile, "saved bytes: %lu\n", (raw > zbytes) ? raw - zbytes : 0);
+  seq_printf(sfile, "ratio: %lu.%02lu\n", zbytes ? raw / zbytes : 0,
+             zbytes ? (raw % zbytes) * 100 / zbytes : 0);
+  seq_printf(sfile, "compressed: %lu\n", scull_stat_sum(dev, SCULL_STAT_COMPRESSED));
+  seq_printf(sfile, "inflated: %lu\n", scull_stat_sum(dev, SCULL_STAT_INFLATED));
+  seq_printf(sfile, "cached: %ld\n", atomic_long_read(&dev->zcached));
+
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_compress);
+
+/*
+ * scull_dedup_show - the debugfs "dedup" file: what zero elision and
+ * deduplication save on a device
+ */
+
+static int scull_dedup_show(struct seq_file * sfile, void * v)
+{
+  unsigned long zero, hits, misses, saved, quantum;
+  struct scull_dev * dev;
+
+  dev = sfile->private;
+
+  quantum = READ_ONCE(dev->quantum);
+  zero = scull_stat_sum(dev, SCULL_STAT_ZERO_ELIDED);
+  hits = scull_stat_sum(dev, SCULL_STAT_DEDUP_HITS);
+  misses = scull_stat_sum(dev, SCULL_STAT_DEDUP_MISSES);
+  saved = atomic_long_read(&dev->dedup_saved);
+
+  seq_printf(sfile, "enabled: %d\n", READ_ONCE(scull_dedup));
+  seq_printf(sfile, "zero quanta: %lu\n", zero);
+  seq_printf(sfile, "zero bytes: %lu\n", zero * quantum);
+  seq_printf(sfile, "hits: %lu\n", hits);
+  seq_printf(sfile, "misses: %lu\n", misses);
+  seq_printf(sfile, "hit rate: %lu%%\n", (hits + misses) ? hits * 100 / (hits + misses) : 0);
+  seq_printf(sfile, "copies on write: %lu\n", scull_stat_sum(dev, SCULL_STAT_DEDUP_COW));
+  seq_printf(sfile, "shared quanta saved: %lu\n", saved);
+  seq_printf(sfile, "shared bytes saved: %lu\n", saved * quantum);
+
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_dedup);
+
+static void scull_debugfs_create(struct scull_dev * dev, unsigned int index)
+{
+  char name[16];
+
+  snprintf(name, sizeof(name), "scull%u", index);
+  dev->debugfs = debugfs_create_dir(name, scull_debugfs_root);
+  debugfs_create_file("pool", 0444, dev->debugfs, dev, &scull_pool_fops);
+  debugfs_create_file("stats", 0644, dev->debugfs, dev, &scull_stats_fops);
+  debugfs_create_file("compress", 0444, dev->debugfs, dev, &scull_compress_fops);
+  debugfs_create_file("dedup", 0444, dev->debugfs, dev, &scull_dedup_fops);
+}
+
 /*
  * scull_open - open the scull device
  * @inode:      inode structure for that device
@@ -214,26 +473,50 @@ static void scull_remove_proc(void)
 
 int scull_open(struct inode * inode, struct file * flip)
 {
+  int retval;
   struct scull_dev * dev;       // device information
+  struct scull_file * sf;       // per open file state
 
   dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-  flip->private_data = dev;     // save the pointer for other methods
+
+  sf = kzalloc(sizeof(struct scull_file), GFP_KERNEL);
+  if (sf == NULL)
+    return -ENOMEM;
+
+  sf->dev = dev;
+  spin_lock_init(&sf->lock);
 
   // trim the length of the device to 0 , if it was open was write-only
   if ((flip->f_flags & O_ACCMODE) == O_WRONLY)
   {
-    if (mutex_lock_interruptible(&dev->mtx_lock))
+    if (scull_lock_write(dev))
+    {
+      kfree(sf);
+      trace_scull_open(dev, flip->f_flags, -ERESTARTSYS);
       return -ERESTARTSYS;
+    }
 
-    scull_trim(dev);
-    mutex_unlock(&dev->mtx_lock);
+    // mappings would otherwise keep showing the old pages
+    unmap_mapping_range(flip->f_mapping, 0, 0, 1);
+    retval = scull_trim(dev);
+    up_write(&dev->rwsem);
+
+    if (retval)
+    {
+      kfree(sf);
+      trace_scull_open(dev, flip->f_flags, retval);
+      return retval;
+    }
   }
 
+  flip->private_data = sf;      // save the pointer for other methods
+  trace_scull_open(dev, flip->f_flags, 0);
+
   return 0;
 }
 
 /*
- * scull_open - release the scull device (does nothing)
+ * scull_release - release the scull device
  * @inode:      inode structure for that device
  * @flip:       file pointer to the special "device file" for that device
  *
@@ -243,193 +526,360 @@ int scull_open(struct inode * inode, struct file * flip)
 
 int scull_release(struct inode * inode, struct file * flip)
 {
+  kfree(flip->private_data);
   return 0;
 }
 
 /*
- * scull_follow - follow the list and return the nth element in the linked-list
- * @dev         scull device
- * @n           index of the list [0..)
+ * scull_fallocate - punch a hole or zero a range of the device
+ * @flip:         file pointer to the special "device file" for that device
+ * @mode:         FALLOC_FL_PUNCH_HOLE (with FALLOC_FL_KEEP_SIZE) or
+ *                FALLOC_FL_ZERO_RANGE, optionally with FALLOC_FL_KEEP_SIZE
+ * @off:          start of the range
+ * @len:          length of the range
+ *
+ * Both modes release the quanta of the range in place; zeroing a range
+ * past the end of the device grows it unless FALLOC_FL_KEEP_SIZE is set.
+ * The VFS refuses fallocate(2) on character devices, so this is reached
+ * through the SCULL_IOCFALLOCATE ioctl.
  *
  * Return:
- * address of nth element on success or NULL on error.
+ * 0 on success or appropriate errno value on error.
  */
 
-struct scull_qset * scull_follow(struct scull_dev * dev, unsigned long n)
+long scull_fallocate(struct file * flip, int mode, loff_t off, loff_t len)
 {
-  struct scull_qset * qset;
+  int retval;
+  struct scull_dev * dev;
 
-  qset = dev->data;
+  dev = ((struct scull_file *) flip->private_data)->dev;
+
+  if ((off < 0) || (len <= 0) || (off > LLONG_MAX - len))
+    return -EINVAL;
 
-  // allocate the first qset if needed
-  if (qset == NULL)
+  switch (mode)
   {
-    qset = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-    if (qset == NULL)
-      return NULL;
+    case FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE:
+    case FALLOC_FL_ZERO_RANGE:
+    case FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE:
+      break;
+    default:
+      return -EOPNOTSUPP;
+  }
 
-    dev->data = qset;
+  if (down_read_interruptible(&dev->rwsem))
+    return -ERESTARTSYS;
 
-    SCULL_QSET_INIT(qset);
-  }
+  // mappings of the range would keep showing the released pages
+  unmap_mapping_range(flip->f_mapping, off, len, 1);
+  retval = scull_punch_range(dev, off, len);
 
-  // then follow the list
-  for (; n > 0; n--)
-  {
-    if (qset->next == NULL)
-    {
-      qset->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-      if (qset->next == NULL)
-        return NULL;
+  if ((retval == 0) && !(mode & FALLOC_FL_KEEP_SIZE))
+    scull_size_extend(dev, off + len);
 
-      SCULL_QSET_INIT(qset->next);
-    }
+  up_read(&dev->rwsem);
 
-    qset = qset->next;
-  }
+  return retval;
+}
+
+/*
+ * scull_reshape - change the geometry of an empty device
+ * @dev:          scull device
+ * @quantum:      new quantum size, 0 keeps the current one
+ * @qset:         new quantum set size, 0 keeps the current one
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error.
+ */
+
+static int scull_reshape(struct scull_dev * dev, unsigned int quantum, unsigned int qset)
+{
+  int retval;
+
+  if (scull_lock_write(dev))
+    return -ERESTARTSYS;
+
+  retval = scull_storage_reshape(dev, quantum ? quantum : dev->quantum,
+                                  qset ? qset : dev->qset);
+
+  up_write(&dev->rwsem);
 
-  return qset;
+  return retval;
 }
 
 /*
- * scull_read -   read data from the device
- * @flip:         file pointer to the special "device file" for that device
- * @buf           buffer (userspace)
- * @count:        amount of data requested
- * @f_pos:        current offset
+ * scull_stats_copy - fill a struct scull_ioc_stats for userspace
+ * @dev:          scull device
+ * @arg:          userspace address of the struct
  *
  * Return:
- * number of bytes read on success or appropriate errno value on error.
+ * 0 on success or -EFAULT.
  */
-ssize_t scull_read(struct file * flip, char __user * buf, size_t count,
-                    loff_t * f_pos)
+
+static int scull_stats_copy(struct scull_dev * dev, void __user * arg)
 {
-  unsigned int quantum, qset;
-  unsigned long itemsize, item, qindx, qoff, rest;
-  ssize_t retval;
-  struct scull_dev * dev;
-  struct scull_qset * qsetp;
+  struct scull_ioc_stats st;
+
+  memset(&st, 0, sizeof(st));
+
+  st.size = atomic_long_read(&dev->size);
+  st.quantum = READ_ONCE(dev->quantum);
+  st.qset = READ_ONCE(dev->qset);
+  st.pool_quanta = READ_ONCE(dev->pool.count);
+  st.read_ops = scull_stat_sum(dev, SCULL_STAT_READ_OPS);
+  st.read_bytes = scull_stat_sum(dev, SCULL_STAT_READ_BYTES);
+  st.write_ops = scull_stat_sum(dev, SCULL_STAT_WRITE_OPS);
+  st.write_bytes = scull_stat_sum(dev, SCULL_STAT_WRITE_BYTES);
+  st.quantum_alloc = scull_stat_sum(dev, SCULL_STAT_QUANTUM_ALLOC);
+  st.quantum_free = scull_stat_sum(dev, SCULL_STAT_QUANTUM_FREE);
+  st.qset_alloc = scull_stat_sum(dev, SCULL_STAT_QSET_ALLOC);
+  st.qset_free = scull_stat_sum(dev, SCULL_STAT_QSET_FREE);
+  st.lock_contended = scull_stat_sum(dev, SCULL_STAT_LOCK_CONTENDED);
+  st.lock_wait_ns = scull_stat_sum(dev, SCULL_STAT_LOCK_WAIT_NS);
+
+  if (copy_to_user(arg, &st, sizeof(st)))
+    return -EFAULT;
 
-  dev = flip->private_data;
-  quantum = dev->quantum;
-  qset = dev->qset;
-  itemsize = quantum * qset;
-  retval = 0;
+  return 0;
+}
 
-  if (mutex_lock_interruptible(&dev->mtx_lock))
-    return -ERESTARTSYS;
+/*
+ * scull_limit_set - change the memory cap of a device
+ * @dev:          scull device
+ * @lim:          new cap and flags, "used_bytes" is ignored
+ *
+ * A cache-like device already over its new cap gives the difference back
+ * right away, an ordinary one only stops growing.
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error.
+ */
 
-  if (*f_pos >= dev->size)
-    goto done;
-  if (*f_pos + count > dev->size)
-    count = dev->size - *f_pos;
+static int scull_limit_set(struct scull_dev * dev, const struct scull_ioc_limit * lim)
+{
+  long over;
+  unsigned long max, nr, freed;
 
-  // find listitem, qset index and offset in that quantum
-  item = (unsigned long) *f_pos / itemsize;
-  rest = (unsigned long) *f_pos % itemsize;
-  qindx = rest / quantum;
-  qoff = rest % quantum;
+  if (lim->flags & ~SCULL_LIMIT_CACHE)
+    return -EINVAL;
+  if (lim->max_bytes > ULONG_MAX)
+    return -EINVAL;
 
-  // follow the list up to the right position
-  qsetp = scull_follow(dev, item);
+  // the geometry must not change while evicting
+  if (scull_lock_read(dev))
+    return -ERESTARTSYS;
 
-  if ((qsetp == NULL) || (qsetp->data == NULL) || (qsetp->data[qindx] == NULL))
-    goto done;
+  WRITE_ONCE(dev->max_bytes, lim->max_bytes);
+  WRITE_ONCE(dev->flags, lim->flags);
 
-  // read only up to the end of this quantum
-  if (count > quantum - qoff)
-    count = quantum - qoff;
+  max = lim->max_bytes ? lim->max_bytes : READ_ONCE(scull_max_bytes);
 
-  if (copy_to_user(buf, qsetp->data[qindx] + qoff, count))
+  while ((lim->flags & SCULL_LIMIT_CACHE) && (max != 0) && !fatal_signal_pending(current))
   {
-    retval = -EFAULT;
-    goto done;
+    over = atomic_long_read(&dev->mem) - (long) max;
+    if (over <= 0)
+      break;
+
+    nr = DIV_ROUND_UP(over, dev->quantum);
+    freed = scull_pool_shrink(dev, nr);
+    if (freed < nr)
+      freed += scull_evict(dev, nr - freed);
+    if (freed == 0)
+      break;
   }
 
-  *f_pos += count;
-  retval = count;
+  up_read(&dev->rwsem);
 
-done:
-  mutex_unlock(&dev->mtx_lock);
-  return retval;
+  return 0;
+}
+
+static loff_t scull_snap_llseek(struct file * flip, loff_t off, int whence)
+{
+  struct scull_snap * snap;
+
+  snap = flip->private_data;
+
+  return fixed_size_llseek(flip, off, whence, snap->size);
+}
+
+static int scull_snap_release_file(struct inode * inode, struct file * flip)
+{
+  scull_snap_release(flip->private_data);
+  return 0;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define scull_copy_splice_read generic_file_splice_read
+#else
+#define scull_copy_splice_read copy_splice_read
+#endif
+
+static const struct file_operations scull_snap_fops = {
+  .owner        = THIS_MODULE,
+  .llseek       = scull_snap_llseek,
+  .read_iter    = scull_snap_read_iter,
+  .splice_read  = scull_copy_splice_read,
+  .release      = scull_snap_release_file
+};
+
 /*
- * scull_write -  write data to the device
- * @flip:         file pointer to the special "device file" for that device
- * @buf           buffer (userspace)
- * @count:        amount of data requested
- * @f_pos:        current offset
+ * scull_snapshot - take a snapshot of a device
+ * @dev:          scull device
+ *
+ * The device lock is only held long enough to let the I/O in flight
+ * finish, the snapshot never blocks the device afterwards.
  *
  * Return:
- * number of bytes written on success or appropriate errno value on error.
+ * a new file descriptor reading the snapshot or appropriate errno value
+ * on error.
  */
 
-ssize_t scull_write(struct file * flip, const char __user * buf, size_t count,
-                   loff_t * f_pos)
+static int scull_snapshot(struct scull_dev * dev)
 {
-  unsigned int quantum, qset;
-  unsigned long itemsize, item, qindx, qoff, rest;
-  ssize_t retval;
-  struct scull_dev * dev;
-  struct scull_qset * qsetp;
+  int fd;
+  struct file * file;
+  struct scull_snap * snap;
 
-  dev = flip->private_data;
-  quantum = dev->quantum;
-  qset = dev->qset;
-  itemsize = quantum * qset;
-  retval = -ENOMEM;
+  fd = get_unused_fd_flags(O_CLOEXEC);
+  if (fd < 0)
+    return fd;
 
-  if (mutex_lock_interruptible(&dev->mtx_lock))
+  if (scull_lock_write(dev))
+  {
+    put_unused_fd(fd);
     return -ERESTARTSYS;
+  }
 
-  // find listitem, qset index and offset in that quantum
-  item = (unsigned long) *f_pos / itemsize;
-  rest = (unsigned long) *f_pos % itemsize;
-  qindx = rest / quantum;
-  qoff = rest % quantum;
+  snap = scull_snap_create(dev);
+  up_write(&dev->rwsem);
 
-  // follow the list up to the right position
-  qsetp = scull_follow(dev, item);
-  if (qsetp == NULL)
-    goto done;
-
-  if (qsetp->data == NULL)
+  if (IS_ERR(snap))
   {
-    qsetp->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-    if (qsetp->data == NULL)
-      goto done;
-
-    memset(qsetp->data, 0, qset * sizeof(char *));
+    put_unused_fd(fd);
+    return PTR_ERR(snap);
   }
 
-  if (qsetp->data[qindx] == NULL)
+  file = anon_inode_getfile("[scull-snapshot]", &scull_snap_fops, snap, O_RDONLY);
+  if (IS_ERR(file))
   {
-    qsetp->data[qindx] = kmalloc(quantum * sizeof(char), GFP_KERNEL);
-    if (qsetp->data[qindx] == NULL)
-      goto done;
+    scull_snap_release(snap);
+    put_unused_fd(fd);
+    return PTR_ERR(file);
   }
 
-  // writes only up to the end of this quantum
-  if (count > quantum - qoff)
-    count = quantum - qoff;
+  // anon inode files are streams, a snapshot has a size and offsets
+  file->f_mode |= FMODE_PREAD;
+#ifdef FMODE_LSEEK
+  file->f_mode |= FMODE_LSEEK;
+#endif
 
-  if (copy_from_user(qsetp->data[qindx] + qoff, buf, count))
-  {
-    retval = -EFAULT;
-    goto done;
-  }
+  fd_install(fd, file);
 
-  *f_pos += count;
-  retval = count;
+  return fd;
+}
 
-  // update the size
-  if (dev->size < *f_pos)
-    dev->size = *f_pos;
+/*
+ * scull_ioctl - the ioctl() implementation
+ * @flip:         file pointer to the special "device file" for that device
+ * @cmd:          one of the SCULL_IOC* commands
+ * @arg:          argument of the command, usually a userspace pointer
+ *
+ * Return:
+ * 0 (or a command specific value) on success or appropriate errno value
+ * on error.
+ */
 
-done:
-  mutex_unlock(&dev->mtx_lock);
-  return retval;
+long scull_ioctl(struct file * flip, unsigned int cmd, unsigned long arg)
+{
+  int retval;
+  u32 val;
+  u64 bytes;
+  struct scull_falloc fa;
+  struct scull_ioc_limit lim;
+  struct scull_dev * dev;
+
+  dev = ((struct scull_file *) flip->private_data)->dev;
+
+  // don't even decode wrong commands
+  if ((_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) || (_IOC_NR(cmd) > SCULL_IOC_MAXNR))
+    return -ENOTTY;
+
+  switch (cmd)
+  {
+    case SCULL_IOCRESET:
+      if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+      return scull_reshape(dev, scull_quantum, scull_qset);
+
+    case SCULL_IOCSQUANTUM:
+      if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+      if (get_user(val, (u32 __user *) arg))
+        return -EFAULT;
+      return scull_reshape(dev, val, 0);
+
+    case SCULL_IOCSQSET:
+      if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+      if (get_user(val, (u32 __user *) arg))
+        return -EFAULT;
+      return scull_reshape(dev, 0, val);
+
+    case SCULL_IOCGQUANTUM:
+      return put_user((u32) READ_ONCE(dev->quantum), (u32 __user *) arg);
+
+    case SCULL_IOCGQSET:
+      return put_user((u32) READ_ONCE(dev->qset), (u32 __user *) arg);
+
+    case SCULL_IOCRESERVE:
+      if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+      if (get_user(bytes, (u64 __user *) arg))
+        return -EFAULT;
+
+      // the geometry must not change under the reservation
+      if (scull_lock_read(dev))
+        return -ERESTARTSYS;
+      retval = scull_pool_reserve(dev, bytes);
+      up_read(&dev->rwsem);
+      return retval;
+
+    case SCULL_IOCGSTATS:
+      return scull_stats_copy(dev, (void __user *) arg);
+
+    case SCULL_IOCSLIMIT:
+      if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+      if (copy_from_user(&lim, (void __user *) arg, sizeof(lim)))
+        return -EFAULT;
+      return scull_limit_set(dev, &lim);
+
+    case SCULL_IOCGLIMIT:
+      memset(&lim, 0, sizeof(lim));
+      lim.max_bytes = READ_ONCE(dev->max_bytes);
+      lim.used_bytes = atomic_long_read(&dev->mem);
+      lim.flags = READ_ONCE(dev->flags);
+      if (copy_to_user((void __user *) arg, &lim, sizeof(lim)))
+        return -EFAULT;
+      return 0;
+
+    case SCULL_IOCSNAPSHOT:
+      if (!(flip->f_mode & FMODE_READ))
+        return -EBADF;
+      return scull_snapshot(dev);
+
+    case SCULL_IOCFALLOCATE:
+      if (!(flip->f_mode & FMODE_WRITE))
+        return -EBADF;
+      if (copy_from_user(&fa, (void __user *) arg, sizeof(fa)))
+        return -EFAULT;
+      if ((fa.offset > LLONG_MAX) || (fa.len > LLONG_MAX))
+        return -EINVAL;
+      return scull_fallocate(flip, fa.mode, fa.offset, fa.len);
+
+    default:
+      return -ENOTTY;
+  }
 }
 
 /*
@@ -447,7 +897,7 @@ loff_t scull_llseek(struct file * flip, loff_t off, int whence)
   struct scull_dev * dev;
   loff_t newpos;
 
-  dev = flip->private_data;
+  dev = ((struct scull_file *) flip->private_data)->dev;
 
   switch (whence)
   {
@@ -458,7 +908,17 @@ loff_t scull_llseek(struct file * flip, loff_t off, int whence)
       newpos = flip->f_pos + off;
       break;
     case 2:   // SEEK_END
-      newpos = dev->size + off;
+      newpos = atomic_long_read(&dev->size) + off;
+      break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+      if (down_read_interruptible(&dev->rwsem))
+        return -ERESTARTSYS;
+      newpos = scull_seek_hole_data(dev, off, whence == SEEK_HOLE);
+      up_read(&dev->rwsem);
+
+      if (newpos < 0)
+        return newpos;
       break;
     default:  // should never hanppen
       return -EINVAL;
@@ -471,32 +931,446 @@ loff_t scull_llseek(struct file * flip, loff_t off, int whence)
   return newpos;
 }
 
+// map the zero page read-only for a hole, vmf_insert_mixed() returns VM_FAULT_NOPAGE
+static vm_fault_t scull_vma_map_zero(struct vm_fault * vmf)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+  return vmf_insert_mixed(vmf->vma, vmf->address, pfn_to_pfn_t(my_zero_pfn(vmf->address)));
+#else
+  return vmf_insert_mixed(vmf->vma, vmf->address, my_zero_pfn(vmf->address));
+#endif
+}
+
+/*
+ * scull_vma_fault - map the page backing a faulting address of a scull
+ * mapping
+ * @vmf:          fault description, vmf->pgoff is the page index in the device
+ *
+ * The page is looked up through the quantum set index. Only write faults
+ * of a shared mapping allocate the quantum and extend the device to cover
+ * the page; other faults past the end of the device get SIGBUS. A hole
+ * maps the zero page, unless the mapping is shared and writable: its
+ * pages are writable as soon as they are mapped, so the quantum is
+ * allocated, but the size is left alone.
+ *
+ * Return:
+ * 0 with vmf->page set on success or a VM_FAULT_* code.
+ */
+
+static vm_fault_t scull_vma_fault(struct vm_fault * vmf)
+{
+  unsigned long item, qindx, qoff;
+  loff_t pos;
+  vm_fault_t retval;
+  struct vm_area_struct * vma;
+  struct scull_dev * dev;
+  struct scull_qset * qsetp;
+  void * data;
+  bool fresh, write;
+
+  vma = vmf->vma;
+  dev = vma->vm_private_data;
+  pos = (loff_t) vmf->pgoff << PAGE_SHIFT;
+  retval = VM_FAULT_SIGBUS;
+
+  // a write fault of a private mapping only copies the page
+  write = (vmf->flags & FAULT_FLAG_WRITE) && (vma->vm_flags & VM_SHARED);
+
+  down_read(&dev->rwsem);
+
+  // the geometry may have changed since mmap() through SCULL_IOCSQUANTUM
+  if (!SCULL_PAGE_QUANTA(dev))
+    goto done;
+  if (!write && (pos >= atomic_long_read(&dev->size)))
+    goto done;
+
+  scull_locate(dev, pos, &item, &qindx, &qoff);
+
+  if (!write)
+  {
+    data = NULL;
+    qsetp = xa_load(&dev->index->qsets, item);
+    if (qsetp != NULL)
+    {
+      down_read(&qsetp->rwsem);
+      if ((qsetp->data != NULL) && (qsetp->data[qindx] != NULL))
+      {
+        data = qsetp->data[qindx];
+        vmf->page = virt_to_page(data + qoff);
+        get_page(vmf->page);
+      }
+      up_read(&qsetp->rwsem);
+    }
+
+    retval = 0;
+    if (data != NULL)
+      goto done;
+
+    if ((vma->vm_flags & (VM_SHARED | VM_WRITE)) != (VM_SHARED | VM_WRITE))
+    {
+      retval = scull_vma_map_zero(vmf);
+      goto done;
+    }
+  }
+
+  retval = VM_FAULT_OOM;
+
+  qsetp = scull_follow(dev, item);
+  if (qsetp == NULL)
+    goto done;
+
+  down_write(&qsetp->rwsem);
+  data = scull_qset_fill(dev, qsetp, qindx, &fresh);
+  if (data != NULL)
+  {
+    // the page belongs to the quantum, the mapping takes its own reference
+    vmf->page = virt_to_page(data + qoff);
+    get_page(vmf->page);
+  }
+  up_write(&qsetp->rwsem);
+
+  if (data == NULL)
+    goto done;
+
+  // other mappings of the hole show the zero page
+  if (fresh)
+    unmap_mapping_range(vma->vm_file->f_mapping, pos - qoff, dev->quantum, 0);
+
+  if (write)
+    scull_size_extend(dev, pos + PAGE_SIZE);
+  retval = 0;
+
+done:
+  up_read(&dev->rwsem);
+  return retval;
+}
+
+/*
+ * scull_vma_pfn_mkwrite - write to the zero page mapped for a hole
+ * @vmf:          fault description
+ *
+ * Only a shared mapping made writable by mprotect() gets there. The zero
+ * page is unmapped, the write faults again and gets a quantum of its own.
+ *
+ * Return:
+ * VM_FAULT_NOPAGE, the fault is retried.
+ */
+
+static vm_fault_t scull_vma_pfn_mkwrite(struct vm_fault * vmf)
+{
+  unmap_mapping_range(vmf->vma->vm_file->f_mapping, (loff_t) vmf->pgoff << PAGE_SHIFT,
+                      PAGE_SIZE, 0);
+
+  return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+  .fault        = scull_vma_fault,
+  .pfn_mkwrite  = scull_vma_pfn_mkwrite
+};
+
+/*
+ * scull_mmap -   map the device into a process address space
+ * @flip:         file pointer to the special "device file" for that device
+ * @vma:          the new mapping
+ *
+ * Only devices whose quantum is a whole number of pages can be mapped,
+ * every page of the mapping is then a page of some quantum.
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error.
+ */
+
+int scull_mmap(struct file * flip, struct vm_area_struct * vma)
+{
+  struct scull_dev * dev;
+
+  dev = ((struct scull_file *) flip->private_data)->dev;
+
+  if (!SCULL_PAGE_QUANTA(dev))
+    return -ENODEV;
+
+  // holes map the zero page, which has no struct page of ours
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP;
+#else
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP | VM_MIXEDMAP);
+#endif
+  vma->vm_ops = &scull_vm_ops;
+  vma->vm_private_data = dev;
+
+  return 0;
+}
+
+/*
+ * Pipe buffers holding a page of some quantum. The pipe owns a reference
+ * to the page, which keeps it from being recycled (see
+ * scull_quantum_idle()) or freed while it sits in the pipe.
+ */
+
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+  .confirm      = generic_pipe_buf_confirm,
+  .steal        = generic_pipe_buf_nosteal,
+#endif
+  .release      = generic_pipe_buf_release,
+  .get          = generic_pipe_buf_get
+};
+
+static void scull_spd_release(struct splice_pipe_desc * spd, unsigned int i)
+{
+  put_page(spd->pages[i]);
+}
+
+/*
+ * scull_splice_read - the splice_read() implementation, behind splice()
+ * and sendfile()
+ * @flip:         file pointer to the special "device file" for that device
+ * @ppos:         file offset to read from
+ * @pipe:         the pipe to fill
+ * @len:          number of bytes asked for
+ * @flags:        SPLICE_F_* flags
+ *
+ * With page-backed quanta, the pages themselves go into the pipe, as the
+ * page cache does for regular files: nothing is copied, and like there, a
+ * write to the device shows through pages still sitting in the pipe.
+ * Holes are backed by the zero page. Other geometries copy through
+ * read_iter().
+ *
+ * Return:
+ * number of bytes spliced or appropriate errno value on error.
+ */
+
+static ssize_t scull_splice_read(struct file * flip, loff_t * ppos,
+                                 struct pipe_inode_info * pipe, size_t len,
+                                 unsigned int flags)
+{
+  struct page * pages[PIPE_DEF_BUFFERS];
+  struct partial_page partial[PIPE_DEF_BUFFERS];
+  struct splice_pipe_desc spd = {
+    .pages = pages,
+    .partial = partial,
+    .nr_pages_max = PIPE_DEF_BUFFERS,
+    .ops = &scull_pipe_buf_ops,
+    .spd_release = scull_spd_release
+  };
+  u64 start, elapsed;
+  unsigned long item, qindx, qoff;
+  size_t asked, chunk;
+  loff_t pos, first, size;
+  ssize_t retval;
+  struct scull_dev * dev;
+  struct scull_qset * qsetp;
+  struct page * page;
+
+  dev = ((struct scull_file *) flip->private_data)->dev;
+  pos = *ppos;
+  first = pos;
+  asked = len;
+  start = ktime_get_ns();
+
+  if (scull_lock_read(dev))
+    return -ERESTARTSYS;
+
+  if (!SCULL_PAGE_QUANTA(dev))
+  {
+    up_read(&dev->rwsem);
+    return scull_copy_splice_read(flip, ppos, pipe, len, flags);
+  }
+
+  size = atomic_long_read(&dev->size);
+  if (pos >= size)
+    len = 0;
+  else if (len > size - pos)
+    len = size - pos;
+
+  // a quantum is a whole number of pages, a page never spans two of them
+  while ((len > 0) && (spd.nr_pages < PIPE_DEF_BUFFERS))
+  {
+    scull_locate(dev, pos, &item, &qindx, &qoff);
+    chunk = min_t(size_t, len, PAGE_SIZE - (qoff & ~PAGE_MASK));
+
+    page = ZERO_PAGE(0);
+    qsetp = xa_load(&dev->index->qsets, item);
+    if (qsetp != NULL)
+    {
+      down_read(&qsetp->rwsem);
+      if ((qsetp->data != NULL) && (qsetp->data[qindx] != NULL))
+        page = virt_to_page(qsetp->data[qindx] + qoff);
+      get_page(page);
+      up_read(&qsetp->rwsem);
+    }
+    else
+    {
+      get_page(page);
+    }
+
+    pages[spd.nr_pages] = page;
+    partial[spd.nr_pages].offset = qoff & ~PAGE_MASK;
+    partial[spd.nr_pages].len = chunk;
+    spd.nr_pages++;
+
+    pos += chunk;
+    len -= chunk;
+  }
+
+  up_read(&dev->rwsem);
+
+  // the pages the pipe has no room for are handed back to scull_spd_release()
+  retval = splice_to_pipe(pipe, &spd);
+  if (retval > 0)
+    *ppos += retval;
+
+  if (retval >= 0)
+  {
+    scull_stat_add(dev, SCULL_STAT_READ_OPS, 1);
+    scull_stat_add(dev, SCULL_STAT_READ_BYTES, retval);
+  }
+  elapsed = ktime_get_ns() - start;
+  scull_lat_record(dev, SCULL_LAT_READ, elapsed);
+  trace_scull_read(dev, first, asked, retval, spd.nr_pages, elapsed);
+
+  return retval;
+}
+
 struct file_operations scull_fops = {
   .owner        = THIS_MODULE,
   .llseek       = scull_llseek,
-  .read         = scull_read,
-  .write        = scull_write,
+  .read_iter    = scull_read_iter,
+  .write_iter   = scull_write_iter,
+  .mmap         = scull_mmap,
+  .splice_read  = scull_splice_read,
+  .splice_write = iter_file_splice_write,
+  .unlocked_ioctl = scull_ioctl,
+  .compat_ioctl = compat_ptr_ioctl,
   .open         = scull_open,
   .release      = scull_release
 };
 
 /*
  * scull_setup_cdev - setup char_dev structure for a device
- * @dev:        scull device
- * @index:      index of @dev in "scull_devices" array
+ * @cdev:       char device structure of the device
+ * @fops:       its file operations
+ * @index:      minor number of the device, relative to "scull_minor"
  */
 
-static void scull_setup_cdev(struct scull_dev * dev, unsigned int index)
+void scull_setup_cdev(struct cdev * cdev, const struct file_operations * fops,
+                      unsigned int index)
 {
   int err, devno;
 
   devno = MKDEV(scull_major, scull_minor + index);
 
-  cdev_init(&dev->cdev, &scull_fops);
-  dev->cdev.owner = THIS_MODULE;
-  err = cdev_add(&dev->cdev, devno, 1);
+  cdev_init(cdev, fops);
+  cdev->owner = THIS_MODULE;
+  err = cdev_add(cdev, devno, 1);
   if (err)
-    printk(KERN_NOTICE "SCULL Error %d: adding scull%d\n", err, index);
+    printk(KERN_NOTICE "SCULL Error %d: adding minor %d\n", err, scull_minor + index);
+}
+
+/*
+ * Under memory pressure the shrinker takes back pooled quanta of every
+ * device first, they hold no data, then cold quanta of the cache-like
+ * devices (SCULL_LIMIT_CACHE). It never waits for a lock: reclaim may be
+ * running on behalf of a scull writer holding some of them.
+ */
+
+static unsigned long scull_shrink_count(struct shrinker * shrink, struct shrink_control * sc)
+{
+  unsigned int i;
+  unsigned long count;
+  struct scull_dev * dev;
+
+  count = 0;
+
+  for (i = 0; i < scull_nr_devs; i++)
+  {
+    dev = scull_devices + i;
+
+    // "mem" covers the pool too
+    if (READ_ONCE(dev->flags) & SCULL_LIMIT_CACHE)
+      count += atomic_long_read(&dev->mem) / READ_ONCE(dev->quantum);
+    else
+      count += READ_ONCE(dev->pool.count);
+  }
+
+  return (count != 0) ? count : SHRINK_EMPTY;
+}
+
+static unsigned long scull_shrink_scan(struct shrinker * shrink, struct shrink_control * sc)
+{
+  unsigned int i;
+  unsigned long freed;
+  bool evict;
+  struct scull_dev * dev;
+
+  freed = 0;
+
+  // first pass for the pools, second one for eviction
+  for (evict = false; ; evict = true)
+  {
+    for (i = 0; (i < scull_nr_devs) && (freed < sc->nr_to_scan); i++)
+    {
+      dev = scull_devices + i;
+
+      if (evict && !(READ_ONCE(dev->flags) & SCULL_LIMIT_CACHE))
+        continue;
+      if (!down_read_trylock(&dev->rwsem))
+        continue;
+
+      if (evict)
+        freed += scull_evict(dev, sc->nr_to_scan - freed);
+      else
+        freed += scull_pool_shrink(dev, sc->nr_to_scan - freed);
+
+      up_read(&dev->rwsem);
+    }
+
+    if (evict || (freed >= sc->nr_to_scan))
+      break;
+  }
+
+  return (freed != 0) ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker * scull_shrinker;
+#else
+static struct shrinker scull_shrinker_s = {
+  .count_objects  = scull_shrink_count,
+  .scan_objects   = scull_shrink_scan,
+  .seeks          = DEFAULT_SEEKS
+};
+#endif
+
+static int scull_shrinker_register(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+  scull_shrinker = shrinker_alloc(0, "scull");
+  if (scull_shrinker == NULL)
+    return -ENOMEM;
+
+  scull_shrinker->count_objects = scull_shrink_count;
+  scull_shrinker->scan_objects = scull_shrink_scan;
+  shrinker_register(scull_shrinker);
+
+  return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+  return register_shrinker(&scull_shrinker_s, "scull");
+#else
+  return register_shrinker(&scull_shrinker_s);
+#endif
+}
+
+// no problem if it was not registered
+static void scull_shrinker_unregister(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+  shrinker_free(scull_shrinker);
+  scull_shrinker = NULL;
+#else
+  unregister_shrinker(&scull_shrinker_s);
+#endif
 }
 
 /*
@@ -511,23 +1385,40 @@ static void scull_cleanup_module(void)
 
   devno = MKDEV(scull_major, scull_minor);
 
+  // the devices are about to go, setting the parameter must leave them alone
+  mutex_lock(&scull_compress_lock);
+  scull_devices_live = false;
+  mutex_unlock(&scull_compress_lock);
+
+  // before the devices go away, the shrinker walks them
+  scull_shrinker_unregister();
+
+  // no problem if it was not previously created
+  debugfs_remove_recursive(scull_debugfs_root);
+
+  scull_p_cleanup();
+
   if (scull_devices != NULL)
   {
     for (i = 0; i < scull_nr_devs; i++)
     {
-      scull_trim(scull_devices + i);
-      cdev_del(&scull_devices[i].cdev);
+      // a failed initialization may leave some devices untouched
+      if (scull_devices[i].cdev.ops != NULL)
+        cdev_del(&scull_devices[i].cdev);
+      scull_storage_dev_exit(scull_devices + i);
     }
 
     kfree(scull_devices);
   }
 
+  scull_storage_exit();
+
 #ifdef SCULL_DEBUG
   scull_remove_proc();
 #endif
 
   // cleanup_module is never called if registering failed
-  unregister_chrdev_region(devno, scull_nr_devs);
+  unregister_chrdev_region(devno, scull_nr_devs + scull_p_nr_devs);
 }
 
 /*
@@ -540,14 +1431,22 @@ static int __init scull_init_module(void)
   unsigned int i;
   dev_t devno;
 
+  if (!scull_geometry_valid(scull_quantum, scull_qset))
+  {
+    printk(KERN_WARNING "SCULL: invalid geometry, scull_quantum=%u scull_qset=%u\n",
+           scull_quantum, scull_qset);
+    return -EINVAL;
+  }
+
   if (scull_major)
   {
     devno = MKDEV(scull_major, scull_minor);
-    result = register_chrdev_region(devno, scull_nr_devs, "scull");
+    result = register_chrdev_region(devno, scull_nr_devs + scull_p_nr_devs, "scull");
   }
   else
   {
-    result = alloc_chrdev_region(&devno, scull_minor, scull_nr_devs, "scull");
+    result = alloc_chrdev_region(&devno, scull_minor, scull_nr_devs + scull_p_nr_devs,
+                                 "scull");
     scull_major = MAJOR(devno);
   }
 
@@ -566,18 +1465,39 @@ static int __init scull_init_module(void)
 
   memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
+  result = scull_storage_init();
+  if (result)
+    goto failed;
+
+  scull_debugfs_root = debugfs_create_dir("scull", NULL);
+
   for (i = 0; i < scull_nr_devs; i++)
   {
-    scull_devices[i].quantum = scull_quantum;
-    scull_devices[i].qset = scull_qset;
-    mutex_init(&scull_devices[i].mtx_lock);
-    scull_setup_cdev(scull_devices + i, i);
+    result = scull_storage_dev_init(scull_devices + i);
+    if (result)
+      goto failed;
+
+    scull_setup_cdev(&scull_devices[i].cdev, &scull_fops, i);
+    scull_debugfs_create(scull_devices + i, i);
   }
 
+  // the scullpipe devices come right after the scull ones
+  result = scull_p_init(MKDEV(scull_major, scull_minor + scull_nr_devs));
+  if (result)
+    goto failed;
+
+  result = scull_shrinker_register();
+  if (result)
+    goto failed;
+
 #ifdef SCULL_DEBUG
   scull_create_proc();
 #endif
 
+  mutex_lock(&scull_compress_lock);
+  scull_devices_live = true;
+  mutex_unlock(&scull_compress_lock);
+
   return 0;
 
 failed:
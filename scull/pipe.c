@@ -0,0 +1,417 @@
+/*
+ * pipe.c -- fifo driver for scull
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each scullpipe device is a ring buffer between writers and readers.
+ *
+ * "head" only moves forward in write() and "tail" only in read(), both
+ * are free running and published with release/acquire ordering, so a
+ * writer and a reader never share a lock: the ring itself is a lock-free
+ * single-producer/single-consumer queue. Each side has its own mutex,
+ * which only serializes writers among themselves (readers among
+ * themselves); with a single writer it is never contended and costs one
+ * atomic operation.
+ *
+ * Sleepers are only woken up when there is one, wq_has_sleeper() pairs
+ * the barrier with the one prepare_to_wait() implies.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/fcntl.h>          // O_ACCMODE, O_NONBLOCK
+#include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/log2.h>           // roundup_pow_of_two()
+#include <linux/uaccess.h>        // copy_(from|to)_user
+
+#include "scull.h"
+
+struct scull_pipe {
+  char * buffer;              // the ring, "size" bytes
+  unsigned int size;          // a power of two
+  unsigned int head ____cacheline_aligned_in_smp; // next byte to write
+  unsigned int tail ____cacheline_aligned_in_smp; // next byte to read
+  struct mutex wlock ____cacheline_aligned_in_smp; // serializes writers
+  struct mutex rlock;         // serializes readers
+  wait_queue_head_t inq;      // readers waiting for data
+  wait_queue_head_t outq;     // writers waiting for room
+  unsigned int nwriters;      // files open for writing
+  unsigned int wcount;        // writers ever opened
+  struct mutex open_lock;     // protects "nwriters" and "wcount"
+  struct cdev cdev;
+};
+
+// per open file state
+struct scull_p_file {
+  struct scull_pipe * dev;
+  unsigned int wcount;        // "wcount" of a reader opened with no writer
+};
+
+// parameters which can be set at load time
+unsigned int scull_p_nr_devs = SCULL_P_NR_DEVS;
+unsigned int scull_p_buffer = SCULL_P_BUFFER;
+
+module_param(scull_p_nr_devs, uint, S_IRUGO);
+module_param(scull_p_buffer, uint, S_IRUGO);
+
+static struct scull_pipe * scull_p_devices;
+
+// bytes waiting to be read, the caller having loaded its own index itself
+static inline unsigned int scull_p_used(unsigned int head, unsigned int tail)
+{
+  return head - tail;
+}
+
+/*
+ * scull_p_open - open a scullpipe device
+ * @inode:        inode of the device file
+ * @flip:         file pointer to the special "device file" for that device
+ *
+ * Like a FIFO, a reader waits for a writer to open the device unless
+ * O_NONBLOCK, so that it does not see the end of file before anything
+ * was written. A nonblocking one remembers how many writers it saw, so
+ * that poll() only reports a hangup once another writer has come and
+ * gone.
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error.
+ */
+
+static int scull_p_open(struct inode * inode, struct file * flip)
+{
+  unsigned int wcount;
+  bool wait;
+  struct scull_pipe * dev;
+  struct scull_p_file * pf;
+
+  dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
+
+  pf = kmalloc(sizeof(struct scull_p_file), GFP_KERNEL);
+  if (pf == NULL)
+    return -ENOMEM;
+  pf->dev = dev;
+  // "wcount" is past 0 once a writer has opened, see scull_p_poll()
+  pf->wcount = 0;
+
+  if (flip->f_mode & FMODE_WRITE)
+  {
+    mutex_lock(&dev->open_lock);
+    dev->nwriters++;
+    WRITE_ONCE(dev->wcount, dev->wcount + 1);
+    mutex_unlock(&dev->open_lock);
+
+    // readers waiting in open() for a writer
+    wake_up_interruptible(&dev->inq);
+  }
+  else
+  {
+    mutex_lock(&dev->open_lock);
+    wcount = dev->wcount;
+    wait = (dev->nwriters == 0);
+    mutex_unlock(&dev->open_lock);
+
+    if (wait && (flip->f_flags & O_NONBLOCK))
+      pf->wcount = wcount;
+    // a writer which opened and closed meanwhile counts as well
+    else if (wait && wait_event_interruptible(dev->inq, READ_ONCE(dev->wcount) != wcount))
+    {
+      kfree(pf);
+      return -ERESTARTSYS;
+    }
+  }
+
+  flip->private_data = pf;
+
+  // no file position, and no pread()/pwrite()
+  return stream_open(inode, flip);
+}
+
+static int scull_p_release(struct inode * inode, struct file * flip)
+{
+  struct scull_pipe * dev;
+  struct scull_p_file * pf;
+
+  pf = flip->private_data;
+  dev = pf->dev;
+
+  if (flip->f_mode & FMODE_WRITE)
+  {
+    mutex_lock(&dev->open_lock);
+    // readers waiting on an empty ring see the end of file
+    if (--dev->nwriters == 0)
+      wake_up_interruptible(&dev->inq);
+    mutex_unlock(&dev->open_lock);
+  }
+
+  kfree(pf);
+
+  return 0;
+}
+
+/*
+ * scull_p_read - read from the ring, waiting for data unless O_NONBLOCK
+ * @flip:         file pointer to the special "device file" for that device
+ * @buf:          user buffer to read into
+ * @count:        number of bytes to read
+ * @f_pos:        unused, the device is a stream
+ *
+ * Return:
+ * number of bytes read, 0 if the ring is empty with no writer left or
+ * appropriate errno value on error.
+ */
+
+static ssize_t scull_p_read(struct file * flip, char __user * buf, size_t count,
+                            loff_t * f_pos)
+{
+  unsigned int head, tail, off, chunk;
+  struct scull_pipe * dev;
+
+  dev = ((struct scull_p_file *) flip->private_data)->dev;
+
+  if (mutex_lock_interruptible(&dev->rlock))
+    return -ERESTARTSYS;
+
+  tail = dev->tail;
+
+  // pairs with the release in scull_p_write(), the data is there
+  while ((head = smp_load_acquire(&dev->head)) == tail)
+  {
+    mutex_unlock(&dev->rlock);
+
+    if (READ_ONCE(dev->nwriters) == 0)
+      return 0;
+    if (flip->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+
+    if (wait_event_interruptible(dev->inq, (smp_load_acquire(&dev->head) != tail) ||
+                                           (READ_ONCE(dev->nwriters) == 0)))
+      return -ERESTARTSYS;
+
+    // reacquire the mutex first, then check the condition again
+    if (mutex_lock_interruptible(&dev->rlock))
+      return -ERESTARTSYS;
+    tail = dev->tail;
+  }
+
+  count = min_t(size_t, count, scull_p_used(head, tail));
+
+  // up to the end of the buffer, then from its start
+  off = tail & (dev->size - 1);
+  chunk = min_t(size_t, count, dev->size - off);
+  if (copy_to_user(buf, dev->buffer + off, chunk) ||
+      copy_to_user(buf + chunk, dev->buffer, count - chunk))
+  {
+    mutex_unlock(&dev->rlock);
+    return -EFAULT;
+  }
+
+  // the writer may reuse the room only once the data has been copied out
+  smp_store_release(&dev->tail, tail + count);
+  mutex_unlock(&dev->rlock);
+
+  if (wq_has_sleeper(&dev->outq))
+    wake_up_interruptible(&dev->outq);
+
+  return count;
+}
+
+/*
+ * scull_p_write - write to the ring, waiting for room unless O_NONBLOCK
+ * @flip:         file pointer to the special "device file" for that device
+ * @buf:          user buffer to write from
+ * @count:        number of bytes to write
+ * @f_pos:        unused, the device is a stream
+ *
+ * A write that fits in the ring waits until it fits as a whole, so that
+ * it is not interleaved with other writers; a longer one, or a
+ * nonblocking one, writes what fits.
+ *
+ * Return:
+ * number of bytes written or appropriate errno value on error.
+ */
+
+static ssize_t scull_p_write(struct file * flip, const char __user * buf, size_t count,
+                             loff_t * f_pos)
+{
+  unsigned int head, tail, off, chunk, room;
+  struct scull_pipe * dev;
+
+  dev = ((struct scull_p_file *) flip->private_data)->dev;
+
+  if (count == 0)
+    return 0;
+
+  if (mutex_lock_interruptible(&dev->wlock))
+    return -ERESTARTSYS;
+
+  for (;;)
+  {
+    head = dev->head;
+    // pairs with the release in scull_p_read(), the room is free
+    tail = smp_load_acquire(&dev->tail);
+    room = dev->size - scull_p_used(head, tail);
+
+    if (room >= count)
+      break;
+    if ((room != 0) && ((count > dev->size) || (flip->f_flags & O_NONBLOCK)))
+      break;
+
+    mutex_unlock(&dev->wlock);
+
+    if (flip->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+
+    if (wait_event_interruptible(dev->outq,
+                                 dev->size - scull_p_used(head, smp_load_acquire(&dev->tail)) >=
+                                 min_t(size_t, count, dev->size)))
+      return -ERESTARTSYS;
+
+    // reacquire the mutex first, then check the condition again
+    if (mutex_lock_interruptible(&dev->wlock))
+      return -ERESTARTSYS;
+  }
+
+  count = min_t(size_t, count, room);
+
+  off = head & (dev->size - 1);
+  chunk = min_t(size_t, count, dev->size - off);
+  if (copy_from_user(dev->buffer + off, buf, chunk) ||
+      copy_from_user(dev->buffer, buf + chunk, count - chunk))
+  {
+    mutex_unlock(&dev->wlock);
+    return -EFAULT;
+  }
+
+  // the reader may only see the new head once the data is in
+  smp_store_release(&dev->head, head + count);
+  mutex_unlock(&dev->wlock);
+
+  if (wq_has_sleeper(&dev->inq))
+    wake_up_interruptible(&dev->inq);
+
+  return count;
+}
+
+static __poll_t scull_p_poll(struct file * flip, poll_table * wait)
+{
+  unsigned int used;
+  __poll_t mask;
+  struct scull_pipe * dev;
+  struct scull_p_file * pf;
+
+  pf = flip->private_data;
+  dev = pf->dev;
+
+  poll_wait(flip, &dev->inq, wait);
+  poll_wait(flip, &dev->outq, wait);
+
+  used = scull_p_used(smp_load_acquire(&dev->head), smp_load_acquire(&dev->tail));
+  mask = 0;
+
+  if (used != 0)
+    mask |= EPOLLIN | EPOLLRDNORM;
+  // like a FIFO, no hangup before a writer was seen
+  else if ((READ_ONCE(dev->nwriters) == 0) && (READ_ONCE(dev->wcount) != pf->wcount))
+    mask |= EPOLLHUP;
+  if (used != dev->size)
+    mask |= EPOLLOUT | EPOLLWRNORM;
+
+  return mask;
+}
+
+static const struct file_operations scull_pipe_fops = {
+  .owner        = THIS_MODULE,
+  .read         = scull_p_read,
+  .write        = scull_p_write,
+  .poll         = scull_p_poll,
+  .open         = scull_p_open,
+  .release      = scull_p_release
+};
+
+/*
+ * scull_p_init - set up the scullpipe devices
+ * @firstdev:     device number of the first of them
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error, whatever was set up
+ * being left for scull_p_cleanup().
+ */
+
+int scull_p_init(dev_t firstdev)
+{
+  unsigned int i, size;
+  struct scull_pipe * dev;
+
+  if (scull_p_nr_devs == 0)
+    return 0;
+
+  // masking needs a power of two, and "head - tail" must not overflow
+  if ((scull_p_buffer == 0) || (scull_p_buffer > (1U << 30)))
+    return -EINVAL;
+  size = roundup_pow_of_two(scull_p_buffer);
+
+  scull_p_devices = kcalloc(scull_p_nr_devs, sizeof(struct scull_pipe), GFP_KERNEL);
+  if (scull_p_devices == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < scull_p_nr_devs; i++)
+  {
+    dev = scull_p_devices + i;
+
+    dev->buffer = kvmalloc(size, GFP_KERNEL);
+    if (dev->buffer == NULL)
+      return -ENOMEM;
+
+    dev->size = size;
+    mutex_init(&dev->wlock);
+    mutex_init(&dev->rlock);
+    mutex_init(&dev->open_lock);
+    init_waitqueue_head(&dev->inq);
+    init_waitqueue_head(&dev->outq);
+
+    scull_setup_cdev(&dev->cdev, &scull_pipe_fops, MINOR(firstdev) - scull_minor + i);
+  }
+
+  return 0;
+}
+
+void scull_p_cleanup(void)
+{
+  unsigned int i;
+
+  if (scull_p_devices == NULL)
+    return;
+
+  for (i = 0; i < scull_p_nr_devs; i++)
+  {
+    if (scull_p_devices[i].cdev.ops != NULL)
+      cdev_del(&scull_p_devices[i].cdev);
+    kvfree(scull_p_devices[i].buffer);
+  }
+
+  kfree(scull_p_devices);
+  scull_p_devices = NULL;
+}
@@ -20,6 +20,9 @@
 #ifndef _SCULL_H_
 #define _SCULL_H_
 
+#include <linux/ioctl.h>    // needed for the _IOW etc stuff used later
+#include <linux/types.h>
+
 #ifdef SCULL_DEBUG
 # ifdef __KERNEL__
 #   define PDEBUG(fmt, ...) printk(KERN_DEBUG, "scull: " fmt __VA_OPT__(,) __VA_ARGS__)
@@ -43,12 +46,13 @@
 
 /*
  * Each scull device is a variable-length region of memory. It uses
- * a linked-list of indirect blocks of memory (quantum).
+ * an index of indirect blocks of memory (quantum).
  *
- * "scull_dev->data" points to the first quantum set (first scull_qset
- * of the linked-list). "scull_qset->data" points to an array of pointers,
- * each pointer points to a memory region of "SCULL_QUANTUM" bytes.
- * The array is SCULL_QSET long.
+ * "scull_dev->index->qsets" is an xarray keyed by the item number (offset
+ * divided by the size of one quantum set), so finding the nth quantum set
+ * costs the same no matter how large the device grows. "scull_qset->data"
+ * points to an array of pointers, each pointer points to a memory region
+ * of "SCULL_QUANTUM" bytes. The array is SCULL_QSET long.
  */
 
 #ifndef SCULL_QUANTUM
@@ -59,34 +63,562 @@
 #define SCULL_QSET 1000
 #endif
 
+#ifndef SCULL_POOL_MAX
+#define SCULL_POOL_MAX 256  // recycled quanta kept per device
+#endif
+
+/*
+ * Memory caps, 0 for none: "scull_max_bytes" applies to every device
+ * without a limit of its own (SCULL_IOCSLIMIT), "scull_global_max_bytes"
+ * to all of them together. Only quanta count, pooled ones included.
+ */
+
+#ifndef SCULL_MAX_BYTES
+#define SCULL_MAX_BYTES 0
+#endif
+
+#ifndef SCULL_GLOBAL_MAX_BYTES
+#define SCULL_GLOBAL_MAX_BYTES 0
+#endif
+
+/*
+ * With "scull_compress_ms" set, a worker compresses (LZ4) the quanta of
+ * quantum sets nobody touched for that long. Writing to a compressed
+ * quantum inflates it back in place, so what is written stays raw until it
+ * goes cold again. Reads keep a decompressed copy next to the compressed
+ * quantum, for up to SCULL_ZCACHE_MAX quanta per device and only while
+ * there is room under the memory cap; past that, they decompress into a
+ * scratch buffer. The worker drops the copies of quantum sets which went
+ * cold. Page quanta stay raw, they may be mapped or spliced.
+ */
+
+#ifndef SCULL_COMPRESS_MS
+#define SCULL_COMPRESS_MS 0   // off
+#endif
+
+#define SCULL_ZCACHE_MAX 16   // decompressed copies kept per device
+
+/*
+ * A quantum written whole with zeros is not stored, it reads back as a
+ * hole. With "scull_dedup" set, quanta written whole are also looked up
+ * by content, and identical ones share a single buffer until one of them
+ * is written to again. Page quanta are never shared.
+ */
+
+#ifndef SCULL_DEDUP
+#define SCULL_DEDUP false
+#endif
+
+#define SCULL_DEDUP_BITS 16     // log2 of the buckets of a device dedup table
+
+/*
+ * Writes to a file opened with O_APPEND go to the end of the device. With
+ * "scull_log" set, every write does, whatever the file offset: the device
+ * is a log. Appenders reserve their room at the tail under a spinlock and
+ * copy side by side; the size then grows in the order of the
+ * reservations, so a reader never sees a hole an earlier append has yet
+ * to fill. An append landing before an earlier one leaves its end in a
+ * ring, and whoever lands the earlier one publishes both.
+ */
+
+#ifndef SCULL_LOG
+#define SCULL_LOG false
+#endif
+
+#define SCULL_LOG_SLOTS 64      // appends in flight before the next one waits
+
+// bounds of the geometry, for the module parameters and SCULL_IOCSQUANTUM/SQSET
+#define SCULL_QUANTUM_MAX (4U << 20)
+#define SCULL_QSET_MAX    (1U << 16)
+
+/*
+ * The scullpipe devices, a ring buffer of "scull_p_buffer" bytes each
+ * (rounded up to a power of two), see pipe.c.
+ */
+
+#ifndef SCULL_P_NR_DEVS
+#define SCULL_P_NR_DEVS 4   // scullpipe0 through scullpipe3
+#endif
+
+#ifndef SCULL_P_BUFFER
+#define SCULL_P_BUFFER 65536
+#endif
+
+/*
+ * When the quantum is a whole number of pages (e.g. scull_quantum=4096),
+ * quanta come from the page allocator instead of kmalloc() and the device
+ * can be mmap()ed, each mapped page being a page of some quantum (or the
+ * zero page for a hole, until a shared mapping writes to it).
+ */
+
+#define SCULL_PAGE_QUANTA(DEV) (((DEV)->quantum % PAGE_SIZE) == 0)
+
+// the storage engine also builds in userspace, see scull_shim.h
+#if defined(__KERNEL__) || defined(SCULL_SHIM)
+
 // scull quantum set
 struct scull_qset {
   void ** data;
-  struct scull_qset * next;
+  struct rw_semaphore rwsem;  // protects "data" and the quanta it points to
+  unsigned char referenced;   // SCULL_REF_*, set on every use, cleared by the scans
+  bool packed;                // compressed, and not written or inflated since
+  unsigned long item;         // item number, the key in the index
+};
+
+#define SCULL_REF_EVICT     0x1 // used since the eviction scan last passed
+#define SCULL_REF_COMPRESS  0x2 // used since the compression worker last passed
+#define SCULL_REF_ALL       (SCULL_REF_EVICT | SCULL_REF_COMPRESS)
+
+/*
+ * A compressed quantum takes the place of the raw one in "data", tagged
+ * with the low bit of the pointer (quanta are at least word aligned).
+ */
+
+struct scull_zquantum {
+  void * raw;                 // decompressed copy for readers, or NULL
+  unsigned int len;           // compressed bytes in "data"
+  unsigned int size;          // bytes taken, this header included
+  char data[];
+};
+
+#define SCULL_ZQ_TAG 0x1UL
+
+static inline bool scull_zq_tagged(const void * data)
+{
+  return ((unsigned long) data & SCULL_ZQ_TAG) != 0;
+}
+
+static inline struct scull_zquantum * scull_zq(void * data)
+{
+  return (struct scull_zquantum *) ((unsigned long) data & ~SCULL_ZQ_TAG);
+}
+
+/*
+ * A shared quantum is tagged with the next bit. Its buffer is never
+ * written to, a writer gets a copy of its own first.
+ */
+
+struct scull_dquantum {
+  struct hlist_node node;     // in the dedup table of the device
+  u64 hash;                   // of the contents
+  unsigned int refs;          // slots pointing here, under "dedup_lock"
+  bool snapped;               // one of them is the snapshot's, same lock
+  void * data;                // the raw quantum
+};
+
+#define SCULL_DQ_TAG 0x2UL
+
+static inline bool scull_dq_tagged(const void * data)
+{
+  return ((unsigned long) data & SCULL_DQ_TAG) != 0;
+}
+
+static inline struct scull_dquantum * scull_dq(void * data)
+{
+  return (struct scull_dquantum *) ((unsigned long) data & ~SCULL_DQ_TAG);
+}
+
+// the bytes of a quantum, which must not be compressed
+static inline char * scull_quantum_bytes(void * data)
+{
+  return scull_dq_tagged(data) ? scull_dq(data)->data : data;
+}
+
+/*
+ * Quanta freed by scull_trim() are kept in a small per-device pool, linked
+ * through their first word, so that refilling a truncated device does not
+ * go back to the allocator.
+ */
+
+struct scull_pool {
+  spinlock_t lock;
+  void * head;              // first recycled quantum
+  unsigned int count;       // quanta in the pool
+  unsigned long hits;       // allocations served from the pool
+  unsigned long misses;     // allocations that went to the allocator
+};
+
+/*
+ * Per-CPU I/O statistics. Each CPU only bumps its own copy, without any
+ * lock or shared cache line; the debugfs "stats" file adds them up when
+ * it is read.
+ */
+
+enum scull_stat {
+  SCULL_STAT_READ_OPS,
+  SCULL_STAT_READ_BYTES,
+  SCULL_STAT_WRITE_OPS,
+  SCULL_STAT_WRITE_BYTES,
+  SCULL_STAT_FOLLOW,              // quantum set index lookups
+  SCULL_STAT_CURSOR_HITS,         // lookups saved by the file cursor
+  SCULL_STAT_QUANTUM_ALLOC,
+  SCULL_STAT_QUANTUM_FREE,
+  SCULL_STAT_QSET_ALLOC,
+  SCULL_STAT_QSET_FREE,
+  SCULL_STAT_LOCK_CONTENDED,      // device lock not free at first try
+  SCULL_STAT_LOCK_WAIT_NS,
+  SCULL_STAT_QSET_LOCK_CONTENDED, // same for the quantum set locks
+  SCULL_STAT_QSET_LOCK_WAIT_NS,
+  SCULL_STAT_EVICTED,             // quanta dropped under memory pressure
+  SCULL_STAT_COMPRESSED,          // quanta compressed by the worker
+  SCULL_STAT_INFLATED,            // compressed quanta accessed again
+  SCULL_STAT_ZERO_ELIDED,         // all-zero quanta not stored
+  SCULL_STAT_DEDUP_HITS,          // quanta written whole found in the dedup table
+  SCULL_STAT_DEDUP_MISSES,        // and those which were not
+  SCULL_STAT_DEDUP_COW,           // shared quanta copied for a writer
+  SCULL_STAT_SNAP_SAVED,          // quanta kept for a snapshot before a change
+  SCULL_STAT_LOG_WAITS,           // appends which waited for a slot in the ring
+  SCULL_STAT_NR
+};
+
+enum scull_lat {
+  SCULL_LAT_READ,
+  SCULL_LAT_WRITE,
+  SCULL_LAT_TRIM,
+  SCULL_LAT_INFLATE,              // decompressing a quantum on access
+  SCULL_LAT_NR
+};
+
+#define SCULL_LAT_BUCKETS 32  // bucket n counts latencies in [2^n, 2^(n+1)) ns
+
+struct scull_stats {
+  unsigned long count[SCULL_STAT_NR];
+  unsigned long lat[SCULL_LAT_NR][SCULL_LAT_BUCKETS];
+};
+
+/*
+ * The quantum set index lives apart from the device, so that trimming can
+ * swap in an empty one and leave the old one to a worker to free.
+ */
+
+struct scull_index {
+  struct xarray qsets;          // quantum sets indexed by item number
+  struct work_struct free_work; // deferred release after a trim
+  struct scull_dev * dev;       // owner, for the geometry and the pool
+};
+
+#define SCULL_FREE_BATCH 64     // quanta freed per kmem_cache_free_bulk()
+
+/*
+ * Quanta of a cache-like device (SCULL_LIMIT_CACHE) may be dropped, when
+ * the device hits its limit or when the shrinker asks for memory back.
+ * Whole quantum sets go, coldest first: an eviction scan walks the index
+ * like a clock hand, giving quantum sets touched since its last pass a
+ * second chance. Evicted ranges read back as holes.
+ */
+
+#define SCULL_EVICT_BATCH 16    // quanta a device at its limit evicts at once
+
+/*
+ * A snapshot shares the index of its device, so taking one costs the same
+ * whatever the size of the device. Before a quantum first changes, it is
+ * shared with the snapshot ("saved", keyed by quantum number), or a hole
+ * marker is saved if there was none; the writer then gets a copy of its
+ * own, of that quantum only. A trim leaves the
+ * old index to the snapshot. Only one snapshot per device at a time, and
+ * none with page quanta: mmap() writes would go around the copy.
+ */
+
+struct scull_snap {
+  struct scull_dev * dev;
+  struct scull_index * index;   // the device index when the snapshot was taken
+  struct xarray saved;          // quanta changed since, as they were
+  loff_t size;                  // device size when the snapshot was taken
+};
+
+/*
+ * The tail of the device as appenders see it. "end" runs ahead of the
+ * device size by the appends still being copied. Appends are numbered in
+ * the order of their reservations, those from "landed" to "reserved" are
+ * in flight and have a slot in the ring.
+ */
+
+struct scull_log {
+  spinlock_t lock;            // protects the fields below
+  loff_t end;                 // end of the room reserved by appenders
+  unsigned long item;         // item number of "qset"
+  struct scull_qset * qset;   // quantum set at the tail, NULL if unknown
+  unsigned long gen;          // device generation the fields above belong to
+  unsigned long reserved;     // appends reserved so far
+  unsigned long landed;       // appends covered by the device size
+  loff_t ends[SCULL_LOG_SLOTS]; // end of each append in flight
+  bool done[SCULL_LOG_SLOTS]; // set once its data is in
+  wait_queue_head_t wait;     // appenders waiting for a slot
 };
 
 struct scull_dev {
-  struct scull_qset * data; // pinter to the first quantum set
+  struct scull_index * index; // quantum sets, replaced on trim
   unsigned int quantum;     // the current quantum size
   unsigned int qset;        // the current array size
-  unsigned long size;       // the amount of data stored in this deivce
+  bool pow2;                // quantum and qset are both powers of two
+  unsigned int quantum_shift; // log2(quantum), valid if "pow2"
+  unsigned int qset_shift;  // log2(qset), valid if "pow2"
+  atomic_long_t size;       // the amount of data stored in this deivce
+  unsigned long gen;        // bumped by trim, invalidates file cursors
   unsigned int access_key;  // used by sculluid and scullpriv
-  struct mutex mtx_lock;    // mutual exclusion lock
+  struct kmem_cache * quantum_cache; // slab cache for quanta of this size
+  struct kmem_cache * qptr_cache;    // slab cache for the qset pointer arrays
+  struct scull_pool pool;   // recycled quanta
+  atomic_long_t mem;        // bytes of quanta held, pooled ones included
+  unsigned long max_bytes;  // memory cap, 0 for "scull_max_bytes"
+  unsigned int flags;       // SCULL_LIMIT_*
+  unsigned long evict_hand; // item number the eviction scan resumes at
+  atomic_long_t zquanta;    // compressed quanta held
+  atomic_long_t zbytes;     // bytes they take
+  atomic_long_t zcached;    // decompressed copies of them kept for reads
+  struct delayed_work compress_work; // compresses cold quanta
+  spinlock_t dedup_lock;    // protects "dedup" and the references to its quanta
+  struct hlist_head * dedup; // shared quanta by hash, allocated on first use
+  atomic_long_t dedup_saved; // quanta not allocated thanks to sharing
+  struct scull_snap * snap; // the snapshot of the device, if any
+  struct scull_log log;     // tail of the device, for appenders
+  struct scull_stats __percpu * stats; // I/O statistics
+  struct dentry * debugfs;  // per-device debugfs directory
+  struct rw_semaphore rwsem; // taken for writing only by trim
   struct cdev cdev;         // char device structure
 };
 
-#define SCULL_QSET_INIT(QSET) ((QSET)->data = NULL, (QSET)->next = NULL)
+/*
+ * Each open file remembers where its last read or write stopped, so that
+ * sequential I/O resumes there without resolving the offset again.
+ */
+
+struct scull_cursor {
+  loff_t pos;                 // file offset the cursor points at
+  unsigned long item;         // item number of "qset"
+  unsigned long qindx;        // quantum index in "qset"
+  unsigned long qoff;         // offset in that quantum
+  struct scull_qset * qset;   // NULL if the cursor is empty
+  unsigned long gen;          // device generation the cursor belongs to
+};
+
+struct scull_file {
+  struct scull_dev * dev;     // the device this file was opened on
+  spinlock_t lock;            // protects "cursor"
+  struct scull_cursor cursor;
+};
+
+#define SCULL_QSET_INIT(QSET)       \
+  do {                              \
+    (QSET)->data = NULL;            \
+    init_rwsem(&(QSET)->rwsem);     \
+    (QSET)->referenced = SCULL_REF_ALL; \
+    (QSET)->packed = false;         \
+  } while (0)
+
+/*
+ * scull_locate - split a file offset into item number, quantum index and
+ * offset in that quantum
+ * @dev:        scull device
+ * @pos:        file offset
+ * @item:       item number of the quantum set holding @pos
+ * @qindx:      index of the quantum in that set
+ * @qoff:       offset in that quantum
+ *
+ * Power-of-two geometries get away with shifts and masks, any other one
+ * pays for two 64-bit divisions.
+ */
+
+static inline void scull_locate(const struct scull_dev * dev, loff_t pos,
+                                unsigned long * item, unsigned long * qindx,
+                                unsigned long * qoff)
+{
+  unsigned long itemsize, rest;
+
+  if (dev->pow2)
+  {
+    *item = (unsigned long) pos >> (dev->quantum_shift + dev->qset_shift);
+    *qindx = ((unsigned long) pos >> dev->quantum_shift) & (dev->qset - 1);
+    *qoff = (unsigned long) pos & (dev->quantum - 1);
+    return;
+  }
+
+  itemsize = (unsigned long) dev->quantum * dev->qset;
+  *item = (unsigned long) pos / itemsize;
+  rest = (unsigned long) pos % itemsize;
+  *qindx = rest / dev->quantum;
+  *qoff = rest % dev->quantum;
+}
+
+/*
+ * scull_stat_add - add to a statistics counter of the device
+ * @dev:        scull device
+ * @item:       the counter
+ * @n:          amount to add
+ *
+ * this_cpu_add() is safe against preemption, so it can be called from
+ * any context the driver runs in.
+ */
+
+static inline void scull_stat_add(struct scull_dev * dev, enum scull_stat item,
+                                  unsigned long n)
+{
+  this_cpu_add(dev->stats->count[item], n);
+}
+
+/*
+ * scull_lat_record - count an operation in a latency histogram
+ * @dev:        scull device
+ * @which:      the histogram
+ * @delta:      how long the operation took, in ns
+ */
+
+static inline void scull_lat_record(struct scull_dev * dev, enum scull_lat which, u64 delta)
+{
+  unsigned int bucket;
+
+  bucket = (delta != 0) ? ilog2(delta) : 0;
+  if (bucket >= SCULL_LAT_BUCKETS)
+    bucket = SCULL_LAT_BUCKETS - 1;
+
+  this_cpu_inc(dev->stats->lat[which][bucket]);
+}
 
 // defined in main.c
 extern unsigned int scull_major;
+extern unsigned int scull_minor;
 extern unsigned int scull_nr_devs;
 extern unsigned int scull_quantum;
 extern unsigned int scull_qset;
+extern unsigned int scull_pool_max;
+extern unsigned long scull_max_bytes;
+extern unsigned long scull_global_max_bytes;
+extern unsigned int scull_compress_ms;
+extern bool scull_dedup;
+extern bool scull_log;
+
+// defined in pipe.c
+extern unsigned int scull_p_nr_devs;
+extern unsigned int scull_p_buffer;
 
-// function prototype
+// function prototype, storage.c
+int scull_storage_init(void);
+void scull_storage_exit(void);
+void scull_storage_flush(void);
+int scull_storage_dev_init(struct scull_dev * dev);
+void scull_storage_dev_exit(struct scull_dev * dev);
+void scull_compress_kick(struct scull_dev * dev);
+int scull_lock_read(struct scull_dev * dev);
+int scull_lock_write(struct scull_dev * dev);
 int scull_trim(struct scull_dev * dev);
-ssize_t scull_read(struct file *, char __user *, size_t, loff_t *);
-ssize_t scull_write(struct file *, const char __user *, size_t, loff_t *);
+bool scull_geometry_valid(unsigned int quantum, unsigned int qset);
+int scull_storage_reshape(struct scull_dev * dev, unsigned int quantum, unsigned int qset);
+int scull_pool_reserve(struct scull_dev * dev, unsigned long long bytes);
+unsigned long scull_pool_shrink(struct scull_dev * dev, unsigned long nr);
+unsigned long scull_evict(struct scull_dev * dev, unsigned long nr);
+struct scull_qset * scull_follow(struct scull_dev * dev, unsigned long n);
+void * scull_qset_fill(struct scull_dev * dev, struct scull_qset * qsetp,
+                       unsigned long qindx, bool * fresh);
+void scull_size_extend(struct scull_dev * dev, loff_t pos);
+loff_t scull_seek_hole_data(struct scull_dev * dev, loff_t off, bool hole);
+struct scull_snap * scull_snap_create(struct scull_dev * dev);
+void scull_snap_release(struct scull_snap * snap);
+ssize_t scull_snap_read_iter(struct kiocb *, struct iov_iter *);
+int scull_punch_range(struct scull_dev * dev, loff_t off, loff_t len);
+ssize_t scull_read_iter(struct kiocb *, struct iov_iter *);
+ssize_t scull_write_iter(struct kiocb *, struct iov_iter *);
+
+// function prototype, main.c
 loff_t scull_llseek(struct file *, loff_t, int);
+int scull_mmap(struct file *, struct vm_area_struct *);
+long scull_fallocate(struct file *, int, loff_t, loff_t);
+long scull_ioctl(struct file *, unsigned int, unsigned long);
+void scull_setup_cdev(struct cdev *, const struct file_operations *, unsigned int);
+
+// function prototype, pipe.c
+int scull_p_init(dev_t firstdev);
+void scull_p_cleanup(void);
+
+#endif /* __KERNEL__ || SCULL_SHIM */
+
+/*
+ * Ioctl definitions, shared with userspace.
+ */
+
+// use 'k' as magic number
+#define SCULL_IOC_MAGIC 'k'
+
+/*
+ * fallocate(2) is refused by the VFS on character devices, so punching
+ * holes and zeroing ranges goes through an ioctl taking the same
+ * arguments. "mode" takes the FALLOC_FL_* flags of <linux/falloc.h>.
+ */
+
+struct scull_falloc {
+  __u32 mode;
+  __u32 pad;
+  __u64 offset;
+  __u64 len;
+};
+
+#define SCULL_IOCFALLOCATE _IOW(SCULL_IOC_MAGIC, 1, struct scull_falloc)
+
+/*
+ * Per-device geometry, in the spirit of the original scull commands. The
+ * geometry can only change while the device holds no data (right after
+ * a write-only open, for instance) and needs CAP_SYS_ADMIN, as does
+ * SCULL_IOCRESERVE. RESET goes back to the module parameters.
+ */
+
+#define SCULL_IOCRESET     _IO(SCULL_IOC_MAGIC, 2)
+#define SCULL_IOCSQUANTUM  _IOW(SCULL_IOC_MAGIC, 3, __u32)
+#define SCULL_IOCGQUANTUM  _IOR(SCULL_IOC_MAGIC, 4, __u32)
+#define SCULL_IOCSQSET     _IOW(SCULL_IOC_MAGIC, 5, __u32)
+#define SCULL_IOCGQSET     _IOR(SCULL_IOC_MAGIC, 6, __u32)
+
+// keep enough quanta aside for that many bytes of writes
+#define SCULL_IOCRESERVE   _IOW(SCULL_IOC_MAGIC, 7, __u64)
+
+/*
+ * Snapshot of a device and its statistics (see the debugfs "stats" file),
+ * in one call.
+ */
+
+struct scull_ioc_stats {
+  __u64 size;
+  __u32 quantum;
+  __u32 qset;
+  __u64 pool_quanta;        // quanta kept aside for writes
+  __u64 read_ops;
+  __u64 read_bytes;
+  __u64 write_ops;
+  __u64 write_bytes;
+  __u64 quantum_alloc;
+  __u64 quantum_free;
+  __u64 qset_alloc;
+  __u64 qset_free;
+  __u64 lock_contended;
+  __u64 lock_wait_ns;
+};
+
+#define SCULL_IOCGSTATS    _IOR(SCULL_IOC_MAGIC, 8, struct scull_ioc_stats)
+
+/*
+ * Memory cap of a device and whether its quanta may be evicted (see
+ * scull.h), "used_bytes" is only filled in by SCULL_IOCGLIMIT. A
+ * "max_bytes" of 0 falls back to the scull_max_bytes module parameter.
+ */
+
+#define SCULL_LIMIT_CACHE 0x1   // the device is a cache, its data may go
+
+struct scull_ioc_limit {
+  __u64 max_bytes;
+  __u64 used_bytes;
+  __u32 flags;              // SCULL_LIMIT_*
+  __u32 pad;
+};
+
+#define SCULL_IOCSLIMIT    _IOW(SCULL_IOC_MAGIC, 9, struct scull_ioc_limit)
+#define SCULL_IOCGLIMIT    _IOR(SCULL_IOC_MAGIC, 10, struct scull_ioc_limit)
+
+/*
+ * Take a snapshot of the device, returned as a new read-only file
+ * descriptor (see struct scull_snap). Only needs the device open for
+ * reading.
+ */
+
+#define SCULL_IOCSNAPSHOT  _IO(SCULL_IOC_MAGIC, 11)
+
+#define SCULL_IOC_MAXNR 11
 
 #endif /* _SCULL_H_ */
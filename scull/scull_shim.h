@@ -0,0 +1,845 @@
+/*
+ * scull_shim.h -- the bits of the kernel API the scull storage engine
+ * needs, on top of libc and pthreads, for building storage.c in userspace
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Only what storage.c uses is here, and only as faithful as it needs to
+ * be to exercise the same code paths:
+ *
+ *  - slab caches, kmalloc() and page allocations are malloc() and friends;
+ *    pages are never mapped, so every quantum looks idle
+ *  - rw_semaphores, spinlocks and mutexes are their pthread counterparts
+ *  - per-CPU data has a single copy updated with relaxed atomics
+ *  - the xarray is a two level table of SHIM_XA_SLOTS^2 entries with
+ *    lock-free lookups, which is plenty for a benchmark
+ *  - a workqueue is one thread running its work in the order queued
+ *  - LZ4 is a run-length codec with the same interface
+ *  - an iov_iter is one flat buffer, tracepoints compile to nothing
+ */
+
+#ifndef _SCULL_SHIM_H_
+#define _SCULL_SHIM_H_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>             // malloc_usable_size()
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define SCULL_SHIM
+
+typedef uint64_t u64;
+
+#define __percpu
+#define __user
+#define __maybe_unused __attribute__((unused))
+
+#ifndef ERESTARTSYS
+#define ERESTARTSYS 512
+#endif
+
+#define PAGE_SIZE       4096UL
+#define GFP_KERNEL      0
+#define __GFP_ZERO      1
+#define GFP_KERNEL_ACCOUNT GFP_KERNEL
+#define __GFP_NOWARN    0
+#define SLAB_ACCOUNT    0
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val) __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+
+#define container_of(ptr, type, member) \
+  ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define min_t(type, x, y) ((type) (x) < (type) (y) ? (type) (x) : (type) (y))
+#define max_t(type, x, y) ((type) (x) > (type) (y) ? (type) (x) : (type) (y))
+
+#define swap(a, b)                  \
+  do {                              \
+    typeof(a) __tmp = (a);          \
+    (a) = (b);                      \
+    (b) = __tmp;                    \
+  } while (0)
+
+#define is_power_of_2(n) (((n) != 0) && (((n) & ((n) - 1)) == 0))
+#define ilog2(n) (63 - __builtin_clzll((unsigned long long) (n)))
+
+#define DIV_ROUND_UP_ULL(n, d) (((unsigned long long) (n) + (d) - 1) / (d))
+
+static inline void cond_resched(void)
+{
+}
+
+// there is no task to kill
+#define current NULL
+#define fatal_signal_pending(task) false
+
+static inline u64 ktime_get_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Memory
+ */
+
+static inline void * kmalloc(size_t size, int gfp)
+{
+  return (gfp & __GFP_ZERO) ? calloc(1, size) : malloc(size);
+}
+
+#define kzalloc(size, gfp) kmalloc(size, (gfp) | __GFP_ZERO)
+#define kfree(ptr) free(ptr)
+#define ksize(ptr) malloc_usable_size(ptr)
+#define kvmalloc(size, gfp) kmalloc(size, gfp)
+#define kvcalloc(n, size, gfp) kmalloc((n) * (size), (gfp) | __GFP_ZERO)
+#define kvfree(ptr) free(ptr)
+
+#define WARN_ON_ONCE(cond) (cond)
+
+static inline void * memchr_inv(const void * start, int c, size_t bytes)
+{
+  const unsigned char * p;
+
+  for (p = start; bytes > 0; p++, bytes--)
+  {
+    if (*p != (unsigned char) c)
+      return (void *) p;
+  }
+
+  return NULL;
+}
+
+// FNV-1a, any 64-bit hash does for the dedup table
+static inline u64 xxh64(const void * input, size_t len, u64 seed)
+{
+  u64 hash;
+  const unsigned char * p;
+
+  hash = 0xcbf29ce484222325ULL ^ seed;
+  for (p = input; len > 0; p++, len--)
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+struct kmem_cache {
+  size_t size;
+};
+
+static inline struct kmem_cache * kmem_cache_create(const char * name __maybe_unused,
+                                                    size_t size,
+                                                    size_t align __maybe_unused,
+                                                    unsigned long flags __maybe_unused,
+                                                    void (*ctor)(void *) __maybe_unused)
+{
+  struct kmem_cache * cache;
+
+  cache = malloc(sizeof(struct kmem_cache));
+  if (cache != NULL)
+    cache->size = size;
+
+  return cache;
+}
+
+#define KMEM_CACHE(s, flags) kmem_cache_create(#s, sizeof(struct s), 0, flags, NULL)
+
+#define kmem_cache_alloc(cache, gfp) kmalloc((cache)->size, gfp)
+#define kmem_cache_zalloc(cache, gfp) kmalloc((cache)->size, (gfp) | __GFP_ZERO)
+#define kmem_cache_free(cache, ptr) free(ptr)
+#define kmem_cache_destroy(cache) free(cache)
+
+static inline void kmem_cache_free_bulk(struct kmem_cache * cache __maybe_unused, size_t n,
+                                        void ** p)
+{
+  while (n > 0)
+    free(p[--n]);
+}
+
+static inline void * alloc_pages_exact(size_t size, int gfp)
+{
+  void * p;
+
+  p = aligned_alloc(PAGE_SIZE, size);
+  if ((p != NULL) && (gfp & __GFP_ZERO))
+    memset(p, 0, size);
+
+  return p;
+}
+
+#define free_pages_exact(ptr, size) free(ptr)
+
+// nothing is ever mapped, a quantum is always idle
+#define virt_to_page(addr) ((void *) (addr))
+#define page_count(page) ((void) (page), 1)
+
+#define alloc_percpu(type) ((type *) calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) (ptr)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+/*
+ * Atomics and locks
+ */
+
+typedef struct {
+  long counter;
+} atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i) { (i) }
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_add_return(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_long_sub(i, v) __atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_long_add(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_long_inc(v) atomic_long_add(1, v)
+#define atomic_long_dec(v) atomic_long_sub(1, v)
+
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+
+// returns the old value, like the kernel one
+#define cmpxchg_release(p, old, new)                                        \
+  ({                                                                        \
+    typeof(*(p)) __old = (old);                                             \
+    __atomic_compare_exchange_n(p, &__old, new, false, __ATOMIC_RELEASE,    \
+                                __ATOMIC_RELAXED);                          \
+    __old;                                                                  \
+  })
+#define atomic_long_try_cmpxchg(v, old, new) \
+  __atomic_compare_exchange_n(&(v)->counter, (old), (new), false, \
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(lock) pthread_spin_init(lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(lock) pthread_spin_lock(lock)
+#define spin_unlock(lock) pthread_spin_unlock(lock)
+
+#define DEFINE_MUTEX(name) pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#define mutex_lock(lock) pthread_mutex_lock(lock)
+#define mutex_unlock(lock) pthread_mutex_unlock(lock)
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int sleepers;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq)           \
+  do {                                    \
+    pthread_mutex_init(&(wq)->lock, NULL); \
+    pthread_cond_init(&(wq)->cond, NULL); \
+    (wq)->sleepers = 0;                   \
+  } while (0)
+
+// the condition is checked with the mutex held, wake_up_all() takes it
+#define wait_event(wq, condition)         \
+  do {                                    \
+    pthread_mutex_lock(&(wq).lock);       \
+    __atomic_add_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST); \
+    while (!(condition))                  \
+      pthread_cond_wait(&(wq).cond, &(wq).lock); \
+    __atomic_sub_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST); \
+    pthread_mutex_unlock(&(wq).lock);     \
+  } while (0)
+
+// signals are never sent to the shim's threads
+#define wait_event_interruptible(wq, condition) \
+  ({                                      \
+    wait_event(wq, condition);            \
+    0;                                    \
+  })
+
+static inline bool wq_has_sleeper(wait_queue_head_t * wq)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&wq->sleepers, __ATOMIC_SEQ_CST) != 0;
+}
+
+static inline void wake_up_all(wait_queue_head_t * wq)
+{
+  pthread_mutex_lock(&wq->lock);
+  pthread_cond_broadcast(&wq->cond);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+struct rw_semaphore {
+  pthread_rwlock_t lock;
+};
+
+#define init_rwsem(sem) pthread_rwlock_init(&(sem)->lock, NULL)
+#define down_read(sem) pthread_rwlock_rdlock(&(sem)->lock)
+#define down_read_trylock(sem) (pthread_rwlock_tryrdlock(&(sem)->lock) == 0)
+#define down_read_interruptible(sem) pthread_rwlock_rdlock(&(sem)->lock)
+#define up_read(sem) pthread_rwlock_unlock(&(sem)->lock)
+#define down_write(sem) pthread_rwlock_wrlock(&(sem)->lock)
+#define down_write_trylock(sem) (pthread_rwlock_trywrlock(&(sem)->lock) == 0)
+#define down_write_killable(sem) pthread_rwlock_wrlock(&(sem)->lock)
+#define up_write(sem) pthread_rwlock_unlock(&(sem)->lock)
+
+/*
+ * Lists
+ */
+
+struct list_head {
+  struct list_head * next, * prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = { &(name), &(name) }
+
+static inline void list_add(struct list_head * entry, struct list_head * head)
+{
+  entry->next = head->next;
+  entry->prev = head;
+  head->next->prev = entry;
+  head->next = entry;
+}
+
+static inline void list_del(struct list_head * entry)
+{
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+}
+
+#define list_for_each_entry(pos, head, member)                            \
+  for (pos = container_of((head)->next, typeof(*pos), member);            \
+       &pos->member != (head);                                            \
+       pos = container_of(pos->member.next, typeof(*pos), member))
+
+struct hlist_node {
+  struct hlist_node * next, ** pprev;
+};
+
+struct hlist_head {
+  struct hlist_node * first;
+};
+
+static inline void INIT_HLIST_NODE(struct hlist_node * n)
+{
+  n->next = NULL;
+  n->pprev = NULL;
+}
+
+static inline bool hlist_unhashed(const struct hlist_node * n)
+{
+  return n->pprev == NULL;
+}
+
+static inline void hlist_add_head(struct hlist_node * n, struct hlist_head * h)
+{
+  n->next = h->first;
+  if (h->first != NULL)
+    h->first->pprev = &n->next;
+  h->first = n;
+  n->pprev = &h->first;
+}
+
+static inline void hlist_del(struct hlist_node * n)
+{
+  *n->pprev = n->next;
+  if (n->next != NULL)
+    n->next->pprev = n->pprev;
+}
+
+#define hlist_for_each_entry(pos, head, member)                           \
+  for (pos = (head)->first ? container_of((head)->first, typeof(*pos), member) : NULL; \
+       pos != NULL;                                                       \
+       pos = pos->member.next ? container_of(pos->member.next, typeof(*pos), member) : NULL)
+
+#define ERR_PTR(err) ((void *) (long) (err))
+#define PTR_ERR(ptr) ((long) (ptr))
+#define IS_ERR(ptr) ((unsigned long) (ptr) >= (unsigned long) -4095)
+
+/*
+ * xarray
+ */
+
+#define SHIM_XA_SLOTS 1024UL
+#define XA_PRESENT 0
+
+struct xarray {
+  void ** leaves[SHIM_XA_SLOTS];
+};
+
+#define xa_err_entry(errno) ((void *) (long) -(errno))
+#define xa_is_err(entry) ((unsigned long) (entry) >= (unsigned long) -4095)
+
+#define xa_mk_value(v) ((void *) (((unsigned long) (v) << 1) | 1))
+#define xa_is_value(entry) (((unsigned long) (entry) & 1) != 0)
+
+static inline void xa_init(struct xarray * xa)
+{
+  memset(xa, 0, sizeof(struct xarray));
+}
+
+static inline void * xa_load(struct xarray * xa, unsigned long index)
+{
+  void ** leaf;
+
+  if (index >= SHIM_XA_SLOTS * SHIM_XA_SLOTS)
+    return NULL;
+
+  leaf = __atomic_load_n(&xa->leaves[index / SHIM_XA_SLOTS], __ATOMIC_ACQUIRE);
+  if (leaf == NULL)
+    return NULL;
+
+  return __atomic_load_n(&leaf[index % SHIM_XA_SLOTS], __ATOMIC_ACQUIRE);
+}
+
+static inline void * xa_cmpxchg(struct xarray * xa, unsigned long index, void * old,
+                                void * entry, int gfp __maybe_unused)
+{
+  void ** leaf, ** fresh;
+
+  if (index >= SHIM_XA_SLOTS * SHIM_XA_SLOTS)
+    return xa_err_entry(ENOMEM);
+
+  leaf = __atomic_load_n(&xa->leaves[index / SHIM_XA_SLOTS], __ATOMIC_ACQUIRE);
+  if (leaf == NULL)
+  {
+    fresh = calloc(SHIM_XA_SLOTS, sizeof(void *));
+    if (fresh == NULL)
+      return xa_err_entry(ENOMEM);
+
+    leaf = NULL;
+    if (__atomic_compare_exchange_n(&xa->leaves[index / SHIM_XA_SLOTS], &leaf, fresh,
+                                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      leaf = fresh;
+    else
+      free(fresh);
+  }
+
+  __atomic_compare_exchange_n(&leaf[index % SHIM_XA_SLOTS], &old, entry, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+  return old;
+}
+
+static inline void * xa_find(struct xarray * xa, unsigned long * index,
+                             unsigned long max, int filter __maybe_unused)
+{
+  unsigned long i;
+  void * entry;
+
+  for (i = *index; (i <= max) && (i < SHIM_XA_SLOTS * SHIM_XA_SLOTS); i++)
+  {
+    if (xa->leaves[i / SHIM_XA_SLOTS] == NULL)
+    {
+      // skip the whole missing leaf
+      i |= SHIM_XA_SLOTS - 1;
+      continue;
+    }
+
+    entry = xa_load(xa, i);
+    if (entry != NULL)
+    {
+      *index = i;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+#define xa_for_each(xa, index, entry)                                     \
+  for (index = 0, entry = xa_find(xa, &(index), ULONG_MAX, XA_PRESENT);   \
+       entry != NULL;                                                     \
+       index++, entry = xa_find(xa, &(index), ULONG_MAX, XA_PRESENT))
+
+static inline bool xa_empty(struct xarray * xa)
+{
+  unsigned long index = 0;
+
+  return xa_find(xa, &index, ULONG_MAX, XA_PRESENT) == NULL;
+}
+
+static inline void xa_destroy(struct xarray * xa)
+{
+  unsigned long i;
+
+  for (i = 0; i < SHIM_XA_SLOTS; i++)
+    free(xa->leaves[i]);
+
+  xa_init(xa);
+}
+
+/*
+ * Workqueues
+ */
+
+struct work_struct {
+  void (*func)(struct work_struct *);
+  struct work_struct * next;    // on the queue of a workqueue
+  bool pending;
+};
+
+struct workqueue_struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          // work queued, or some done
+  struct work_struct * head;
+  struct work_struct ** tail;
+  bool busy;                    // the thread is running work
+  bool stop;
+};
+
+#define WQ_UNBOUND 0
+#define INIT_WORK(work, fn) \
+  do { (work)->func = (fn); (work)->next = NULL; (work)->pending = false; } while (0)
+
+static inline void * shim_worker(void * arg)
+{
+  struct work_struct * work;
+  struct workqueue_struct * wq;
+
+  wq = arg;
+  pthread_mutex_lock(&wq->lock);
+  for (;;)
+  {
+    while ((wq->head == NULL) && !wq->stop)
+      pthread_cond_wait(&wq->cond, &wq->lock);
+    if (wq->head == NULL)
+      break;
+
+    work = wq->head;
+    wq->head = work->next;
+    if (wq->head == NULL)
+      wq->tail = &wq->head;
+    work->pending = false;
+    wq->busy = true;
+
+    // the work may free itself
+    pthread_mutex_unlock(&wq->lock);
+    work->func(work);
+    pthread_mutex_lock(&wq->lock);
+
+    wq->busy = false;
+    pthread_cond_broadcast(&wq->cond);
+  }
+  pthread_mutex_unlock(&wq->lock);
+
+  return NULL;
+}
+
+static inline struct workqueue_struct * alloc_workqueue(const char * name __maybe_unused,
+                                                       unsigned int flags __maybe_unused,
+                                                       int max __maybe_unused)
+{
+  struct workqueue_struct * wq;
+
+  wq = calloc(1, sizeof(struct workqueue_struct));
+  if (wq == NULL)
+    return NULL;
+
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->cond, NULL);
+  wq->tail = &wq->head;
+
+  if (pthread_create(&wq->thread, NULL, shim_worker, wq))
+  {
+    free(wq);
+    return NULL;
+  }
+
+  return wq;
+}
+
+static inline bool queue_work(struct workqueue_struct * wq, struct work_struct * work)
+{
+  bool queued;
+
+  pthread_mutex_lock(&wq->lock);
+  queued = !work->pending;
+  if (queued)
+  {
+    work->pending = true;
+    work->next = NULL;
+    *wq->tail = work;
+    wq->tail = &work->next;
+    pthread_cond_broadcast(&wq->cond);
+  }
+  pthread_mutex_unlock(&wq->lock);
+
+  return queued;
+}
+
+// waits for the queue to drain, which is at least what was queued so far
+static inline void flush_workqueue(struct workqueue_struct * wq)
+{
+  pthread_mutex_lock(&wq->lock);
+  while ((wq->head != NULL) || wq->busy)
+    pthread_cond_wait(&wq->cond, &wq->lock);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+static inline void destroy_workqueue(struct workqueue_struct * wq)
+{
+  flush_workqueue(wq);
+
+  pthread_mutex_lock(&wq->lock);
+  wq->stop = true;
+  pthread_cond_broadcast(&wq->cond);
+  pthread_mutex_unlock(&wq->lock);
+
+  pthread_join(wq->thread, NULL);
+  pthread_cond_destroy(&wq->cond);
+  pthread_mutex_destroy(&wq->lock);
+  free(wq);
+}
+
+// periodic work (the compression worker) never runs in userspace
+struct delayed_work {
+  struct work_struct work;
+};
+
+#define INIT_DELAYED_WORK(dwork, fn) INIT_WORK(&(dwork)->work, fn)
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+#define msecs_to_jiffies(ms) (ms)
+
+static inline bool queue_delayed_work(struct workqueue_struct * wq __maybe_unused,
+                                      struct delayed_work * dwork __maybe_unused,
+                                      unsigned long delay __maybe_unused)
+{
+  return false;
+}
+
+static inline bool mod_delayed_work(struct workqueue_struct * wq __maybe_unused,
+                                    struct delayed_work * dwork __maybe_unused,
+                                    unsigned long delay __maybe_unused)
+{
+  return false;
+}
+
+static inline bool cancel_delayed_work_sync(struct delayed_work * dwork __maybe_unused)
+{
+  return false;
+}
+
+/*
+ * LZ4, stood in for by a run-length codec with the same interface: a
+ * header byte below 128 is followed by that many literals plus one, one
+ * of 128 or more by a byte repeated that many times minus 125. It does
+ * not compress as well, only the compressed and raw paths matter here.
+ */
+
+#define LZ4_MEM_COMPRESS 16384
+#define LZ4_COMPRESSBOUND(isize) ((isize) + ((isize) / 255) + 16)
+
+#define SHIM_RLE_MIN_RUN 3
+#define SHIM_RLE_MAX_RUN (255 - 125)
+#define SHIM_RLE_MAX_LIT 128
+
+static inline int LZ4_compress_default(const char * src, char * dst, int srclen,
+                                       int dstcap, void * wrkmem)
+{
+  int i, o, run, lit;
+
+  (void) wrkmem;
+
+  i = 0;
+  o = 0;
+  lit = 0;
+
+  while (i < srclen)
+  {
+    for (run = 1; (i + run < srclen) && (run < SHIM_RLE_MAX_RUN); run++)
+    {
+      if (src[i + run] != src[i])
+        break;
+    }
+
+    // a literal run ends at the start of a repeat or when it is full
+    if ((run >= SHIM_RLE_MIN_RUN) || (lit == SHIM_RLE_MAX_LIT))
+    {
+      if (lit != 0)
+      {
+        if (o + 1 + lit > dstcap)
+          return 0;
+        dst[o++] = lit - 1;
+        memcpy(dst + o, src + i - lit, lit);
+        o += lit;
+        lit = 0;
+      }
+    }
+
+    if (run >= SHIM_RLE_MIN_RUN)
+    {
+      if (o + 2 > dstcap)
+        return 0;
+      dst[o++] = run + 125;
+      dst[o++] = src[i];
+      i += run;
+    }
+    else
+    {
+      lit++;
+      i++;
+    }
+  }
+
+  if (lit != 0)
+  {
+    if (o + 1 + lit > dstcap)
+      return 0;
+    dst[o++] = lit - 1;
+    memcpy(dst + o, src + i - lit, lit);
+    o += lit;
+  }
+
+  return o;
+}
+
+static inline int LZ4_decompress_safe(const char * src, char * dst, int srclen, int dstcap)
+{
+  int i, o, n;
+  unsigned char h;
+
+  i = 0;
+  o = 0;
+
+  while (i < srclen)
+  {
+    h = src[i++];
+    if (h < 128)
+    {
+      n = h + 1;
+      if ((i + n > srclen) || (o + n > dstcap))
+        return -1;
+      memcpy(dst + o, src + i, n);
+      i += n;
+    }
+    else
+    {
+      n = h - 125;
+      if ((i + 1 > srclen) || (o + n > dstcap))
+        return -1;
+      memset(dst + o, src[i], n);
+      i++;
+    }
+    o += n;
+  }
+
+  return o;
+}
+
+/*
+ * VFS
+ */
+
+struct cdev {
+  dev_t dev;
+};
+
+struct dentry;
+struct vm_area_struct;
+struct file_operations;
+
+struct address_space;
+
+struct file {
+  void * private_data;
+  struct address_space * f_mapping;
+};
+
+// nothing is ever mapped
+#define unmap_mapping_range(mapping, start, len, even_cows) do { } while (0)
+
+struct kiocb {
+  struct file * ki_filp;
+  loff_t ki_pos;
+  int ki_flags;
+};
+
+#define IOCB_APPEND (1 << 1)
+
+struct iov_iter {
+  char * buf;
+  size_t count;
+};
+
+static inline void iov_iter_shim_init(struct iov_iter * i, void * buf, size_t count)
+{
+  i->buf = buf;
+  i->count = count;
+}
+
+#define iov_iter_count(i) ((i)->count)
+
+static inline size_t copy_to_iter(const void * addr, size_t bytes, struct iov_iter * i)
+{
+  bytes = min_t(size_t, bytes, i->count);
+  memcpy(i->buf, addr, bytes);
+  i->buf += bytes;
+  i->count -= bytes;
+
+  return bytes;
+}
+
+static inline size_t copy_from_iter(void * addr, size_t bytes, struct iov_iter * i)
+{
+  bytes = min_t(size_t, bytes, i->count);
+  memcpy(addr, i->buf, bytes);
+  i->buf += bytes;
+  i->count -= bytes;
+
+  return bytes;
+}
+
+static inline size_t iov_iter_zero(size_t bytes, struct iov_iter * i)
+{
+  bytes = min_t(size_t, bytes, i->count);
+  memset(i->buf, 0, bytes);
+  i->buf += bytes;
+  i->count -= bytes;
+
+  return bytes;
+}
+
+/*
+ * Tracepoints
+ */
+
+static inline void trace_shim(int unused __maybe_unused, ...)
+{
+}
+
+#define trace_scull_read(...) trace_shim(0, __VA_ARGS__)
+#define trace_scull_write(...) trace_shim(0, __VA_ARGS__)
+#define trace_scull_follow(...) trace_shim(0, __VA_ARGS__)
+#define trace_scull_trim(...) trace_shim(0, __VA_ARGS__)
+#define trace_scull_open(...) trace_shim(0, __VA_ARGS__)
+#define trace_scull_lock(...) trace_shim(0, __VA_ARGS__)
+
+#endif /* _SCULL_SHIM_H_ */
@@ -0,0 +1,178 @@
+/*
+ * scull_trace.h -- tracepoints of the scull char module
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The events show up under <tracefs>/events/scull/. A disabled event is
+ * a static branch skipped over, so they stay compiled in.
+ *
+ * "dev" is the minor number of the device, times are in nanoseconds.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#include "scull.h"
+
+DECLARE_EVENT_CLASS(scull_io,
+
+  TP_PROTO(struct scull_dev * dev, loff_t pos, size_t count, ssize_t ret,
+           unsigned long quanta, u64 elapsed),
+
+  TP_ARGS(dev, pos, count, ret, quanta, elapsed),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, dev)
+    __field(loff_t, pos)
+    __field(size_t, count)
+    __field(ssize_t, ret)
+    __field(unsigned long, quanta)
+    __field(u64, elapsed)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = MINOR(dev->cdev.dev);
+    __entry->pos = pos;
+    __entry->count = count;
+    __entry->ret = ret;
+    __entry->quanta = quanta;
+    __entry->elapsed = elapsed;
+  ),
+
+  TP_printk("dev=%u pos=%lld count=%zu ret=%zd quanta=%lu elapsed=%llu",
+            __entry->dev, __entry->pos, __entry->count, __entry->ret,
+            __entry->quanta, __entry->elapsed)
+);
+
+DEFINE_EVENT(scull_io, scull_read,
+  TP_PROTO(struct scull_dev * dev, loff_t pos, size_t count, ssize_t ret,
+           unsigned long quanta, u64 elapsed),
+  TP_ARGS(dev, pos, count, ret, quanta, elapsed)
+);
+
+DEFINE_EVENT(scull_io, scull_write,
+  TP_PROTO(struct scull_dev * dev, loff_t pos, size_t count, ssize_t ret,
+           unsigned long quanta, u64 elapsed),
+  TP_ARGS(dev, pos, count, ret, quanta, elapsed)
+);
+
+TRACE_EVENT(scull_follow,
+
+  TP_PROTO(struct scull_dev * dev, unsigned long item, bool allocated),
+
+  TP_ARGS(dev, item, allocated),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, dev)
+    __field(unsigned long, item)
+    __field(bool, allocated)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = MINOR(dev->cdev.dev);
+    __entry->item = item;
+    __entry->allocated = allocated;
+  ),
+
+  TP_printk("dev=%u item=%lu allocated=%d",
+            __entry->dev, __entry->item, __entry->allocated)
+);
+
+TRACE_EVENT(scull_trim,
+
+  TP_PROTO(struct scull_dev * dev, long size, bool deferred, u64 elapsed),
+
+  TP_ARGS(dev, size, deferred, elapsed),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, dev)
+    __field(long, size)
+    __field(bool, deferred)
+    __field(u64, elapsed)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = MINOR(dev->cdev.dev);
+    __entry->size = size;
+    __entry->deferred = deferred;
+    __entry->elapsed = elapsed;
+  ),
+
+  TP_printk("dev=%u size=%ld deferred=%d elapsed=%llu",
+            __entry->dev, __entry->size, __entry->deferred, __entry->elapsed)
+);
+
+TRACE_EVENT(scull_open,
+
+  TP_PROTO(struct scull_dev * dev, unsigned int flags, int ret),
+
+  TP_ARGS(dev, flags, ret),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, dev)
+    __field(unsigned int, flags)
+    __field(int, ret)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = MINOR(dev->cdev.dev);
+    __entry->flags = flags;
+    __entry->ret = ret;
+  ),
+
+  TP_printk("dev=%u flags=0%o ret=%d", __entry->dev, __entry->flags, __entry->ret)
+);
+
+TRACE_EVENT(scull_lock,
+
+  TP_PROTO(struct scull_dev * dev, bool qset, bool write, u64 wait),
+
+  TP_ARGS(dev, qset, write, wait),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, dev)
+    __field(bool, qset)
+    __field(bool, write)
+    __field(u64, wait)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = MINOR(dev->cdev.dev);
+    __entry->qset = qset;
+    __entry->write = write;
+    __entry->wait = wait;
+  ),
+
+  TP_printk("dev=%u lock=%s mode=%s wait=%llu", __entry->dev,
+            __entry->qset ? "qset" : "device", __entry->write ? "write" : "read",
+            __entry->wait)
+);
+
+#endif /* _SCULL_TRACE_H_ */
+
+// this part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
@@ -17,13 +17,14 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
-declare -i no_devs
+declare -i no_devs no_pipes
 
 # control variables
 declare -r DEVICE="scull"   # the name of the device
 declare -r MODULE="scull"   # the name of the module
 mode="664"                  # permission
 no_devs=4
+no_pipes=4                  # scullpipe devices, after the scull ones
 group=""
 
 function clean_devnodes()
@@ -33,23 +34,49 @@ function clean_devnodes()
     rm -f /dev/${DEVICE}$i
   done
 
+  for ((i = 0; i < no_pipes; i++))
+  do
+    rm -f /dev/${DEVICE}pipe$i
+  done
+
   return
 }
 
+# load [param=value ...] -- the arguments are passed on to insmod
 function load() {
 
-  # TODO: add support for the insmod arguments
-  insmod ./${MODULE}.ko || exit 1
+  local arg
+
+  # the number of nodes follows the number of devices
+  for arg in "$@"
+  do
+    case "${arg}" in
+      scull_nr_devs=* )
+        no_devs=${arg#scull_nr_devs=} ;;
+      scull_p_nr_devs=* )
+        no_pipes=${arg#scull_p_nr_devs=} ;;
+    esac
+  done
+
+  # insmod does not pull in what the module depends on
+  modprobe -q -a lz4_compress lz4_decompress
+
+  insmod ./${MODULE}.ko "$@" || exit 1
 
   clean_devnodes
 
-  major=$(awk -v device="${DEVICE}" '$2 == "device" {print $1}' /proc/devices)
+  major=$(awk -v device="${DEVICE}" '$2 == device {print $1}' /proc/devices)
 
   for ((i = 0; i < no_devs; i++))
   do
     mknod /dev/${DEVICE}$i c "${major}" $i
   done
 
+  for ((i = 0; i < no_pipes; i++))
+  do
+    mknod /dev/${DEVICE}pipe$i c "${major}" $((no_devs + i))
+  done
+
   if grep -qE '^wheel:' /etc/group; then
     group="wheel"
   elif grep -qE '^staff:' /etc/group; then
@@ -64,6 +91,12 @@ function load() {
     chmod ${mode} /dev/"${DEVICE}"$i
   done
 
+  for ((i = 0; i < no_pipes; i++))
+  do
+    chgrp ${group} /dev/"${DEVICE}"pipe$i
+    chmod ${mode} /dev/"${DEVICE}"pipe$i
+  done
+
   return
 }
 
@@ -75,18 +108,20 @@ function unload()
 }
 
 args=${1:-"load"}
+shift
 case "${args}" in
   load )
-    load ;;
+    load "$@" ;;
   unload )
     unload ;;
   reload )
     unload
-    load
+    load "$@"
     ;;
   help )
-    echo "Usage: $0 [load | unload | reload]"
-    echo "Default is load"
+    echo "Usage: $0 [load | unload | reload] [param=value ...]"
+    echo "Default is load, the parameters go to insmod"
+    echo "e.g. $0 reload scull_quantum=4096 scull_qset=512"
     exit 1
     ;;
   * )
@@ -0,0 +1,2843 @@
+/*
+ * storage.c -- the scull storage engine: quanta, quantum sets and the
+ * index, and the read/write paths walking them
+ *
+ * Copyright (C) 2024  Arka Mondal
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Nothing in here touches the char device, the VFS or the module
+ * plumbing, so this file also builds in userspace against scull_shim.h
+ * (see bench/Makefile).
+ */
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/slab.h>           // kmem_cache_*()
+#include <linux/fs.h>
+#include <linux/errno.h>          // error codes
+#include <linux/types.h>
+#include <linux/uio.h>            // iov_iter
+#include <linux/mm.h>             // alloc_pages_exact()
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/log2.h>           // is_power_of_2(), ilog2()
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/cdev.h>
+#include <linux/sched/signal.h>   // fatal_signal_pending()
+#include <linux/lz4.h>
+#include <linux/xxhash.h>
+#include <linux/string.h>         // memchr_inv()
+#include <linux/wait.h>
+
+#include "scull.h"
+#include "scull_trace.h"
+
+#else
+
+#include "scull_shim.h"
+#include "scull.h"
+
+#endif /* __KERNEL__ */
+
+/*
+ * Slab caches are kept per geometry: one cache for each quantum size and
+ * one for each size of quantum set pointer array, shared by every device
+ * using that size.
+ */
+
+struct scull_cache {
+  struct list_head list;
+  size_t size;                  // object size
+  unsigned int users;           // devices using this cache
+  struct kmem_cache * cache;
+  char name[32];
+};
+
+static LIST_HEAD(scull_caches);
+static DEFINE_MUTEX(scull_caches_lock);
+
+static struct kmem_cache * scull_qset_cache;  // struct scull_qset nodes
+static struct workqueue_struct * scull_wq;    // deferred trims
+
+static atomic_long_t scull_mem_total = ATOMIC_LONG_INIT(0); // bytes of quanta, all devices
+
+/*
+ * scull_cache_get - find or create the slab cache for objects of @size bytes
+ * @prefix:       name prefix, tells quanta and pointer arrays apart
+ * @size:         object size
+ *
+ * Return:
+ * the cache on success or NULL on error.
+ */
+
+static struct kmem_cache * scull_cache_get(const char * prefix, size_t size)
+{
+  struct scull_cache * sc;
+  struct kmem_cache * cache;
+
+  cache = NULL;
+  mutex_lock(&scull_caches_lock);
+
+  list_for_each_entry(sc, &scull_caches, list)
+  {
+    if ((sc->size == size) && (strncmp(sc->name, prefix, strlen(prefix)) == 0))
+    {
+      sc->users++;
+      cache = sc->cache;
+      goto done;
+    }
+  }
+
+  sc = kmalloc(sizeof(struct scull_cache), GFP_KERNEL);
+  if (sc == NULL)
+    goto done;
+
+  snprintf(sc->name, sizeof(sc->name), "%s%zu", prefix, size);
+  // charged to the memory cgroup of whoever allocates from it
+  sc->cache = kmem_cache_create(sc->name, size, 0, SLAB_ACCOUNT, NULL);
+  if (sc->cache == NULL)
+  {
+    kfree(sc);
+    goto done;
+  }
+
+  sc->size = size;
+  sc->users = 1;
+  list_add(&sc->list, &scull_caches);
+  cache = sc->cache;
+
+done:
+  mutex_unlock(&scull_caches_lock);
+  return cache;
+}
+
+/*
+ * scull_cache_put - drop a reference taken by scull_cache_get()
+ * @cache:        the cache, may be NULL
+ */
+
+static void scull_cache_put(struct kmem_cache * cache)
+{
+  struct scull_cache * sc;
+
+  if (cache == NULL)
+    return;
+
+  mutex_lock(&scull_caches_lock);
+
+  list_for_each_entry(sc, &scull_caches, list)
+  {
+    if (sc->cache == cache)
+    {
+      if (--sc->users == 0)
+      {
+        list_del(&sc->list);
+        kmem_cache_destroy(sc->cache);
+        kfree(sc);
+      }
+      break;
+    }
+  }
+
+  mutex_unlock(&scull_caches_lock);
+}
+
+/*
+ * scull_dev_caches_get - attach the slab caches matching the device geometry
+ * @dev:        scull device
+ *
+ * Page-backed quanta bypass the slab, so only the pointer array cache is
+ * needed for them.
+ *
+ * Return:
+ * 0 on success or -ENOMEM on error.
+ */
+
+static int scull_dev_caches_get(struct scull_dev * dev)
+{
+  dev->qptr_cache = scull_cache_get("scull_qset_", dev->qset * sizeof(void *));
+  if (dev->qptr_cache == NULL)
+    return -ENOMEM;
+
+  if (SCULL_PAGE_QUANTA(dev))
+    return 0;
+
+  dev->quantum_cache = scull_cache_get("scull_quantum_", dev->quantum);
+  if (dev->quantum_cache == NULL)
+    return -ENOMEM;
+
+  return 0;
+}
+
+static void scull_dev_caches_put(struct scull_dev * dev)
+{
+  scull_cache_put(dev->quantum_cache);
+  scull_cache_put(dev->qptr_cache);
+  dev->quantum_cache = NULL;
+  dev->qptr_cache = NULL;
+}
+
+/*
+ * scull_lock_waited - account a lock that was not free at the first try
+ * @dev:        scull device
+ * @item:       SCULL_STAT_LOCK_CONTENDED or SCULL_STAT_QSET_LOCK_CONTENDED
+ * @write:      the lock was taken for writing
+ * @start:      ktime_get_ns() when the wait started
+ */
+
+static void scull_lock_waited(struct scull_dev * dev, enum scull_stat item, bool write,
+                              u64 start)
+{
+  u64 wait;
+
+  wait = ktime_get_ns() - start;
+
+  scull_stat_add(dev, item, 1);
+  // the wait time counter always follows the contention counter
+  scull_stat_add(dev, item + 1, wait);
+
+  trace_scull_lock(dev, item == SCULL_STAT_QSET_LOCK_CONTENDED, write, wait);
+}
+
+/*
+ * Lock helpers: the uncontended case costs a trylock, the clock is only
+ * read when there is a wait to measure. Every acquisition is traced.
+ */
+
+int scull_lock_read(struct scull_dev * dev)
+{
+  u64 start;
+  int err;
+
+  if (down_read_trylock(&dev->rwsem))
+  {
+    trace_scull_lock(dev, false, false, 0);
+    return 0;
+  }
+
+  start = ktime_get_ns();
+  err = down_read_interruptible(&dev->rwsem);
+  scull_lock_waited(dev, SCULL_STAT_LOCK_CONTENDED, false, start);
+
+  return err ? -ERESTARTSYS : 0;
+}
+
+int scull_lock_write(struct scull_dev * dev)
+{
+  u64 start;
+  int err;
+
+  if (down_write_trylock(&dev->rwsem))
+  {
+    trace_scull_lock(dev, false, true, 0);
+    return 0;
+  }
+
+  start = ktime_get_ns();
+  err = down_write_killable(&dev->rwsem);
+  scull_lock_waited(dev, SCULL_STAT_LOCK_CONTENDED, true, start);
+
+  return err ? -ERESTARTSYS : 0;
+}
+
+// tell the scans the quantum set is in use, without dirtying its line for nothing
+static inline void scull_qset_touch(struct scull_qset * qsetp)
+{
+  if (READ_ONCE(qsetp->referenced) != SCULL_REF_ALL)
+    WRITE_ONCE(qsetp->referenced, SCULL_REF_ALL);
+}
+
+static void scull_qset_lock_read(struct scull_dev * dev, struct scull_qset * qsetp)
+{
+  u64 start;
+
+  scull_qset_touch(qsetp);
+
+  if (down_read_trylock(&qsetp->rwsem))
+  {
+    trace_scull_lock(dev, true, false, 0);
+    return;
+  }
+
+  start = ktime_get_ns();
+  down_read(&qsetp->rwsem);
+  scull_lock_waited(dev, SCULL_STAT_QSET_LOCK_CONTENDED, false, start);
+}
+
+static void scull_qset_lock_write(struct scull_dev * dev, struct scull_qset * qsetp)
+{
+  u64 start;
+
+  scull_qset_touch(qsetp);
+
+  if (down_write_trylock(&qsetp->rwsem))
+  {
+    trace_scull_lock(dev, true, true, 0);
+    return;
+  }
+
+  start = ktime_get_ns();
+  down_write(&qsetp->rwsem);
+  scull_lock_waited(dev, SCULL_STAT_QSET_LOCK_CONTENDED, true, start);
+}
+
+/*
+ * scull_mem_limit - memory cap of a device
+ * @dev:        scull device
+ *
+ * Return:
+ * the cap in bytes, 0 if there is none.
+ */
+
+static unsigned long scull_mem_limit(struct scull_dev * dev)
+{
+  unsigned long max;
+
+  max = READ_ONCE(dev->max_bytes);
+
+  return (max != 0) ? max : READ_ONCE(scull_max_bytes);
+}
+
+/*
+ * scull_mem_full - check whether one more quantum would go over the cap
+ * of the device or the global one
+ * @dev:        scull device
+ */
+
+static bool scull_mem_full(struct scull_dev * dev)
+{
+  unsigned long max, global;
+
+  max = scull_mem_limit(dev);
+  global = READ_ONCE(scull_global_max_bytes);
+
+  if ((max != 0) && ((unsigned long) atomic_long_read(&dev->mem) + dev->quantum > max))
+    return true;
+
+  return (global != 0) &&
+         ((unsigned long) atomic_long_read(&scull_mem_total) + dev->quantum > global);
+}
+
+/*
+ * scull_mem_charge - account for a quantum about to be allocated
+ * @dev:        scull device
+ *
+ * Return:
+ * true if the quantum fits under both caps, false (nothing charged)
+ * otherwise.
+ */
+
+static bool scull_mem_charge(struct scull_dev * dev)
+{
+  unsigned long max, global;
+
+  max = scull_mem_limit(dev);
+  global = READ_ONCE(scull_global_max_bytes);
+
+  // charge first and back off, so that racing writers cannot both get in
+  if (((unsigned long) atomic_long_add_return(dev->quantum, &dev->mem) > max) && (max != 0))
+    goto over_dev;
+
+  if (((unsigned long) atomic_long_add_return(dev->quantum, &scull_mem_total) > global) &&
+      (global != 0))
+    goto over_global;
+
+  return true;
+
+over_global:
+  atomic_long_sub(dev->quantum, &scull_mem_total);
+over_dev:
+  atomic_long_sub(dev->quantum, &dev->mem);
+  return false;
+}
+
+// account for @nr quanta given back to the allocator
+static void scull_mem_uncharge(struct scull_dev * dev, unsigned long nr)
+{
+  atomic_long_sub(nr * dev->quantum, &dev->mem);
+  atomic_long_sub(nr * dev->quantum, &scull_mem_total);
+}
+
+/*
+ * scull_zq_account - account for a compressed quantum coming or going
+ * @dev:        scull device
+ * @zq:         the compressed quantum
+ * @sign:       1 when it comes, -1 when it goes
+ *
+ * Compressed quanta always fit: they only ever replace a larger raw one.
+ */
+
+static void scull_zq_account(struct scull_dev * dev, struct scull_zquantum * zq, long sign)
+{
+  atomic_long_add(sign * zq->size, &dev->mem);
+  atomic_long_add(sign * zq->size, &scull_mem_total);
+  atomic_long_add(sign * zq->size, &dev->zbytes);
+  atomic_long_add(sign, &dev->zquanta);
+}
+
+/*
+ * scull_zq_uncache - drop the decompressed copy of a compressed quantum,
+ * if it has one; must be called with the quantum set lock held for
+ * writing, or on a quantum nobody can find any more.
+ * @dev:        scull device
+ * @zq:         the compressed quantum
+ */
+
+static void scull_zq_uncache(struct scull_dev * dev, struct scull_zquantum * zq)
+{
+  if (zq->raw == NULL)
+    return;
+
+  // never a page quantum, those are not compressed
+  scull_mem_uncharge(dev, 1);
+  kmem_cache_free(dev->quantum_cache, zq->raw);
+  zq->raw = NULL;
+  atomic_long_dec(&dev->zcached);
+}
+
+/*
+ * scull_dedup_put - drop a reference to a shared quantum
+ * @dev:        scull device
+ * @dq:         the shared quantum
+ * @snap:       the reference is the one of the snapshot
+ *
+ * The last reference frees it, shared quanta are only ever slab quanta.
+ * Those kept for a snapshot are not in the dedup table. "dedup_saved"
+ * counts the slots sharing a quantum with another slot, the snapshot
+ * does not take part.
+ */
+
+static void scull_dedup_put(struct scull_dev * dev, struct scull_dquantum * dq, bool snap)
+{
+  bool last, saved;
+
+  spin_lock(&dev->dedup_lock);
+  if (snap)
+    dq->snapped = false;
+  last = (--dq->refs == 0);
+  saved = !snap && (dq->refs > dq->snapped);
+  if (last && !hlist_unhashed(&dq->node))
+    hlist_del(&dq->node);
+  spin_unlock(&dev->dedup_lock);
+
+  if (saved)
+    atomic_long_dec(&dev->dedup_saved);
+
+  if (!last)
+    return;
+
+  scull_mem_uncharge(dev, 1);
+  kmem_cache_free(dev->quantum_cache, dq->data);
+  kfree(dq);
+}
+
+/*
+ * scull_quantum_release - hand a quantum back to its allocator
+ * @dev:        scull device
+ * @data:       the quantum
+ *
+ * Pages still mapped by a process keep their own reference, so they
+ * only go back to the page allocator once the last mapping is gone.
+ * Compressed and shared quanta are handled too.
+ */
+
+static void scull_quantum_release(struct scull_dev * dev, void * data)
+{
+  struct scull_zquantum * zq;
+
+  if (scull_zq_tagged(data))
+  {
+    zq = scull_zq(data);
+    scull_zq_uncache(dev, zq);
+    scull_zq_account(dev, zq, -1);
+    kfree(zq);
+    return;
+  }
+
+  if (scull_dq_tagged(data))
+  {
+    scull_dedup_put(dev, scull_dq(data), false);
+    return;
+  }
+
+  scull_mem_uncharge(dev, 1);
+
+  if (SCULL_PAGE_QUANTA(dev))
+    free_pages_exact(data, dev->quantum);
+  else
+    kmem_cache_free(dev->quantum_cache, data);
+}
+
+/*
+ * scull_quantum_idle - check that nobody but the device uses a quantum
+ * @dev:        scull device
+ * @data:       the quantum
+ *
+ * Return:
+ * true if the quantum can be recycled.
+ */
+
+static bool scull_quantum_idle(struct scull_dev * dev, void * data)
+{
+  unsigned int off;
+
+  if (!SCULL_PAGE_QUANTA(dev))
+    return true;
+
+  // a page still mapped somewhere must not be handed out again
+  for (off = 0; off < dev->quantum; off += PAGE_SIZE)
+  {
+    if (page_count(virt_to_page(data + off)) != 1)
+      return false;
+  }
+
+  return true;
+}
+
+/*
+ * scull_quantum_new - get a quantum from the allocator, bypassing the pool
+ * @dev:        scull device
+ *
+ * The quantum is charged to the device, and to the memory cgroup of the
+ * calling task.
+ *
+ * Return:
+ * address of the quantum on success or NULL on error, or when it would
+ * go over a memory cap.
+ */
+
+static void * scull_quantum_new(struct scull_dev * dev)
+{
+  void * data;
+
+  if (!scull_mem_charge(dev))
+    return NULL;
+
+  if (SCULL_PAGE_QUANTA(dev))
+    data = alloc_pages_exact(dev->quantum, GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+  else
+    data = kmem_cache_alloc(dev->quantum_cache, GFP_KERNEL_ACCOUNT);
+
+  if (data == NULL)
+    scull_mem_uncharge(dev, 1);
+
+  return data;
+}
+
+/*
+ * scull_quantum_alloc - allocate one quantum for the device
+ * @dev:        scull device
+ *
+ * Recycled quanta from the device pool are used first. Otherwise quanta
+ * that are a whole number of pages come straight from the page allocator
+ * (zeroed, since they may end up mapped into userspace), so that the
+ * device can be mmap()ed, and any other size comes from the slab cache
+ * of that quantum size. A cache-like device at its memory cap makes room
+ * by evicting some of its own cold quanta.
+ *
+ * Return:
+ * address of the quantum on success or NULL on error.
+ */
+
+static void * scull_quantum_alloc(struct scull_dev * dev)
+{
+  void * data;
+  struct scull_pool * pool;
+
+  pool = &dev->pool;
+
+  spin_lock(&pool->lock);
+  data = pool->head;
+  if (data != NULL)
+  {
+    pool->head = *(void **) data;
+    pool->count--;
+    pool->hits++;
+  }
+  else
+  {
+    pool->misses++;
+  }
+  spin_unlock(&pool->lock);
+
+  if (data != NULL)
+  {
+    if (SCULL_PAGE_QUANTA(dev))
+      memset(data, 0, dev->quantum);
+    return data;
+  }
+
+  data = scull_quantum_new(dev);
+  if ((data == NULL) && (READ_ONCE(dev->flags) & SCULL_LIMIT_CACHE) &&
+      scull_mem_full(dev) && (scull_evict(dev, SCULL_EVICT_BATCH) != 0))
+    data = scull_quantum_new(dev);
+
+  return data;
+}
+
+/*
+ * scull_quantum_recycle - keep a quantum in the device pool for the next
+ * write
+ * @dev:        scull device
+ * @data:       the quantum
+ *
+ * Return:
+ * true if the quantum went to the pool, false if the pool already holds
+ * "scull_pool_max" quanta, the quantum is still in use elsewhere or it is
+ * compressed or shared.
+ */
+
+static bool scull_quantum_recycle(struct scull_dev * dev, void * data)
+{
+  bool pooled;
+  struct scull_pool * pool;
+
+  if (scull_zq_tagged(data) || scull_dq_tagged(data) || !scull_quantum_idle(dev, data))
+    return false;
+
+  pool = &dev->pool;
+  pooled = false;
+
+  spin_lock(&pool->lock);
+  if (pool->count < scull_pool_max)
+  {
+    *(void **) data = pool->head;
+    pool->head = data;
+    pool->count++;
+    pooled = true;
+  }
+  spin_unlock(&pool->lock);
+
+  return pooled;
+}
+
+/*
+ * scull_quantum_free - release a quantum allocated by scull_quantum_alloc()
+ * @dev:        scull device
+ * @data:       the quantum, may be NULL
+ */
+
+static void scull_quantum_free(struct scull_dev * dev, void * data)
+{
+  if (data == NULL)
+    return;
+
+  scull_stat_add(dev, SCULL_STAT_QUANTUM_FREE, 1);
+
+  if (!scull_quantum_recycle(dev, data))
+    scull_quantum_release(dev, data);
+}
+
+/*
+ * scull_pool_drain - give every pooled quantum back to its allocator
+ * @dev:        scull device
+ */
+
+static void scull_pool_drain(struct scull_dev * dev)
+{
+  void * data, * next;
+  struct scull_pool * pool;
+
+  pool = &dev->pool;
+
+  spin_lock(&pool->lock);
+  data = pool->head;
+  pool->head = NULL;
+  pool->count = 0;
+  spin_unlock(&pool->lock);
+
+  for (; data != NULL; data = next)
+  {
+    next = *(void **) data;
+    scull_quantum_release(dev, data);
+  }
+}
+
+/*
+ * scull_pool_shrink - give up to @nr pooled quanta back to their allocator
+ * @dev:        scull device
+ * @nr:         number of quanta to free
+ *
+ * Return:
+ * number of quanta freed.
+ */
+
+unsigned long scull_pool_shrink(struct scull_dev * dev, unsigned long nr)
+{
+  unsigned long freed;
+  void * data;
+  struct scull_pool * pool;
+
+  pool = &dev->pool;
+
+  for (freed = 0; freed < nr; freed++)
+  {
+    spin_lock(&pool->lock);
+    data = pool->head;
+    if (data != NULL)
+    {
+      pool->head = *(void **) data;
+      pool->count--;
+    }
+    spin_unlock(&pool->lock);
+
+    if (data == NULL)
+      break;
+
+    scull_quantum_release(dev, data);
+  }
+
+  return freed;
+}
+
+/*
+ * scull_set_geometry - set the quantum and quantum set sizes of a device
+ * @dev:        scull device
+ * @quantum:    quantum size in bytes
+ * @qset:       number of quanta per quantum set
+ *
+ * When both are powers of two, offsets are decomposed with shifts and
+ * masks instead of divisions (see scull_locate()).
+ */
+
+static void scull_set_geometry(struct scull_dev * dev, unsigned int quantum,
+                               unsigned int qset)
+{
+  dev->quantum = quantum;
+  dev->qset = qset;
+  dev->pow2 = is_power_of_2(quantum) && is_power_of_2(qset);
+  dev->quantum_shift = dev->pow2 ? ilog2(quantum) : 0;
+  dev->qset_shift = dev->pow2 ? ilog2(qset) : 0;
+}
+
+/*
+ * scull_index_release - free every quantum set and quantum of an index
+ * @dev:        scull device the index belonged to
+ * @index:      the index, left empty but usable
+ *
+ * Quanta go to the device pool while it has room. The rest of the slab
+ * allocated ones are freed in batches, and the CPU is given up between
+ * quantum sets, since a large device holds millions of quanta.
+ */
+
+static void scull_index_release(struct scull_dev * dev, struct scull_index * index)
+{
+  unsigned int i, n;
+  unsigned long item, freed;
+  struct scull_qset * curr;
+  void * data;
+  void * batch[SCULL_FREE_BATCH];
+
+  n = 0;
+
+  xa_for_each(&index->qsets, item, curr)
+  {
+    freed = 0;
+
+    for (i = 0; (curr->data != NULL) && (i < dev->qset); i++)
+    {
+      data = curr->data[i];
+      if (data == NULL)
+        continue;
+
+      freed++;
+      if (scull_quantum_recycle(dev, data))
+        continue;
+
+      if (SCULL_PAGE_QUANTA(dev) || scull_zq_tagged(data) || scull_dq_tagged(data))
+      {
+        scull_quantum_release(dev, data);
+        continue;
+      }
+
+      batch[n++] = data;
+      if (n == SCULL_FREE_BATCH)
+      {
+        kmem_cache_free_bulk(dev->quantum_cache, n, batch);
+        scull_mem_uncharge(dev, n);
+        n = 0;
+      }
+    }
+
+    if (curr->data != NULL)
+      kmem_cache_free(dev->qptr_cache, curr->data);
+    kmem_cache_free(scull_qset_cache, curr);
+
+    scull_stat_add(dev, SCULL_STAT_QUANTUM_FREE, freed);
+    scull_stat_add(dev, SCULL_STAT_QSET_FREE, 1);
+
+    cond_resched();
+  }
+
+  if (n > 0)
+  {
+    kmem_cache_free_bulk(dev->quantum_cache, n, batch);
+    scull_mem_uncharge(dev, n);
+  }
+
+  xa_destroy(&index->qsets);
+}
+
+/*
+ * scull_index_free_work - release an index detached by scull_trim()
+ * @work:       the "free_work" of the index
+ */
+
+static void scull_index_free_work(struct work_struct * work)
+{
+  struct scull_index * index;
+
+  index = container_of(work, struct scull_index, free_work);
+
+  scull_index_release(index->dev, index);
+  kfree(index);
+}
+
+/*
+ * scull_index_alloc - set up an empty quantum set index for a device
+ * @dev:        scull device
+ *
+ * Return:
+ * the index on success or NULL on error.
+ */
+
+static struct scull_index * scull_index_alloc(struct scull_dev * dev)
+{
+  struct scull_index * index;
+
+  index = kmalloc(sizeof(struct scull_index), GFP_KERNEL);
+  if (index == NULL)
+    return NULL;
+
+  xa_init(&index->qsets);
+  INIT_WORK(&index->free_work, scull_index_free_work);
+  index->dev = dev;
+
+  return index;
+}
+
+/*
+ * scull_snap_attached - check whether a snapshot shares the device index;
+ * must be called with the device lock held.
+ * @dev:        scull device
+ */
+
+static inline bool scull_snap_attached(struct scull_dev * dev)
+{
+  return (dev->snap != NULL) && (dev->snap->index == dev->index);
+}
+
+/*
+ * scull_trim - empty out the scull device; must be called with
+ * the device lock held for writing.
+ * @dev:        scull device
+ *
+ * The quantum set index is swapped for an empty one and the old one is
+ * freed later from the scull workqueue, so trimming costs the same
+ * whatever the size of the device. Should there be no memory for a new
+ * index, the old one is emptied in place. A snapshot sharing the old index
+ * keeps it, and frees it once closed.
+ *
+ * Return:
+ * 0 on success or -ENOMEM if there is no memory for a new index while a
+ * snapshot shares the old one, the device being left as it was.
+ */
+
+int scull_trim(struct scull_dev * dev)
+{
+  u64 start, elapsed;
+  long size;
+  bool deferred, snapped;
+  struct scull_index * index;
+
+  start = ktime_get_ns();
+  size = atomic_long_read(&dev->size);
+  deferred = false;
+  snapped = scull_snap_attached(dev);
+
+  if (!xa_empty(&dev->index->qsets) || snapped)
+  {
+    index = scull_index_alloc(dev);
+    if (index != NULL)
+    {
+      swap(index, dev->index);
+      if (!snapped)
+        queue_work(scull_wq, &index->free_work);
+      deferred = true;
+    }
+    else if (snapped)
+    {
+      return -ENOMEM;
+    }
+    else
+    {
+      scull_index_release(dev, dev->index);
+    }
+  }
+
+  // quantum sets cached by open file cursors are gone
+  dev->gen++;
+  atomic_long_set(&dev->size, 0);
+
+  elapsed = ktime_get_ns() - start;
+  scull_lat_record(dev, SCULL_LAT_TRIM, elapsed);
+  trace_scull_trim(dev, size, deferred, elapsed);
+
+  return 0;
+}
+
+/*
+ * scull_geometry_valid - check a geometry against the bounds of scull.h
+ * @quantum:    quantum size in bytes
+ * @qset:       number of quanta per quantum set
+ *
+ * The pool links quanta through their first word, so a quantum holds at
+ * least a pointer.
+ */
+
+bool scull_geometry_valid(unsigned int quantum, unsigned int qset)
+{
+  return (quantum >= sizeof(void *)) && (quantum <= SCULL_QUANTUM_MAX) &&
+         (qset != 0) && (qset <= SCULL_QSET_MAX);
+}
+
+/*
+ * scull_storage_reshape - change the geometry of an empty device; must be
+ * called with the device lock held for writing.
+ * @dev:        scull device
+ * @quantum:    new quantum size in bytes
+ * @qset:       new number of quanta per quantum set
+ *
+ * The geometry stays with the device across trims. The pool is emptied,
+ * its quanta having the old size.
+ *
+ * Return:
+ * 0 on success, -EINVAL for a geometry out of range, -EBUSY if the device
+ * holds any quantum set or has a snapshot or appropriate errno value on
+ * error.
+ */
+
+int scull_storage_reshape(struct scull_dev * dev, unsigned int quantum, unsigned int qset)
+{
+  struct kmem_cache * quantum_cache, * qptr_cache;
+
+  if (!scull_geometry_valid(quantum, qset))
+    return -EINVAL;
+
+  // a snapshot reads its quanta with the geometry of the device
+  if ((atomic_long_read(&dev->size) != 0) || !xa_empty(&dev->index->qsets) ||
+      (dev->snap != NULL))
+    return -EBUSY;
+
+  if ((quantum == dev->quantum) && (qset == dev->qset))
+    return 0;
+
+  // get the new caches first, so that a failure leaves the device as it was
+  quantum_cache = NULL;
+  qptr_cache = scull_cache_get("scull_qset_", qset * sizeof(void *));
+  if (qptr_cache == NULL)
+    return -ENOMEM;
+
+  if ((quantum % PAGE_SIZE) != 0)
+  {
+    quantum_cache = scull_cache_get("scull_quantum_", quantum);
+    if (quantum_cache == NULL)
+    {
+      scull_cache_put(qptr_cache);
+      return -ENOMEM;
+    }
+  }
+
+  // earlier trims may still be freeing quanta of the old geometry
+  scull_storage_flush();
+  scull_pool_drain(dev);
+  scull_dev_caches_put(dev);
+
+  dev->quantum_cache = quantum_cache;
+  dev->qptr_cache = qptr_cache;
+  scull_set_geometry(dev, quantum, qset);
+
+  // file cursors hold offsets split with the old geometry
+  dev->gen++;
+
+  return 0;
+}
+
+/*
+ * scull_pool_reserve - fill the pool of a device with enough quanta for
+ * @bytes of data
+ * @dev:        scull device
+ * @bytes:      amount of data the next writes should find quanta for
+ *
+ * The next writes then take their quanta from the pool instead of the
+ * allocator. Quanta already in the pool count, and a reservation may go
+ * over "scull_pool_max": the limit only applies to quanta coming back
+ * from trims and punched holes.
+ *
+ * Return:
+ * 0 on success, -ENOSPC past the memory cap or appropriate errno value on
+ * error, the quanta reserved so far staying in the pool.
+ */
+
+int scull_pool_reserve(struct scull_dev * dev, unsigned long long bytes)
+{
+  unsigned long long want;
+  void * data;
+  struct scull_pool * pool;
+
+  pool = &dev->pool;
+  want = DIV_ROUND_UP_ULL(bytes, dev->quantum);
+
+  for (;;)
+  {
+    spin_lock(&pool->lock);
+    if (pool->count >= want)
+    {
+      spin_unlock(&pool->lock);
+      return 0;
+    }
+    spin_unlock(&pool->lock);
+
+    if (fatal_signal_pending(current))
+      return -EINTR;
+
+    data = scull_quantum_new(dev);
+    if (data == NULL)
+      return scull_mem_full(dev) ? -ENOSPC : -ENOMEM;
+
+    spin_lock(&pool->lock);
+    *(void **) data = pool->head;
+    pool->head = data;
+    pool->count++;
+    spin_unlock(&pool->lock);
+
+    cond_resched();
+  }
+}
+
+/*
+ * scull_cursor_load - resolve a file offset into item, quantum index and
+ * offset in that quantum; must be called with the device lock held.
+ * @sf:         per open file state
+ * @pos:        file offset
+ * @item:       item number of the quantum set holding @pos
+ * @qindx:      index of the quantum in that set
+ * @qoff:       offset in that quantum
+ *
+ * When @pos is where the last read or write on this file stopped, the
+ * cursor left behind by scull_cursor_store() answers without any division
+ * or index lookup. The cursor is stale once the device generation moved
+ * on, i.e. after a trim.
+ *
+ * Return:
+ * the quantum set holding @pos if the cursor had it, otherwise NULL (the
+ * caller looks it up from @item).
+ */
+
+static struct scull_qset * scull_cursor_load(struct scull_file * sf, loff_t pos,
+                                              unsigned long * item, unsigned long * qindx,
+                                              unsigned long * qoff)
+{
+  struct scull_dev * dev;
+  struct scull_qset * qsetp;
+
+  dev = sf->dev;
+  qsetp = NULL;
+
+  spin_lock(&sf->lock);
+  if ((sf->cursor.qset != NULL) && (sf->cursor.pos == pos) && (sf->cursor.gen == dev->gen))
+  {
+    *item = sf->cursor.item;
+    *qindx = sf->cursor.qindx;
+    *qoff = sf->cursor.qoff;
+    qsetp = sf->cursor.qset;
+  }
+  spin_unlock(&sf->lock);
+
+  if (qsetp != NULL)
+  {
+    scull_stat_add(dev, SCULL_STAT_CURSOR_HITS, 1);
+    return qsetp;
+  }
+
+  scull_locate(dev, pos, item, qindx, qoff);
+
+  return NULL;
+}
+
+/*
+ * scull_cursor_store - remember where an I/O on this file stopped
+ * @sf:         per open file state
+ * @pos:        file offset the I/O stopped at
+ * @item:       item number of @qsetp
+ * @qindx:      quantum index in @qsetp
+ * @qoff:       offset in that quantum
+ * @qsetp:      quantum set holding @pos, NULL empties the cursor
+ */
+
+static void scull_cursor_store(struct scull_file * sf, loff_t pos, unsigned long item,
+                                unsigned long qindx, unsigned long qoff,
+                                struct scull_qset * qsetp)
+{
+  spin_lock(&sf->lock);
+  sf->cursor.pos = pos;
+  sf->cursor.item = item;
+  sf->cursor.qindx = qindx;
+  sf->cursor.qoff = qoff;
+  sf->cursor.qset = qsetp;
+  sf->cursor.gen = sf->dev->gen;
+  spin_unlock(&sf->lock);
+}
+
+/*
+ * scull_size_extend - raise the device size to @pos if it is below it
+ * @dev         scull device
+ * @pos         end of the data just written
+ *
+ * The size is a high-water mark shared by concurrent writers, it only
+ * ever grows outside of scull_trim().
+ */
+
+void scull_size_extend(struct scull_dev * dev, loff_t pos)
+{
+  long size;
+
+  size = atomic_long_read(&dev->size);
+  while (size < pos)
+  {
+    if (atomic_long_try_cmpxchg(&dev->size, &size, pos))
+      break;
+  }
+}
+
+/*
+ * scull_follow - look up the nth quantum set in the index, allocating
+ * it if needed; must be called with the device lock held.
+ * @dev         scull device
+ * @n           item number of the quantum set [0..)
+ *
+ * Writers only hold the device lock for reading, so two of them may race
+ * to allocate the same quantum set; the loser frees its copy and uses the
+ * winner's.
+ *
+ * Return:
+ * address of nth quantum set on success or NULL on error.
+ */
+
+struct scull_qset * scull_follow(struct scull_dev * dev, unsigned long n)
+{
+  struct scull_qset * qset, * old;
+
+  scull_stat_add(dev, SCULL_STAT_FOLLOW, 1);
+
+  qset = xa_load(&dev->index->qsets, n);
+  if (qset != NULL)
+  {
+    trace_scull_follow(dev, n, false);
+    return qset;
+  }
+
+  // allocate the qset if needed
+  qset = kmem_cache_alloc(scull_qset_cache, GFP_KERNEL_ACCOUNT);
+  if (qset == NULL)
+    return NULL;
+
+  SCULL_QSET_INIT(qset);
+  qset->item = n;
+
+  old = xa_cmpxchg(&dev->index->qsets, n, NULL, qset, GFP_KERNEL_ACCOUNT);
+  if (old != NULL)
+  {
+    kmem_cache_free(scull_qset_cache, qset);
+    if (xa_is_err(old))
+      return NULL;
+
+    trace_scull_follow(dev, n, false);
+    return old;
+  }
+
+  scull_stat_add(dev, SCULL_STAT_QSET_ALLOC, 1);
+  trace_scull_follow(dev, n, true);
+
+  return qset;
+}
+
+/*
+ * scull_zq_decompress - decompress a quantum into a buffer
+ * @dev         scull device
+ * @zq          the compressed quantum
+ * @buf         room for a whole quantum
+ *
+ * Return:
+ * 0 on success or -EIO if the quantum does not come back whole.
+ */
+
+static int scull_zq_decompress(struct scull_dev * dev, struct scull_zquantum * zq, void * buf)
+{
+  u64 start;
+
+  start = ktime_get_ns();
+
+  // the worker made sure the whole quantum comes back
+  if (WARN_ON_ONCE(LZ4_decompress_safe(zq->data, buf, zq->len, dev->quantum) !=
+                   (int) dev->quantum))
+    return -EIO;
+
+  scull_stat_add(dev, SCULL_STAT_INFLATED, 1);
+  scull_lat_record(dev, SCULL_LAT_INFLATE, ktime_get_ns() - start);
+
+  return 0;
+}
+
+/*
+ * scull_quantum_inflate - decompress a quantum back in place; must be
+ * called with the quantum set lock held for writing.
+ * @dev         scull device
+ * @qsetp       quantum set holding the quantum
+ * @qindx       index of the quantum in @qsetp
+ *
+ * Return:
+ * address of the raw quantum, which may already have been raw, on success
+ * or NULL on error (the compressed one is left in place).
+ */
+
+static void * scull_quantum_inflate(struct scull_dev * dev, struct scull_qset * qsetp,
+                                    unsigned long qindx)
+{
+  void * data;
+
+  struct scull_zquantum * zq;
+
+  if (!scull_zq_tagged(qsetp->data[qindx]))
+    return qsetp->data[qindx];
+
+  // the copy kept for readers is already the raw quantum
+  zq = scull_zq(qsetp->data[qindx]);
+  data = zq->raw;
+  if (data != NULL)
+  {
+    zq->raw = NULL;
+    atomic_long_dec(&dev->zcached);
+  }
+  else
+  {
+    data = scull_quantum_alloc(dev);
+    if (data == NULL)
+      return NULL;
+
+    if (scull_zq_decompress(dev, zq, data))
+    {
+      scull_quantum_release(dev, data);
+      return NULL;
+    }
+  }
+
+  scull_quantum_release(dev, qsetp->data[qindx]);
+  qsetp->data[qindx] = data;
+  qsetp->packed = false;
+
+  return data;
+}
+
+/*
+ * scull_quantum_read - the bytes of a quantum for a reader holding the
+ * quantum set lock
+ * @dev         scull device
+ * @data        the quantum, as found in the quantum set
+ * @scratch     buffer for a compressed quantum, allocated on first use and
+ *              freed by the caller with kvfree()
+ * @keep        keep a decompressed copy for the next reads if there is room
+ *
+ * A compressed quantum stays compressed, its copy is taken if there is
+ * one. Otherwise the copy is made under SCULL_ZCACHE_MAX and the memory
+ * cap, and the scratch buffer is used past them: it is not device memory,
+ * so a read does not depend on room under the cap. Copies only go away
+ * with the quantum set lock held for writing.
+ *
+ * Return:
+ * address of the bytes on success or ERR_PTR() of an errno value.
+ */
+
+static void * scull_quantum_read(struct scull_dev * dev, void * data, void ** scratch,
+                                 bool keep)
+{
+  int retval;
+  void * raw;
+  struct scull_zquantum * zq;
+
+  if (!scull_zq_tagged(data))
+    return scull_quantum_bytes(data);
+
+  // pairs with the release below, the copy is whole once seen
+  zq = scull_zq(data);
+  raw = smp_load_acquire(&zq->raw);
+  if (raw != NULL)
+    return raw;
+
+  // the bound is loose, readers racing here may each add one copy
+  raw = NULL;
+  if (keep && (atomic_long_read(&dev->zcached) < SCULL_ZCACHE_MAX))
+    raw = scull_quantum_new(dev);
+
+  if (raw != NULL)
+  {
+    retval = scull_zq_decompress(dev, zq, raw);
+    if (retval)
+    {
+      scull_quantum_release(dev, raw);
+      return ERR_PTR(retval);
+    }
+
+    if (cmpxchg_release(&zq->raw, NULL, raw) == NULL)
+    {
+      atomic_long_inc(&dev->zcached);
+      return raw;
+    }
+
+    // another reader kept one first
+    scull_quantum_release(dev, raw);
+    return smp_load_acquire(&zq->raw);
+  }
+
+  if (*scratch == NULL)
+  {
+    *scratch = kvmalloc(dev->quantum, GFP_KERNEL);
+    if (*scratch == NULL)
+      return ERR_PTR(-ENOMEM);
+  }
+
+  retval = scull_zq_decompress(dev, zq, *scratch);
+  if (retval)
+    return ERR_PTR(retval);
+
+  return *scratch;
+}
+
+/*
+ * scull_quantum_unshare - give a quantum set its own copy of a shared
+ * quantum; must be called with the quantum set lock held for writing.
+ * @dev         scull device
+ * @qsetp       quantum set holding the quantum
+ * @qindx       index of the quantum in @qsetp
+ *
+ * The last user takes the buffer over, the others copy it.
+ *
+ * Return:
+ * address of the raw quantum on success or NULL on error.
+ */
+
+static void * scull_quantum_unshare(struct scull_dev * dev, struct scull_qset * qsetp,
+                                    unsigned long qindx)
+{
+  void * data;
+  struct scull_dquantum * dq;
+
+  dq = scull_dq(qsetp->data[qindx]);
+
+  spin_lock(&dev->dedup_lock);
+  if (dq->refs == 1)
+  {
+    if (!hlist_unhashed(&dq->node))
+      hlist_del(&dq->node);
+    spin_unlock(&dev->dedup_lock);
+
+    qsetp->data[qindx] = dq->data;
+    kfree(dq);
+    return qsetp->data[qindx];
+  }
+  spin_unlock(&dev->dedup_lock);
+
+  // the contents of a shared quantum never change, no lock needed to copy
+  data = scull_quantum_alloc(dev);
+  if (data == NULL)
+    return NULL;
+
+  memcpy(data, dq->data, dev->quantum);
+  qsetp->data[qindx] = data;
+  scull_dedup_put(dev, dq, false);
+
+  scull_stat_add(dev, SCULL_STAT_QUANTUM_ALLOC, 1);
+  scull_stat_add(dev, SCULL_STAT_DEDUP_COW, 1);
+
+  return data;
+}
+
+/*
+ * scull_quantum_own - make a quantum raw and private before modifying
+ * it; must be called with the quantum set lock held for writing.
+ * @dev         scull device
+ * @qsetp       quantum set holding the quantum
+ * @qindx       index of the quantum in @qsetp, which must hold one
+ *
+ * Return:
+ * address of the raw quantum on success or NULL on error.
+ */
+
+static void * scull_quantum_own(struct scull_dev * dev, struct scull_qset * qsetp,
+                                unsigned long qindx)
+{
+  if (scull_zq_tagged(qsetp->data[qindx]))
+    return scull_quantum_inflate(dev, qsetp, qindx);
+
+  if (scull_dq_tagged(qsetp->data[qindx]))
+    return scull_quantum_unshare(dev, qsetp, qindx);
+
+  return qsetp->data[qindx];
+}
+
+/*
+ * scull_snap_preserve - hand a quantum over to the snapshot before its
+ * first change; must be called with the device lock held and the quantum
+ * set lock held for writing.
+ * @dev         scull device
+ * @qsetp       quantum set holding the quantum
+ * @qindx       index of the quantum in @qsetp
+ *
+ * The quantum becomes shared between the snapshot and the device, so the
+ * caller ends up copying it, through scull_quantum_own(). A hole is kept
+ * as a marker. Nothing is done if the snapshot already has the quantum.
+ *
+ * Return:
+ * 0 on success or -ENOMEM, the quantum being left as it was.
+ */
+
+static int scull_snap_preserve(struct scull_dev * dev, struct scull_qset * qsetp,
+                               unsigned long qindx)
+{
+  unsigned long key;
+  void * entry, * old;
+  struct scull_dquantum * dq;
+
+  if (!scull_snap_attached(dev))
+    return 0;
+
+  key = qsetp->item * dev->qset + qindx;
+  if (xa_load(&dev->snap->saved, key) != NULL)
+    return 0;
+
+  dq = NULL;
+  entry = xa_mk_value(0);
+
+  if ((qsetp->data != NULL) && (qsetp->data[qindx] != NULL))
+  {
+    // the snapshot holds raw quanta only, the worker never sees them
+    if (scull_quantum_inflate(dev, qsetp, qindx) == NULL)
+      return -ENOMEM;
+
+    if (scull_dq_tagged(qsetp->data[qindx]))
+    {
+      dq = scull_dq(qsetp->data[qindx]);
+
+      spin_lock(&dev->dedup_lock);
+      dq->refs++;
+      dq->snapped = true;
+      spin_unlock(&dev->dedup_lock);
+    }
+    else
+    {
+      dq = kmalloc(sizeof(struct scull_dquantum), GFP_KERNEL_ACCOUNT);
+      if (dq == NULL)
+        return -ENOMEM;
+
+      // shared, but not in the dedup table: its contents are not settled
+      INIT_HLIST_NODE(&dq->node);
+      dq->hash = 0;
+      dq->refs = 2;
+      dq->snapped = true;
+      dq->data = qsetp->data[qindx];
+      qsetp->data[qindx] = (void *) ((unsigned long) dq | SCULL_DQ_TAG);
+    }
+
+    entry = dq;
+  }
+
+  // the quantum set lock keeps anyone else from saving the same quantum
+  old = xa_cmpxchg(&dev->snap->saved, key, NULL, entry, GFP_KERNEL_ACCOUNT);
+  if (old != NULL)
+  {
+    if (dq != NULL)
+      scull_dedup_put(dev, dq, true);
+    return -ENOMEM;
+  }
+
+  scull_stat_add(dev, SCULL_STAT_SNAP_SAVED, 1);
+
+  return 0;
+}
+
+/*
+ * scull_dedup_table - the dedup table of a device, allocated on first use
+ * @dev         scull device
+ *
+ * Return:
+ * the table or NULL if there is no memory for it.
+ */
+
+static struct hlist_head * scull_dedup_table(struct scull_dev * dev)
+{
+  struct hlist_head * table;
+
+  table = smp_load_acquire(&dev->dedup);
+  if (table != NULL)
+    return table;
+
+  table = kvcalloc(1U << SCULL_DEDUP_BITS, sizeof(struct hlist_head), GFP_KERNEL);
+  if (table == NULL)
+    return NULL;
+
+  // another writer may have won the race, its table is as good
+  if (cmpxchg_release(&dev->dedup, NULL, table) != NULL)
+  {
+    kvfree(table);
+    table = smp_load_acquire(&dev->dedup);
+  }
+
+  return table;
+}
+
+/*
+ * scull_dedup_insert - share a quantum written whole with an identical
+ * one, or make it available for sharing; must be called with the quantum
+ * set lock held for writing.
+ * @dev         scull device, not using page quanta
+ * @qsetp       quantum set holding the quantum
+ * @qindx       index of the quantum in @qsetp, a raw one
+ */
+
+static void scull_dedup_insert(struct scull_dev * dev, struct scull_qset * qsetp,
+                               unsigned long qindx)
+{
+  u64 hash;
+  void * data;
+  struct hlist_head * table, * bucket;
+  struct scull_dquantum * dq, * new;
+  bool saved;
+
+  table = scull_dedup_table(dev);
+  if (table == NULL)
+    return;
+
+  new = kmalloc(sizeof(struct scull_dquantum), GFP_KERNEL_ACCOUNT);
+  if (new == NULL)
+    return;
+
+  data = qsetp->data[qindx];
+  hash = xxh64(data, dev->quantum, 0);
+  bucket = table + (hash & ((1U << SCULL_DEDUP_BITS) - 1));
+
+  spin_lock(&dev->dedup_lock);
+  hlist_for_each_entry(dq, bucket, node)
+  {
+    if ((dq->hash == hash) && (memcmp(dq->data, data, dev->quantum) == 0))
+    {
+      // a quantum only the snapshot still holds is not shared with a slot yet
+      saved = (dq->refs > dq->snapped);
+      dq->refs++;
+      spin_unlock(&dev->dedup_lock);
+
+      qsetp->data[qindx] = (void *) ((unsigned long) dq | SCULL_DQ_TAG);
+      scull_quantum_free(dev, data);
+      kfree(new);
+
+      if (saved)
+        atomic_long_inc(&dev->dedup_saved);
+      scull_stat_add(dev, SCULL_STAT_DEDUP_HITS, 1);
+      return;
+    }
+  }
+
+  new->hash = hash;
+  new->refs = 1;
+  new->snapped = false;
+  new->data = data;
+  hlist_add_head(&new->node, bucket);
+  spin_unlock(&dev->dedup_lock);
+
+  qsetp->data[qindx] = (void *) ((unsigned long) new | SCULL_DQ_TAG);
+  scull_stat_add(dev, SCULL_STAT_DEDUP_MISSES, 1);
+}
+
+/*
+ * scull_quantum_settle - drop a quantum just written if it only holds
+ * zeros, otherwise share it if it can be; must be called with the quantum
+ * set lock held for writing.
+ * @dev         scull device
+ * @qsetp       quantum set holding the quantum
+ * @qindx       index of the quantum in @qsetp, a raw one
+ * @off         start of the part of the quantum that may not be zero
+ * @len         length of that part
+ * @whole       the quantum was written whole
+ *
+ * memchr_inv() checks a word at a time and stops at the first non-zero
+ * one, so data pays for a few words only.
+ */
+
+static void scull_quantum_settle(struct scull_dev * dev, struct scull_qset * qsetp,
+                                 unsigned long qindx, unsigned long off, size_t len,
+                                 bool whole)
+{
+  void * data;
+
+  data = qsetp->data[qindx];
+
+  if (memchr_inv(data + off, 0, len) == NULL)
+  {
+    // a page mapped somewhere has to stay, the mapping would go stale
+    if (!scull_quantum_idle(dev, data))
+      return;
+
+    scull_quantum_free(dev, data);
+    qsetp->data[qindx] = NULL;
+    scull_stat_add(dev, SCULL_STAT_ZERO_ELIDED, 1);
+    return;
+  }
+
+  if (whole && READ_ONCE(scull_dedup) && !SCULL_PAGE_QUANTA(dev))
+    scull_dedup_insert(dev, qsetp, qindx);
+}
+
+/*
+ * scull_qset_fill - make sure a quantum set has its pointer array and
+ * the quantum at @qindx; must be called with the quantum set lock held
+ * for writing.
+ * @dev         scull device
+ * @qsetp       quantum set returned by scull_follow()
+ * @qindx       index of the quantum in @qsetp
+ * @fresh       set if the quantum was just allocated (its contents are
+ *              undefined unless it is page-backed)
+ *
+ * A compressed quantum is inflated and a shared one copied, the caller is
+ * about to write to it. The snapshot of the device, if any, keeps what
+ * was there first.
+ *
+ * Return:
+ * address of the quantum on success or NULL on error.
+ */
+
+void * scull_qset_fill(struct scull_dev * dev, struct scull_qset * qsetp,
+                       unsigned long qindx, bool * fresh)
+{
+  *fresh = false;
+  qsetp->packed = false;
+
+  if (scull_snap_preserve(dev, qsetp, qindx))
+    return NULL;
+
+  if (qsetp->data == NULL)
+  {
+    qsetp->data = kmem_cache_zalloc(dev->qptr_cache, GFP_KERNEL_ACCOUNT);
+    if (qsetp->data == NULL)
+      return NULL;
+  }
+
+  if (qsetp->data[qindx] == NULL)
+  {
+    qsetp->data[qindx] = scull_quantum_alloc(dev);
+    *fresh = (qsetp->data[qindx] != NULL);
+    if (*fresh)
+      scull_stat_add(dev, SCULL_STAT_QUANTUM_ALLOC, 1);
+  }
+  else
+  {
+    return scull_quantum_own(dev, qsetp, qindx);
+  }
+
+  return qsetp->data[qindx];
+}
+
+/*
+ * scull_read_iter - read data from the device
+ * @iocb:           kernel I/O control block, carries the file and the offset
+ * @to:             destination iterator (userspace or kernel buffers)
+ *
+ * The whole request is served under one lock hold, walking across quanta
+ * and quantum sets until @to is full or the end of data is reached. Holes
+ * (quanta never written or punched out) read back as zeros. Reads
+ * never modify the device, so they only take the device lock and each
+ * quantum set lock for reading, and any number of them run side by side.
+ * A compressed quantum is decompressed into a scratch buffer and stays
+ * compressed: a read must not fail for want of room under the memory cap.
+ *
+ * Return:
+ * number of bytes read on success or appropriate errno value on error.
+ */
+
+ssize_t scull_read_iter(struct kiocb * iocb, struct iov_iter * to)
+{
+  u64 start, elapsed;
+  unsigned int quantum, qset;
+  unsigned long item, qindx, qoff, quanta;
+  size_t count, asked, chunk, copied;
+  loff_t pos, first, size;
+  ssize_t retval;
+  void * src, * scratch;
+  struct scull_file * sf;
+  struct scull_dev * dev;
+  struct scull_qset * qsetp;
+
+  sf = iocb->ki_filp->private_data;
+  dev = sf->dev;
+  pos = iocb->ki_pos;
+  count = iov_iter_count(to);
+  first = pos;
+  asked = count;
+  retval = 0;
+  quanta = 0;
+  scratch = NULL;
+  start = ktime_get_ns();
+
+  if (scull_lock_read(dev))
+    return -ERESTARTSYS;
+
+  // the geometry only changes under the device lock held for writing
+  quantum = dev->quantum;
+  qset = dev->qset;
+
+  size = atomic_long_read(&dev->size);
+  if (pos >= size)
+    goto done;
+  if (count > (size_t) (size - pos))
+    count = size - pos;
+
+  // resume from the cursor or look up the quantum set, reads never allocate one
+  qsetp = scull_cursor_load(sf, pos, &item, &qindx, &qoff);
+  if (qsetp == NULL)
+  {
+    scull_stat_add(dev, SCULL_STAT_FOLLOW, 1);
+    qsetp = xa_load(&dev->index->qsets, item);
+  }
+  if (qsetp != NULL)
+    scull_qset_lock_read(dev, qsetp);
+
+  while (count > 0)
+  {
+    // read only up to the end of this quantum, then move to the next one
+    chunk = min_t(size_t, count, quantum - qoff);
+    quanta++;
+
+    if ((qsetp == NULL) || (qsetp->data == NULL) || (qsetp->data[qindx] == NULL))
+    {
+      copied = iov_iter_zero(chunk, to);
+    }
+    else
+    {
+      src = scull_quantum_read(dev, qsetp->data[qindx], &scratch, true);
+      if (IS_ERR(src))
+      {
+        if (retval == 0)
+          retval = PTR_ERR(src);
+        break;
+      }
+      copied = copy_to_iter(src + qoff, chunk, to);
+    }
+
+    pos += copied;
+    retval += copied;
+    count -= copied;
+    qoff += copied;
+
+    if (copied < chunk)
+    {
+      if (retval == 0)
+        retval = -EFAULT;
+      break;
+    }
+
+    if (qoff == quantum)
+    {
+      qoff = 0;
+      if (++qindx == qset)
+      {
+        qindx = 0;
+        if (qsetp != NULL)
+          up_read(&qsetp->rwsem);
+        scull_stat_add(dev, SCULL_STAT_FOLLOW, 1);
+        qsetp = xa_load(&dev->index->qsets, ++item);
+        if (qsetp != NULL)
+          scull_qset_lock_read(dev, qsetp);
+      }
+    }
+  }
+
+  scull_cursor_store(sf, pos, item, qindx, qoff, qsetp);
+
+  if (qsetp != NULL)
+    up_read(&qsetp->rwsem);
+
+  iocb->ki_pos = pos;
+
+done:
+  up_read(&dev->rwsem);
+  kvfree(scratch);
+
+  if (retval >= 0)
+  {
+    scull_stat_add(dev, SCULL_STAT_READ_OPS, 1);
+    scull_stat_add(dev, SCULL_STAT_READ_BYTES, retval);
+  }
+  elapsed = ktime_get_ns() - start;
+  scull_lat_record(dev, SCULL_LAT_READ, elapsed);
+  trace_scull_read(dev, first, asked, retval, quanta, elapsed);
+
+  return retval;
+}
+
+/*
+ * scull_log_full - check whether the ring of appends in flight is full
+ * @log         tail of the device
+ */
+
+static bool scull_log_full(struct scull_log * log)
+{
+  bool full;
+
+  spin_lock(&log->lock);
+  full = (log->reserved - log->landed >= SCULL_LOG_SLOTS);
+  spin_unlock(&log->lock);
+
+  return full;
+}
+
+/*
+ * scull_log_reserve - take room for an append at the tail of the device;
+ * must be called with the device lock held.
+ * @dev         scull device
+ * @count       bytes to append
+ * @seq         number of the append, for scull_log_commit()
+ * @pos         start of the room reserved
+ * @item        item number of the quantum set holding @pos
+ * @qindx       index of the quantum in that set
+ * @qoff        offset in that quantum
+ *
+ * The tail starts out at the device size after a trim, and from then on
+ * follows the reservations. A write past it without O_APPEND moves it to
+ * the new size. With the ring full, this waits for the oldest append in
+ * flight to land, unless a signal comes first: nothing is reserved then.
+ *
+ * Return:
+ * the quantum set holding @pos if it is the one the last append stopped
+ * in, otherwise NULL (the caller looks it up from @item), or
+ * ERR_PTR(-ERESTARTSYS) if the wait was interrupted.
+ */
+
+static struct scull_qset * scull_log_reserve(struct scull_dev * dev, size_t count,
+                                             unsigned long * seq, loff_t * pos,
+                                             unsigned long * item, unsigned long * qindx,
+                                             unsigned long * qoff)
+{
+  unsigned long tail, slot;
+  struct scull_log * log;
+  struct scull_qset * qsetp;
+
+  log = &dev->log;
+
+  spin_lock(&log->lock);
+  while (log->reserved - log->landed >= SCULL_LOG_SLOTS)
+  {
+    spin_unlock(&log->lock);
+    scull_stat_add(dev, SCULL_STAT_LOG_WAITS, 1);
+    // the device lock is held, trims and snapshots must not wait for a stuck appender
+    if (wait_event_interruptible(log->wait, !scull_log_full(log)))
+      return ERR_PTR(-ERESTARTSYS);
+    spin_lock(&log->lock);
+  }
+
+  // a trim ran since the last append, none can be in flight
+  if (log->gen != dev->gen)
+  {
+    log->end = 0;
+    log->qset = NULL;
+    log->gen = dev->gen;
+  }
+
+  *pos = max_t(loff_t, log->end, atomic_long_read(&dev->size));
+  log->end = *pos + count;
+
+  *seq = log->reserved++;
+  slot = *seq % SCULL_LOG_SLOTS;
+  log->ends[slot] = log->end;
+  log->done[slot] = false;
+
+  tail = log->item;
+  qsetp = log->qset;
+  spin_unlock(&log->lock);
+
+  scull_locate(dev, *pos, item, qindx, qoff);
+
+  if ((qsetp == NULL) || (tail != *item))
+    return NULL;
+
+  scull_stat_add(dev, SCULL_STAT_CURSOR_HITS, 1);
+
+  return qsetp;
+}
+
+/*
+ * scull_log_commit - mark an append as landed; must be called with the
+ * device lock held, and no quantum set lock.
+ * @dev         scull device
+ * @seq         number of the append, from scull_log_reserve()
+ * @end         end of the data actually written
+ * @item        item number of @qsetp
+ * @qsetp       quantum set holding @end, may be NULL
+ *
+ * Room left unused goes back if nobody reserved after it, otherwise it
+ * reads as a hole. The size only covers the append once the earlier ones
+ * have landed too: if they have not, the last of them to land publishes
+ * this one as well. Nobody waits on anybody here.
+ */
+
+static void scull_log_commit(struct scull_dev * dev, unsigned long seq, loff_t end,
+                             unsigned long item, struct scull_qset * qsetp)
+{
+  loff_t size;
+  bool published;
+  struct scull_log * log;
+
+  log = &dev->log;
+  size = 0;
+  published = false;
+
+  spin_lock(&log->lock);
+  if (seq + 1 == log->reserved)
+  {
+    log->end = end;
+    log->ends[seq % SCULL_LOG_SLOTS] = end;
+  }
+  log->done[seq % SCULL_LOG_SLOTS] = true;
+
+  while ((log->landed != log->reserved) && log->done[log->landed % SCULL_LOG_SLOTS])
+  {
+    size = log->ends[log->landed % SCULL_LOG_SLOTS];
+    log->landed++;
+    published = true;
+  }
+
+  if ((qsetp != NULL) && ((log->qset == NULL) || (item >= log->item)))
+  {
+    log->item = item;
+    log->qset = qsetp;
+  }
+  spin_unlock(&log->lock);
+
+  if (!published)
+    return;
+
+  scull_size_extend(dev, size);
+
+  if (wq_has_sleeper(&log->wait))
+    wake_up_all(&log->wait);
+}
+
+/*
+ * scull_write_iter - write data to the device
+ * @iocb:           kernel I/O control block, carries the file and the offset
+ * @from:           source iterator (userspace or kernel buffers)
+ *
+ * Like scull_read_iter(), the whole request is served under one hold of
+ * the device lock, taken for reading: writers only exclude each other on
+ * the quantum set they are writing to, so writers to different regions of
+ * the device run in parallel. Quantum sets and quanta are allocated as the
+ * write reaches them. Appends (O_APPEND or "scull_log") start at the tail
+ * instead of the file offset, see scull_log_reserve().
+ *
+ * Return:
+ * number of bytes written on success or appropriate errno value on error.
+ */
+
+ssize_t scull_write_iter(struct kiocb * iocb, struct iov_iter * from)
+{
+  u64 start, elapsed;
+  unsigned int quantum, qset;
+  unsigned long item, qindx, qoff, quanta, seq;
+  size_t count, asked, chunk, copied;
+  loff_t pos, first;
+  ssize_t retval;
+  bool fresh, append;
+  char * data;
+  struct scull_file * sf;
+  struct scull_dev * dev;
+  struct scull_qset * qsetp;
+
+  sf = iocb->ki_filp->private_data;
+  dev = sf->dev;
+  pos = iocb->ki_pos;
+  count = iov_iter_count(from);
+  first = pos;
+  asked = count;
+  retval = 0;
+  quanta = 0;
+  append = (iocb->ki_flags & IOCB_APPEND) || READ_ONCE(scull_log);
+  start = ktime_get_ns();
+
+  if (scull_lock_read(dev))
+    return -ERESTARTSYS;
+
+  // the geometry only changes under the device lock held for writing
+  quantum = dev->quantum;
+  qset = dev->qset;
+
+  // resume from the tail or the cursor, the loop looks the quantum set up otherwise
+  if (append)
+  {
+    qsetp = scull_log_reserve(dev, count, &seq, &pos, &item, &qindx, &qoff);
+    if (IS_ERR(qsetp))
+    {
+      up_read(&dev->rwsem);
+      return PTR_ERR(qsetp);
+    }
+    first = pos;
+  }
+  else
+  {
+    qsetp = scull_cursor_load(sf, pos, &item, &qindx, &qoff);
+  }
+  if (qsetp != NULL)
+    scull_qset_lock_write(dev, qsetp);
+
+  while (count > 0)
+  {
+    // find (or allocate) the quantum set for that position
+    if (qsetp == NULL)
+    {
+      qsetp = scull_follow(dev, item);
+      if (qsetp == NULL)
+        goto nomem;
+
+      scull_qset_lock_write(dev, qsetp);
+    }
+
+    data = scull_qset_fill(dev, qsetp, qindx, &fresh);
+    if (data == NULL)
+      goto nomem;
+
+    // write only up to the end of this quantum, then move to the next one
+    chunk = min_t(size_t, count, quantum - qoff);
+    quanta++;
+    copied = copy_from_iter(data + qoff, chunk, from);
+
+    // whatever this write does not cover of a new quantum must read as a hole
+    if (fresh && !SCULL_PAGE_QUANTA(dev))
+    {
+      memset(data, 0, qoff);
+      memset(data + qoff + copied, 0, quantum - qoff - copied);
+    }
+
+    // mappings of the hole show the zero page, they have to fault the quantum in
+    if (fresh && SCULL_PAGE_QUANTA(dev))
+      unmap_mapping_range(iocb->ki_filp->f_mapping, pos - qoff, quantum, 0);
+
+    // all the non-zero bytes of a quantum are known when it is new or written whole
+    if ((copied == chunk) && (fresh || (chunk == quantum)))
+      scull_quantum_settle(dev, qsetp, qindx, fresh ? qoff : 0, fresh ? chunk : quantum,
+                           chunk == quantum);
+
+    pos += copied;
+    retval += copied;
+    count -= copied;
+    qoff += copied;
+
+    if (copied < chunk)
+    {
+      if (retval == 0)
+        retval = -EFAULT;
+      goto done;
+    }
+
+    if (qoff == quantum)
+    {
+      qoff = 0;
+      if (++qindx == qset)
+      {
+        qindx = 0;
+        item++;
+        up_write(&qsetp->rwsem);
+        qsetp = NULL;
+      }
+    }
+  }
+
+  goto done;
+
+nomem:
+  // report what made it in, the error only if nothing did
+  if (retval == 0)
+    retval = scull_mem_full(dev) ? -ENOSPC : -ENOMEM;
+
+done:
+  scull_cursor_store(sf, pos, item, qindx, qoff, qsetp);
+
+  if (qsetp != NULL)
+    up_write(&qsetp->rwsem);
+
+  iocb->ki_pos = pos;
+  if (append)
+    scull_log_commit(dev, seq, pos, item, qsetp);
+  else
+    scull_size_extend(dev, pos);
+
+  up_read(&dev->rwsem);
+
+  if (retval >= 0)
+  {
+    scull_stat_add(dev, SCULL_STAT_WRITE_OPS, 1);
+    scull_stat_add(dev, SCULL_STAT_WRITE_BYTES, retval);
+  }
+  elapsed = ktime_get_ns() - start;
+  scull_lat_record(dev, SCULL_LAT_WRITE, elapsed);
+  trace_scull_write(dev, first, asked, retval, quanta, elapsed);
+
+  return retval;
+}
+
+/*
+ * scull_quantum_present - check whether a quantum holds data
+ * @qsetp       quantum set, may be NULL
+ * @qindx       index of the quantum in @qsetp
+ */
+
+static bool scull_quantum_present(struct scull_qset * qsetp, unsigned long qindx)
+{
+  bool present;
+
+  if (qsetp == NULL)
+    return false;
+
+  down_read(&qsetp->rwsem);
+  present = (qsetp->data != NULL) && (qsetp->data[qindx] != NULL);
+  up_read(&qsetp->rwsem);
+
+  return present;
+}
+
+/*
+ * scull_seek_hole_data - find the next data or hole at or after an offset;
+ * must be called with the device lock held.
+ * @dev         scull device
+ * @off         starting offset
+ * @hole        look for a hole (SEEK_HOLE) rather than data (SEEK_DATA)
+ *
+ * Holes have quantum granularity. The end of the device counts as a hole.
+ * Missing quantum sets are skipped whole, so sparse devices are cheap to
+ * scan for data.
+ *
+ * Return:
+ * the offset found or -ENXIO if @off is past the end (or there is no data
+ * after it).
+ */
+
+loff_t scull_seek_hole_data(struct scull_dev * dev, loff_t off, bool hole)
+{
+  unsigned long item, next, qindx, qoff, itemsize;
+  loff_t pos, size;
+  struct scull_qset * qsetp;
+
+  size = atomic_long_read(&dev->size);
+  if ((off < 0) || (off >= size))
+    return -ENXIO;
+
+  itemsize = (unsigned long) dev->quantum * dev->qset;
+  scull_locate(dev, off, &item, &qindx, &qoff);
+  pos = off;
+
+  while (pos < size)
+  {
+    qsetp = xa_load(&dev->index->qsets, item);
+
+    if ((qsetp == NULL) && !hole)
+    {
+      // jump straight to the next quantum set there is
+      next = item;
+      if (xa_find(&dev->index->qsets, &next, ULONG_MAX, XA_PRESENT) == NULL)
+        break;
+
+      item = next;
+      qindx = 0;
+      pos = (loff_t) item * itemsize;
+      continue;
+    }
+
+    if (scull_quantum_present(qsetp, qindx) != hole)
+      return pos;
+
+    // move to the start of the next quantum
+    pos += dev->quantum - qoff;
+    qoff = 0;
+    if (++qindx == dev->qset)
+    {
+      qindx = 0;
+      item++;
+    }
+  }
+
+  return hole ? size : -ENXIO;
+}
+
+/*
+ * scull_punch_range - release the quanta of a range of the device and
+ * zero the partial quanta at its edges; must be called with the device
+ * lock held.
+ * @dev         scull device
+ * @off         start of the range
+ * @len         length of the range
+ *
+ * Released quanta go back to the pool and read as holes afterwards. A
+ * pointer array left with no quanta is released too; the quantum set
+ * itself stays in the index, as other I/O may be holding it.
+ *
+ * Return:
+ * 0 on success or -ENOMEM if a compressed quantum at an edge could not be
+ * inflated, or one could not be kept for the snapshot, the range being
+ * punched up to there.
+ */
+
+int scull_punch_range(struct scull_dev * dev, loff_t off, loff_t len)
+{
+  int retval;
+  unsigned long item, qindx, qoff, i;
+  size_t chunk;
+  loff_t end;
+  struct scull_qset * qsetp;
+  void ** data;
+
+  end = off + len;
+  retval = 0;
+  scull_locate(dev, off, &item, &qindx, &qoff);
+
+  while ((off < end) && (retval == 0))
+  {
+    qsetp = xa_find(&dev->index->qsets, &item, ULONG_MAX, XA_PRESENT);
+    if (qsetp == NULL)
+      return 0;
+
+    // the range may have skipped a few missing quantum sets
+    if ((loff_t) item * dev->quantum * dev->qset > off)
+    {
+      off = (loff_t) item * dev->quantum * dev->qset;
+      qindx = 0;
+      qoff = 0;
+      if (off >= end)
+        return 0;
+    }
+
+    down_write(&qsetp->rwsem);
+
+    for (; (qindx < dev->qset) && (off < end); qindx++, qoff = 0)
+    {
+      chunk = min_t(loff_t, end - off, dev->quantum - qoff);
+      off += chunk;
+
+      if ((qsetp->data == NULL) || (qsetp->data[qindx] == NULL))
+        continue;
+
+      if (scull_snap_preserve(dev, qsetp, qindx))
+      {
+        retval = -ENOMEM;
+        break;
+      }
+
+      if (chunk == dev->quantum)
+      {
+        scull_quantum_free(dev, qsetp->data[qindx]);
+        qsetp->data[qindx] = NULL;
+      }
+      else if (scull_quantum_own(dev, qsetp, qindx) != NULL)
+      {
+        memset(qsetp->data[qindx] + qoff, 0, chunk);
+      }
+      else
+      {
+        retval = -ENOMEM;
+        break;
+      }
+    }
+
+    data = qsetp->data;
+    for (i = 0; (data != NULL) && (i < dev->qset) && (data[i] == NULL); i++)
+      ;
+    if ((data != NULL) && (i == dev->qset))
+    {
+      kmem_cache_free(dev->qptr_cache, data);
+      qsetp->data = NULL;
+    }
+
+    up_write(&qsetp->rwsem);
+
+    qindx = 0;
+    item++;
+  }
+
+  return retval;
+}
+
+/*
+ * scull_snap_create - take a snapshot of the device; must be called with
+ * the device lock held for writing.
+ * @dev         scull device
+ *
+ * The snapshot shares the index, nothing is copied until the device is
+ * written to (see scull_snap_preserve()).
+ *
+ * Return:
+ * the snapshot on success, ERR_PTR(-EOPNOTSUPP) with page quanta,
+ * ERR_PTR(-EBUSY) if the device already has a snapshot or ERR_PTR(-ENOMEM).
+ */
+
+struct scull_snap * scull_snap_create(struct scull_dev * dev)
+{
+  struct scull_snap * snap;
+
+  // mmap() writes go straight to the quanta, there is no copying them first
+  if (SCULL_PAGE_QUANTA(dev))
+    return ERR_PTR(-EOPNOTSUPP);
+
+  if (dev->snap != NULL)
+    return ERR_PTR(-EBUSY);
+
+  snap = kmalloc(sizeof(struct scull_snap), GFP_KERNEL_ACCOUNT);
+  if (snap == NULL)
+    return ERR_PTR(-ENOMEM);
+
+  snap->dev = dev;
+  snap->index = dev->index;
+  xa_init(&snap->saved);
+  snap->size = atomic_long_read(&dev->size);
+
+  dev->snap = snap;
+
+  return snap;
+}
+
+/*
+ * scull_snap_release - drop a snapshot
+ * @snap        the snapshot, from scull_snap_create()
+ *
+ * The quanta kept for it are released, and so is the index it shares
+ * once the device has been trimmed away from it.
+ */
+
+void scull_snap_release(struct scull_snap * snap)
+{
+  bool attached;
+  unsigned long key;
+  void * entry;
+  struct scull_dev * dev;
+
+  dev = snap->dev;
+
+  // no writer may be saving a quantum past this point
+  down_write(&dev->rwsem);
+  attached = scull_snap_attached(dev);
+  dev->snap = NULL;
+  up_write(&dev->rwsem);
+
+  xa_for_each(&snap->saved, key, entry)
+  {
+    if (!xa_is_value(entry))
+      scull_dedup_put(dev, entry, true);
+  }
+  xa_destroy(&snap->saved);
+
+  if (!attached)
+    queue_work(scull_wq, &snap->index->free_work);
+
+  kfree(snap);
+}
+
+/*
+ * scull_snap_read_iter - read data from a snapshot
+ * @iocb:           kernel I/O control block, carries the file and the offset
+ * @to:             destination iterator (userspace or kernel buffers)
+ *
+ * Each quantum is read from the snapshot if it kept one, otherwise from
+ * the index, which still holds it as it was. The quantum set lock makes
+ * the two lookups agree with a writer saving the quantum meanwhile. Reads
+ * of a snapshot do not count as uses of the device quanta, and since they
+ * run without the device lock they leave the index as it is: compressed
+ * quanta are decompressed into a scratch buffer.
+ *
+ * Return:
+ * number of bytes read on success or appropriate errno value on error.
+ */
+
+ssize_t scull_snap_read_iter(struct kiocb * iocb, struct iov_iter * to)
+{
+  unsigned long item, qindx, qoff;
+  size_t count, chunk, copied;
+  loff_t pos;
+  ssize_t retval;
+  void * entry, * src, * scratch;
+  struct scull_snap * snap;
+  struct scull_dev * dev;
+  struct scull_qset * qsetp;
+
+  snap = iocb->ki_filp->private_data;
+  dev = snap->dev;
+  pos = iocb->ki_pos;
+  count = iov_iter_count(to);
+  retval = 0;
+  scratch = NULL;
+
+  if (pos >= snap->size)
+    return 0;
+  if (count > (size_t) (snap->size - pos))
+    count = snap->size - pos;
+
+  while (count > 0)
+  {
+    scull_locate(dev, pos, &item, &qindx, &qoff);
+    chunk = min_t(size_t, count, dev->quantum - qoff);
+
+    qsetp = xa_load(&snap->index->qsets, item);
+    if (qsetp != NULL)
+      down_read(&qsetp->rwsem);
+
+    entry = xa_load(&snap->saved, item * dev->qset + qindx);
+
+    if (entry != NULL)
+      src = xa_is_value(entry) ? NULL : ((struct scull_dquantum *) entry)->data;
+    else if ((qsetp != NULL) && (qsetp->data != NULL) && (qsetp->data[qindx] != NULL))
+      // a snapshot reader takes no device memory, it only uses the copies there are
+      src = scull_quantum_read(dev, qsetp->data[qindx], &scratch, false);
+    else
+      src = NULL;
+
+    if (IS_ERR(src))
+    {
+      up_read(&qsetp->rwsem);
+      if (retval == 0)
+        retval = PTR_ERR(src);
+      break;
+    }
+
+    if (src == NULL)
+      copied = iov_iter_zero(chunk, to);
+    else
+      copied = copy_to_iter(src + qoff, chunk, to);
+
+    if (qsetp != NULL)
+      up_read(&qsetp->rwsem);
+
+    pos += copied;
+    retval += copied;
+    count -= copied;
+
+    if (copied < chunk)
+    {
+      if (retval == 0)
+        retval = -EFAULT;
+      break;
+    }
+  }
+
+  iocb->ki_pos = pos;
+  kvfree(scratch);
+
+  return retval;
+}
+
+/*
+ * scull_qset_evict - release the idle quanta of a quantum set; must be
+ * called with the quantum set lock held for writing.
+ * @dev         scull device
+ * @qsetp       the quantum set
+ *
+ * Quanta go straight back to the allocator, not to the pool: the point
+ * is to give memory back. Pages still mapped or spliced somewhere stay.
+ *
+ * Return:
+ * number of quanta released.
+ */
+
+static unsigned long scull_qset_evict(struct scull_dev * dev, struct scull_qset * qsetp)
+{
+  unsigned long i, freed;
+  bool busy;
+  void ** data;
+
+  data = qsetp->data;
+  if (data == NULL)
+    return 0;
+
+  freed = 0;
+  busy = false;
+
+  for (i = 0; i < dev->qset; i++)
+  {
+    if (data[i] == NULL)
+      continue;
+
+    if (!scull_quantum_idle(dev, data[i]))
+    {
+      busy = true;
+      continue;
+    }
+
+    scull_quantum_release(dev, data[i]);
+    data[i] = NULL;
+    freed++;
+  }
+
+  if (!busy)
+  {
+    kmem_cache_free(dev->qptr_cache, data);
+    qsetp->data = NULL;
+  }
+
+  scull_stat_add(dev, SCULL_STAT_QUANTUM_FREE, freed);
+  scull_stat_add(dev, SCULL_STAT_EVICTED, freed);
+
+  return freed;
+}
+
+/*
+ * scull_evict - drop cold quanta of the device; must be called with the
+ * device lock held.
+ * @dev         scull device
+ * @nr          number of quanta wanted
+ *
+ * The scan resumes where the previous one stopped and walks the index
+ * like a clock hand: a quantum set used since the hand last passed
+ * loses its SCULL_REF_EVICT bit and is kept, any other one has all its idle
+ * quanta released. Busy quantum sets are skipped rather than waited for,
+ * as this also runs from the shrinker and from writers holding another
+ * quantum set lock. Two laps at most, the first may only clear bits.
+ * Nothing is evicted while a snapshot shares the index: the snapshot would
+ * lose the data too.
+ *
+ * Return:
+ * number of quanta released, possibly more than @nr.
+ */
+
+unsigned long scull_evict(struct scull_dev * dev, unsigned long nr)
+{
+  unsigned int laps;
+  unsigned long item, freed;
+  struct scull_qset * qsetp;
+
+  if (scull_snap_attached(dev))
+    return 0;
+
+  item = READ_ONCE(dev->evict_hand);
+  freed = 0;
+  laps = 0;
+
+  while ((freed < nr) && (laps < 2))
+  {
+    qsetp = xa_find(&dev->index->qsets, &item, ULONG_MAX, XA_PRESENT);
+    if (qsetp == NULL)
+    {
+      item = 0;
+      laps++;
+      continue;
+    }
+
+    if (READ_ONCE(qsetp->referenced) & SCULL_REF_EVICT)
+    {
+      WRITE_ONCE(qsetp->referenced, READ_ONCE(qsetp->referenced) & ~SCULL_REF_EVICT);
+    }
+    else if (down_write_trylock(&qsetp->rwsem))
+    {
+      freed += scull_qset_evict(dev, qsetp);
+      up_write(&qsetp->rwsem);
+    }
+
+    item++;
+  }
+
+  WRITE_ONCE(dev->evict_hand, item);
+
+  return freed;
+}
+
+/*
+ * scull_qset_compress - compress the raw quanta of a quantum set; must be
+ * called with the quantum set lock held for writing.
+ * @dev         scull device, not using page quanta
+ * @qsetp       the quantum set
+ * @buf         scratch buffer, LZ4_COMPRESSBOUND(quantum) bytes
+ * @wrkmem      LZ4 work memory, LZ4_MEM_COMPRESS bytes
+ *
+ * Quanta that would not shrink by an eighth, allocator rounding included,
+ * stay raw. Quanta already compressed lose their decompressed copy.
+ */
+
+static void scull_qset_compress(struct scull_dev * dev, struct scull_qset * qsetp,
+                                char * buf, void * wrkmem)
+{
+  int len;
+  unsigned long i, max;
+  void * data;
+  struct scull_zquantum * zq;
+
+  max = dev->quantum - dev->quantum / 8;
+
+  for (i = 0; (qsetp->data != NULL) && (i < dev->qset); i++)
+  {
+    data = qsetp->data[i];
+    if ((data != NULL) && scull_zq_tagged(data))
+      scull_zq_uncache(dev, scull_zq(data));
+    if ((data == NULL) || scull_zq_tagged(data) || scull_dq_tagged(data))
+      continue;
+
+    len = LZ4_compress_default(data, buf, dev->quantum, LZ4_COMPRESSBOUND(dev->quantum),
+                               wrkmem);
+    if ((len <= 0) || (sizeof(struct scull_zquantum) + len > max))
+      continue;
+
+    zq = kmalloc(sizeof(struct scull_zquantum) + len, GFP_KERNEL_ACCOUNT | __GFP_NOWARN);
+    if (zq == NULL)
+      return;
+
+    zq->size = ksize(zq);
+    if (zq->size > max)
+    {
+      kfree(zq);
+      continue;
+    }
+
+    zq->raw = NULL;
+    zq->len = len;
+    memcpy(zq->data, buf, len);
+
+    scull_zq_account(dev, zq, 1);
+    qsetp->data[i] = (void *) ((unsigned long) zq | SCULL_ZQ_TAG);
+    scull_quantum_release(dev, data);
+
+    scull_stat_add(dev, SCULL_STAT_COMPRESSED, 1);
+  }
+
+  qsetp->packed = true;
+}
+
+/*
+ * scull_compress_work - compress the quantum sets nobody used for a
+ * whole period, then come back one period later
+ * @work:       the "compress_work" of the device
+ *
+ * Like eviction, this is a clock: a quantum set used since the last pass
+ * loses its SCULL_REF_COMPRESS bit and is kept raw. Packed quantum sets
+ * are not looked at again until they are written to, unless readers keep
+ * decompressed copies of their quanta, which go then. The device and the
+ * quantum sets are only ever trylocked, trims and reshapes flush the
+ * scull workqueue with the device lock held.
+ */
+
+static void scull_compress_work(struct work_struct * work)
+{
+  unsigned int ms;
+  unsigned long item;
+  char * buf;
+  void * wrkmem;
+  struct scull_qset * qsetp;
+  struct scull_dev * dev;
+
+  dev = container_of(to_delayed_work(work), struct scull_dev, compress_work);
+  ms = READ_ONCE(scull_compress_ms);
+
+  // turned off meanwhile, scull_compress_kick() starts it again
+  if (ms == 0)
+    return;
+
+  if (!down_read_trylock(&dev->rwsem))
+    goto again;
+
+  buf = NULL;
+  wrkmem = NULL;
+
+  // page quanta may be mapped or spliced, they stay as they are
+  if (SCULL_PAGE_QUANTA(dev) || xa_empty(&dev->index->qsets))
+    goto unlock;
+
+  buf = kvmalloc(LZ4_COMPRESSBOUND(dev->quantum), GFP_KERNEL);
+  wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+  if ((buf == NULL) || (wrkmem == NULL))
+    goto unlock;
+
+  xa_for_each(&dev->index->qsets, item, qsetp)
+  {
+    if (READ_ONCE(qsetp->referenced) & SCULL_REF_COMPRESS)
+    {
+      WRITE_ONCE(qsetp->referenced, READ_ONCE(qsetp->referenced) & ~SCULL_REF_COMPRESS);
+      continue;
+    }
+
+    if ((READ_ONCE(qsetp->packed) && (atomic_long_read(&dev->zcached) == 0)) ||
+        !down_write_trylock(&qsetp->rwsem))
+      continue;
+
+    scull_qset_compress(dev, qsetp, buf, wrkmem);
+    up_write(&qsetp->rwsem);
+
+    cond_resched();
+  }
+
+unlock:
+  kvfree(wrkmem);
+  kvfree(buf);
+  up_read(&dev->rwsem);
+
+again:
+  queue_delayed_work(scull_wq, &dev->compress_work, msecs_to_jiffies(ms));
+}
+
+/*
+ * scull_compress_kick - start, restart or stop the compression worker of a
+ * device as "scull_compress_ms" says
+ * @dev:        scull device
+ *
+ * A new period applies from now on, 0 stops the worker and waits for it.
+ */
+
+void scull_compress_kick(struct scull_dev * dev)
+{
+  unsigned int ms;
+
+  ms = READ_ONCE(scull_compress_ms);
+
+  if (ms == 0)
+    cancel_delayed_work_sync(&dev->compress_work);
+  else
+    mod_delayed_work(scull_wq, &dev->compress_work, msecs_to_jiffies(ms));
+}
+
+
+/*
+ * scull_storage_init - set up what all the devices share
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error.
+ */
+
+int scull_storage_init(void)
+{
+  scull_qset_cache = KMEM_CACHE(scull_qset, SLAB_ACCOUNT);
+  if (scull_qset_cache == NULL)
+    return -ENOMEM;
+
+  scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+  if (scull_wq == NULL)
+  {
+    kmem_cache_destroy(scull_qset_cache);
+    scull_qset_cache = NULL;
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+/*
+ * scull_storage_exit - tear down what scull_storage_init() set up, once
+ * every device went through scull_storage_dev_exit()
+ */
+
+void scull_storage_exit(void)
+{
+  // no problem if they were not created
+  if (scull_wq != NULL)
+    destroy_workqueue(scull_wq);
+  kmem_cache_destroy(scull_qset_cache);
+
+  scull_wq = NULL;
+  scull_qset_cache = NULL;
+}
+
+/*
+ * scull_storage_flush - wait for the trims and snapshot releases still
+ * freeing quanta, of all the devices
+ */
+
+void scull_storage_flush(void)
+{
+  if (scull_wq != NULL)
+    flush_workqueue(scull_wq);
+}
+
+/*
+ * scull_storage_dev_init - set up an empty device with the geometry of
+ * the module parameters
+ * @dev:        scull device, zeroed by the caller
+ *
+ * On error the device is left for scull_storage_dev_exit() to clean up.
+ *
+ * Return:
+ * 0 on success or appropriate errno value on error.
+ */
+
+int scull_storage_dev_init(struct scull_dev * dev)
+{
+  int retval;
+
+  scull_set_geometry(dev, scull_quantum, scull_qset);
+  init_rwsem(&dev->rwsem);
+  spin_lock_init(&dev->pool.lock);
+  spin_lock_init(&dev->dedup_lock);
+  spin_lock_init(&dev->log.lock);
+  init_waitqueue_head(&dev->log.wait);
+  INIT_DELAYED_WORK(&dev->compress_work, scull_compress_work);
+
+  // allocated first, freeing the index updates the statistics
+  dev->stats = alloc_percpu(struct scull_stats);
+  if (dev->stats == NULL)
+    return -ENOMEM;
+
+  dev->index = scull_index_alloc(dev);
+  if (dev->index == NULL)
+    return -ENOMEM;
+
+  retval = scull_dev_caches_get(dev);
+  if (retval)
+    return retval;
+
+  if (READ_ONCE(scull_compress_ms) != 0)
+    queue_delayed_work(scull_wq, &dev->compress_work,
+                       msecs_to_jiffies(READ_ONCE(scull_compress_ms)));
+
+  return 0;
+}
+
+/*
+ * scull_storage_dev_exit - free everything a device holds
+ * @dev:        scull device, no longer reachable by any file
+ */
+
+void scull_storage_dev_exit(struct scull_dev * dev)
+{
+  // not set up if the initialization failed early
+  if (dev->compress_work.work.func != NULL)
+    cancel_delayed_work_sync(&dev->compress_work);
+
+  // wait for the trims still in flight
+  scull_storage_flush();
+
+  if (dev->index != NULL)
+  {
+    scull_index_release(dev, dev->index);
+    kfree(dev->index);
+    dev->index = NULL;
+  }
+
+  scull_pool_drain(dev);
+  scull_dev_caches_put(dev);
+  kvfree(dev->dedup);
+  dev->dedup = NULL;
+  free_percpu(dev->stats);
+  dev->stats = NULL;
+}